@@ -2,14 +2,20 @@
 
 #include <assert.h>
 #include <limits.h>
+#include <linux/futex.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "imsm_list.h"
 #include "imsm_ppoint.h"
+#include "imsm_sdt.h"
 #include "imsm_slab.h"
-
-#define IMSM_MAX_REGISTERED 1024
+#include "imsm_sojourn.h"
+#include "imsm_stats.h"
+#include "imsm_timer.h"
 
 #define VERSION_NUMBER_BITS 12
 
@@ -29,26 +35,26 @@ union imsm_encoded_reference {
         };
 };
 
+/*
+ * Shards may register concurrently, so the list is statically
+ * allocated, and slots are claimed with an atomic increment.
+ */
 static struct {
         size_t registered;
-        struct imsm **list;
+        struct imsm *list[IMSM_MAX_REGISTERED];
 } imsm_list;
 
 static void
 imsm_register(struct imsm *imsm)
 {
+        size_t index;
 
-        if (imsm_list.list == NULL) {
-                imsm_list.list =
-                    calloc(IMSM_MAX_REGISTERED, sizeof(*imsm_list.list));
-                assert(imsm_list.list != NULL && "Static allocation failed.");
-        }
-
-        assert(imsm_list.registered + 1 < IMSM_MAX_REGISTERED &&
-            "Too many static imsm registered");
         assert(imsm->global_index == 0 && "Double registration?!");
-        imsm->global_index = ++imsm_list.registered;
-        imsm_list.list[imsm_list.registered] = imsm;
+        index = __atomic_add_fetch(&imsm_list.registered, 1, __ATOMIC_RELAXED);
+        assert(index < IMSM_MAX_REGISTERED &&
+            "Too many static imsm registered");
+        imsm->global_index = index;
+        __atomic_store_n(&imsm_list.list[index], imsm, __ATOMIC_RELEASE);
         return;
 }
 
@@ -67,16 +73,48 @@ imsm_init(struct imsm *imsm, void *arena, size_t arena_size, size_t elsize,
         imsm_slab_init(&imsm->slab, arena, arena_size, elsize,
             init_fn, deinit_fn);
         imsm->poll_fn = poll_fn;
+        /* calloc should hand us fresh zero pages for large allocations. */
+        imsm->queues = calloc(IMSM_MAX_QUEUES, sizeof(*imsm->queues));
+        assert(imsm->queues != NULL && "Static allocation failed.");
+        imsm->wake_fd = -1;
+        imsm->num_ranges = (imsm->slab.element_count + IMSM_SCAN_RANGE - 1) /
+            IMSM_SCAN_RANGE;
+        imsm->range_scans = calloc(imsm->num_ranges + 1,
+            sizeof(*imsm->range_scans));
+        assert(imsm->range_scans != NULL && "Static allocation failed.");
+        imsm->staged_ns = calloc(imsm->slab.element_count,
+            sizeof(*imsm->staged_ns));
+        assert(imsm->staged_ns != NULL && "Static allocation failed.");
         imsm_register(imsm);
         return;
 }
 
+void
+imsm_ctx_deinit(struct imsm_ctx *ctx)
+{
+
+        imsm_slab_cache_flush(ctx);
+        imsm_list_cache_deinit(&ctx->cache);
+        ctx->cache = (struct imsm_list_cache) { 0 };
+        ctx->position = (struct imsm_ppoint_record) { 0 };
+        return;
+}
+
+struct imsm *
+imsm_lookup(size_t index)
+{
+
+        if (index >= IMSM_MAX_REGISTERED)
+                return NULL;
+
+        return __atomic_load_n(&imsm_list.list[index], __ATOMIC_ACQUIRE);
+}
+
 struct imsm_ref
 imsm_refer(struct imsm_ctx *ctx, void *object)
 {
         struct imsm *imsm = ctx->imsm;
         struct imsm_ref ret = { 0 };
-        union imsm_encoded_reference encoded;
         struct imsm_entry *header;
         uintptr_t arena_base;
         size_t element_size;
@@ -97,11 +135,21 @@ imsm_refer(struct imsm_ctx *ctx, void *object)
 
         arena_base = (uintptr_t)imsm->slab.arena;
         object_index = ((uintptr_t)object - arena_base) / element_size;
+        return imsm_refer_index(imsm, object_index, header->version);
+}
+
+struct imsm_ref
+imsm_refer_index(const struct imsm *imsm, size_t object_index,
+    uint32_t version)
+{
+        union imsm_encoded_reference encoded;
+        struct imsm_ref ret;
+
         assert(object_index < (1UL << 40));
 
         encoded.global_index = imsm->global_index;
         encoded.object_index = object_index;
-        encoded.version = header->version >> 1;
+        encoded.version = version >> 1;
 
         ret.bits = encoded.bits * IMSM_ENCODING_MULTIPLIER;
         return ret;
@@ -118,7 +166,8 @@ imsm_deref_machine(struct imsm_ref ref)
             encoded.global_index >= IMSM_MAX_REGISTERED)
                 return NULL;
 
-        return imsm_list.list[encoded.global_index];
+        return __atomic_load_n(&imsm_list.list[encoded.global_index],
+            __ATOMIC_ACQUIRE);
 }
 
 inline struct imsm_entry *
@@ -150,6 +199,47 @@ imsm_deref(struct imsm_ref ref)
         return header;
 }
 
+static uint64_t
+monotonic_ns(void)
+{
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return now.tv_sec * 1000 * 1000 * 1000ULL + now.tv_nsec;
+}
+
+/*
+ * Marks `header` as pending a wake-up, without signaling `machine`.
+ */
+static void
+imsm_mark_pending(struct imsm *machine, struct imsm_entry *header)
+{
+        struct imsm_sojourn_times *times;
+        uint16_t queue_id = header->queue_id;
+
+        imsm_trace(IMSM_TRACE_NOTIFY, machine, header, queue_id);
+        /* Only the first wake-up counts until the entry's dispatched. */
+        times = __atomic_load_n(&machine->sojourn_times, __ATOMIC_RELAXED);
+        if (times != NULL && header->wakeup_pending == 0) {
+                size_t index = ((uintptr_t)header -
+                    (uintptr_t)machine->slab.arena) /
+                    machine->slab.element_size;
+
+                __atomic_store_n(&times[index].woken_at, monotonic_ns(),
+                    __ATOMIC_RELAXED);
+        }
+
+        header->wakeup_pending = 1;
+        /*
+         * Flag the queue after the entry: `imsm_stage_out` clears
+         * the flag before scanning for wake-ups.
+         */
+        if (queue_id < IMSM_MAX_QUEUES)
+                __atomic_store_n(&machine->queues[queue_id].pending,
+                    1, __ATOMIC_RELEASE);
+        return;
+}
+
 bool
 imsm_notify(struct imsm_ref ref)
 {
@@ -164,20 +254,119 @@ imsm_notify(struct imsm_ref ref)
                 return false;
 
         header = imsm_deref(ref);
-        if (header != NULL)
-                header->wakeup_pending = 1;
+        IMSM_PROBE3(notify, ref.bits, machine->global_index,
+            (header != NULL) ? header->queue_id : UINT16_MAX);
+        if (header != NULL) {
+                imsm_mark_pending(machine, header);
+                imsm_wake(machine);
+        }
 
         return true;
 }
 
-static void
+size_t
+imsm_notify_n(const struct imsm_ref *refs, size_t n)
+{
+        struct imsm *to_wake = NULL;
+        size_t ret = 0;
+
+        for (size_t i = 0; i < n; i++) {
+                struct imsm *machine;
+                struct imsm_entry *header;
+
+                if (refs[i].bits == 0) {
+                        ret++;
+                        continue;
+                }
+
+                machine = imsm_deref_machine(refs[i]);
+                if (machine == NULL)
+                        continue;
+
+                ret++;
+                header = imsm_deref(refs[i]);
+                IMSM_PROBE3(notify, refs[i].bits, machine->global_index,
+                    (header != NULL) ? header->queue_id : UINT16_MAX);
+                if (header == NULL)
+                        continue;
+
+                if (machine != to_wake && to_wake != NULL)
+                        imsm_wake(to_wake);
+
+                to_wake = machine;
+                imsm_mark_pending(machine, header);
+        }
+
+        if (to_wake != NULL)
+                imsm_wake(to_wake);
+        return ret;
+}
+
+void
+imsm_wake(struct imsm *imsm)
+{
+        int wake_fd;
+
+        /*
+         * Sleepers increment `sleepers` before checking
+         * `change_count`, and we do the opposite: at least one of us
+         * will see the other's update.
+         */
+        __atomic_add_fetch(&imsm->change_count, 1, __ATOMIC_SEQ_CST);
+
+        /*
+         * The mux disarms before polling the machine, so any change
+         * after that point writes to the eventfd again.
+         *
+         * Machines that aren't attached to a mux only pay for the
+         * first load.  Otherwise, register in `wake_users` before
+         * reloading the fd: `imsm_mux_remove` clears `wake_fd` before
+         * waiting for `wake_users` to drop to zero, so either we see
+         * -1, or it waits for our write before closing the fd.
+         */
+        wake_fd = __atomic_load_n(&imsm->wake_fd, __ATOMIC_ACQUIRE);
+        if (wake_fd >= 0) {
+                __atomic_add_fetch(&imsm->wake_users, 1, __ATOMIC_SEQ_CST);
+                wake_fd = __atomic_load_n(&imsm->wake_fd, __ATOMIC_SEQ_CST);
+                if (wake_fd >= 0 && __atomic_exchange_n(&imsm->wake_armed,
+                    1, __ATOMIC_SEQ_CST) == 0) {
+                        uint64_t one = 1;
+                        ssize_t r;
+
+                        r = write(wake_fd, &one, sizeof(one));
+                        (void)r;
+                }
+
+                __atomic_sub_fetch(&imsm->wake_users, 1, __ATOMIC_RELEASE);
+        }
+
+        if (__atomic_load_n(&imsm->sleepers, __ATOMIC_SEQ_CST) == 0)
+                return;
+
+        syscall(SYS_futex, &imsm->change_count, FUTEX_WAKE_PRIVATE, INT_MAX,
+            NULL, NULL, 0);
+        return;
+}
+
+/*
+ * Returns the number of entries staged.  If `wheel` is non-NULL,
+ * also arms the staged entries' timers, `timeout_ns` from now.
+ */
+static size_t
 imsm_stage_in(struct imsm_ctx *ctx, size_t ppoint_index,
-    void **list_in, uint64_t aux_match)
+    void **list_in, uint64_t aux_match, struct imsm_timer_wheel *wheel,
+    uint64_t timeout_ns)
 {
+        const struct imsm_slab *slab = &ctx->imsm->slab;
+        struct imsm_sojourn_times *times;
+        uint64_t now_ns = 0, deadline_ns = 0;
+        size_t num_staged = 0;
+
+        times = __atomic_load_n(&ctx->imsm->sojourn_times, __ATOMIC_RELAXED);
 
         for (size_t i = 0, n = imsm_list_size(list_in); i < n; i++) {
                 struct imsm_entry *entry;
-                size_t offset;
+                size_t index, offset;
 
                 if (list_in[i] == NULL ||
                     imsm_list_aux(list_in)[i] != aux_match)
@@ -188,21 +377,119 @@ imsm_stage_in(struct imsm_ctx *ctx, size_t ppoint_index,
 
                 offset = (char *)list_in[i] - (char *)entry;
                 assert(offset <= UINT8_MAX);
+                imsm_trace(IMSM_TRACE_STAGE_IN, ctx->imsm, entry,
+                    ppoint_index);
                 entry->queue_id = ppoint_index;
                 entry->offset = offset;
-                entry->wakeup_pending = 1;
+                if (now_ns == 0) {
+                        now_ns = monotonic_ns();
+                        deadline_ns = (timeout_ns < UINT64_MAX - now_ns)
+                            ? now_ns + timeout_ns : UINT64_MAX;
+                        /* Take the lock once for the whole list. */
+                        if (wheel != NULL)
+                                imsm_timer_lock(wheel);
+                }
+
+                /* Same expression as in `imsm_entry_of`, for CSE. */
+                index = ((uintptr_t)list_in[i] - (uintptr_t)slab->arena) /
+                    slab->element_size;
+                ctx->imsm->staged_ns[index] = now_ns;
+                if (wheel != NULL)
+                        imsm_timer_arm_locked(wheel, index, entry->version,
+                            ppoint_index, deadline_ns);
+                /* Staging in also wakes the entry up. */
+                if (times != NULL)
+                        times[index] = (struct imsm_sojourn_times) {
+                                .waiting_since = now_ns,
+                                .woken_at = now_ns,
+                        };
+                /* Publish the entry to concurrent `imsm_stage_out`s. */
+                __atomic_store_n(&entry->wakeup_pending, 1, __ATOMIC_RELEASE);
+                num_staged++;
         }
 
-        return;
+        if (wheel != NULL && num_staged > 0)
+                imsm_timer_unlock(wheel);
+        if (num_staged > 0)
+                __atomic_store_n(&ctx->imsm->queues[ppoint_index].pending,
+                    1, __ATOMIC_RELEASE);
+        return num_staged;
 }
 
+/*
+ * Dispatches the `i`th arena entry, whose wake-up for `ppoint_index`
+ * we just claimed: pushes it to `list_out` or, if `wheel` is non-NULL
+ * and the wake-up is the entry's timer, takes the entry out of the
+ * queue and pushes it to `timed_out`.  `*now_ns` caches the time for
+ * sojourn `times`, 0 until we first need it.
+ */
 static void
-imsm_stage_out(void **list_out, struct imsm_ctx *ctx, size_t ppoint_index)
+stage_out_entry(void **list_out, void **timed_out, struct imsm_ctx *ctx,
+    size_t ppoint_index, size_t i, struct imsm_timer_wheel *wheel,
+    struct imsm_sojourn_times *times, uint64_t *now_ns)
 {
         const struct imsm_slab *slab = &ctx->imsm->slab;
-        const uintptr_t arena_base = (uintptr_t)slab->arena;
+        struct imsm_entry *entry;
+        bool success;
+        void *member;
+
+        entry = (void *)((uintptr_t)slab->arena + i * slab->element_size);
+        member = (char *)entry + entry->offset;
+        if (wheel != NULL && imsm_timer_consume_expired(wheel, i)) {
+                imsm_trace(IMSM_TRACE_TIMEOUT, ctx->imsm, entry, UINT16_MAX);
+                entry->queue_id = UINT16_MAX;
+                success = imsm_list_push(timed_out, member, 0);
+                assert(success);
+                return;
+        }
+
+        imsm_trace(IMSM_TRACE_WAKE_OUT, ctx->imsm, entry, ppoint_index);
+        if (times != NULL) {
+                uint64_t since, woken;
+
+                if (*now_ns == 0)
+                        *now_ns = monotonic_ns();
+                since = times[i].waiting_since;
+                woken = __atomic_load_n(&times[i].woken_at, __ATOMIC_RELAXED);
+                if (woken < since || woken > *now_ns)
+                        woken = since;
+                imsm_sojourn_record(ctx->sojourn,
+                    ctx->imsm->queues[ppoint_index].ppoint, ppoint_index,
+                    woken - since, *now_ns - woken);
+                /* The entry waits for its next wake-up. */
+                times[i].waiting_since = *now_ns;
+        }
 
-        for (size_t i = 0, n = slab->element_count; i < n; i++) {
+        success = imsm_list_push(list_out, member, 0);
+        assert(success);
+        return;
+}
+
+/*
+ * Pushes the entries in [begin, end) with a pending wake-up for
+ * `ppoint_index` to `list_out`, or to `timed_out` (see
+ * `stage_out_entry`).
+ *
+ * Returns the number of entries in the queue, woken or not.
+ */
+static size_t
+imsm_stage_out_range(void **list_out, void **timed_out,
+    struct imsm_ctx *ctx, size_t ppoint_index, size_t begin, size_t end)
+{
+        const struct imsm_slab *slab = &ctx->imsm->slab;
+        const uintptr_t arena_base = (uintptr_t)slab->arena;
+        struct imsm_timer_wheel *wheel = NULL;
+        struct imsm_sojourn_times *times = NULL;
+        uint64_t now_ns = 0;
+        size_t depth = 0;
+
+        if (ctx->sojourn != NULL)
+                times = __atomic_load_n(&ctx->imsm->sojourn_times,
+                    __ATOMIC_RELAXED);
+        if (timed_out != NULL)
+                wheel = ctx->imsm->timers;
+
+        for (size_t i = begin; i < end; i++) {
                 struct imsm_entry *entry;
 
                 /*
@@ -210,36 +497,474 @@ imsm_stage_out(void **list_out, struct imsm_ctx *ctx, size_t ppoint_index)
                  * aliasing annotations?
                  */
                 entry = (void *)(arena_base + i * slab->element_size);
+                depth += (entry->queue_id == ppoint_index &&
+                    (entry->version & 1) != 0);
                 if (entry != NULL &&
                     entry->queue_id == ppoint_index &&
                     entry->wakeup_pending != 0) {
-                        bool success;
-                        void *member = (char *)entry + entry->offset;
+                        /*
+                         * Other workers may be scanning the same
+                         * queue: only dispatch wake-ups we claimed.
+                         */
+                        if (__atomic_exchange_n(&entry->wakeup_pending, 0,
+                            __ATOMIC_ACQUIRE) == 0)
+                                continue;
+
+                        stage_out_entry(list_out, timed_out, ctx,
+                            ppoint_index, i, wheel, times, &now_ns);
+                }
+        }
+
+        return depth;
+}
+
+/*
+ * Returns the number of entries in [begin, end) in `ppoint_index`'s
+ * queue, without touching their wake-ups.
+ */
+static size_t
+imsm_count_range(const struct imsm *imsm, size_t ppoint_index,
+    size_t begin, size_t end)
+{
+        const struct imsm_slab *slab = &imsm->slab;
+        const uintptr_t arena_base = (uintptr_t)slab->arena;
+        size_t depth = 0;
+
+        for (size_t i = begin; i < end; i++) {
+                const struct imsm_entry *entry;
+
+                entry = (void *)(arena_base + i * slab->element_size);
+                depth += (entry->queue_id == ppoint_index &&
+                    (entry->version & 1) != 0);
+        }
+
+        return depth;
+}
 
-                        entry->wakeup_pending = 0;
-                        success = imsm_list_push(list_out, member, 0);
-                        assert(success);
+/*
+ * Pushes the queue's entries with a pending wake-up to `list_out`
+ * (or `timed_out`, see `imsm_stage_out_range`), and adds the number
+ * of arena entries we scanned to `scanned`, and the number of entries
+ * we found in the queue to `depth`.  Ranges that another worker is
+ * scanning only count toward `depth` if `count_skipped` is true.
+ *
+ * Returns whether we skipped ranges another worker was scanning.
+ */
+static bool
+imsm_stage_out(void **list_out, void **timed_out, struct imsm_ctx *ctx,
+    size_t ppoint_index, bool count_skipped, size_t *scanned, size_t *depth)
+{
+        struct imsm *imsm = ctx->imsm;
+        const size_t element_count = imsm->slab.element_count;
+        const size_t num_ranges = imsm->num_ranges;
+        const uint32_t scan_tag = ppoint_index + 1;
+        bool skipped = false;
+        size_t home;
+
+        /*
+         * Clear the queue's pending flag before scanning: any
+         * wake-up we miss will set it again.
+         */
+        __atomic_store_n(&imsm->queues[ppoint_index].pending, 0,
+            __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        if (ctx->worker_count <= 1 || num_ranges <= 1) {
+                *scanned += element_count;
+                *depth += imsm_stage_out_range(list_out, timed_out, ctx,
+                    ppoint_index, 0, element_count);
+                return false;
+        }
+
+        /*
+         * Start with our home ranges, then steal the others'.  Skip
+         * ranges another worker is already scanning for the same
+         * queue: it will dispatch anything pending there, and any
+         * wake-up after its scan bumps the generation counter, so
+         * someone will poll again.  We must scan ranges claimed for
+         * other queues ourselves.
+         */
+        home = ((uint64_t)ctx->worker_index * num_ranges) / ctx->worker_count;
+        for (size_t k = 0; k < num_ranges; k++) {
+                size_t range = (home + k) % num_ranges;
+                uint32_t *scan = &imsm->range_scans[range];
+                size_t begin = range * IMSM_SCAN_RANGE;
+                size_t end = begin + IMSM_SCAN_RANGE;
+                uint32_t expected = 0;
+                bool claimed;
+
+                if (end > element_count)
+                        end = element_count;
+
+                claimed = __atomic_compare_exchange_n(scan, &expected,
+                    scan_tag, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+                if (!claimed && expected == scan_tag) {
+                        skipped = true;
+                        /*
+                         * The other worker only reports its own
+                         * ranges: count this one without dispatching.
+                         */
+                        if (count_skipped) {
+                                *scanned += end - begin;
+                                *depth += imsm_count_range(imsm,
+                                    ppoint_index, begin, end);
+                        }
+
+                        continue;
                 }
+
+                *scanned += end - begin;
+                *depth += imsm_stage_out_range(list_out, timed_out, ctx,
+                    ppoint_index, begin, end);
+                if (claimed)
+                        __atomic_store_n(scan, 0, __ATOMIC_RELEASE);
         }
 
+        return skipped;
+}
+
+static void
+oldest_swap(void **items, uint64_t *keys, size_t i, size_t j)
+{
+        void *item = items[i];
+        uint64_t key = keys[i];
+
+        items[i] = items[j];
+        keys[i] = keys[j];
+        items[j] = item;
+        keys[j] = key;
         return;
 }
 
-void **
-imsm_stage_io(struct imsm_ctx *ctx, struct imsm_ppoint_record ppoint,
-    void **list_in, uint64_t aux_match)
+/*
+ * `items` and `keys` form a binary max-heap of `n` elements, on
+ * `keys`, except maybe at `i`: restores the heap property.
+ */
+static void
+oldest_sift_down(void **items, uint64_t *keys, size_t n, size_t i)
+{
+
+        for (;;) {
+                size_t largest = i;
+                size_t left = 2 * i + 1;
+
+                if (left < n && keys[left] > keys[largest])
+                        largest = left;
+                if (left + 1 < n && keys[left + 1] > keys[largest])
+                        largest = left + 1;
+                if (largest == i)
+                        return;
+
+                oldest_swap(items, keys, i, largest);
+                i = largest;
+        }
+}
+
+static void
+oldest_sift_up(void **items, uint64_t *keys, size_t i)
+{
+
+        while (i > 0 && keys[(i - 1) / 2] < keys[i]) {
+                oldest_swap(items, keys, i, (i - 1) / 2);
+                i = (i - 1) / 2;
+        }
+
+        return;
+}
+
+/*
+ * Like `imsm_stage_out`, but only dispatches the `max_batch` woken
+ * entries that were staged in the queue the longest time ago, oldest
+ * first, and leaves the others' wake-ups pending for later calls.
+ * We scan the whole arena at once, regardless of other workers.
+ *
+ * Returns whether we left wake-ups pending.
+ */
+static bool
+imsm_stage_out_oldest(void **list_out, void **timed_out,
+    struct imsm_ctx *ctx, size_t ppoint_index, size_t max_batch,
+    size_t *scanned, size_t *depth)
+{
+        struct imsm *imsm = ctx->imsm;
+        const struct imsm_slab *slab = &imsm->slab;
+        const uintptr_t arena_base = (uintptr_t)slab->arena;
+        struct imsm_timer_wheel *wheel = NULL;
+        struct imsm_sojourn_times *times = NULL;
+        uint64_t now_ns = 0;
+        size_t num_woken = 0, n = 0;
+        uint64_t *keys;
+        void **oldest;
+
+        if (ctx->sojourn != NULL)
+                times = __atomic_load_n(&imsm->sojourn_times,
+                    __ATOMIC_RELAXED);
+        if (timed_out != NULL)
+                wheel = imsm->timers;
+
+        /* Same protocol as `imsm_stage_out`. */
+        __atomic_store_n(&imsm->queues[ppoint_index].pending, 0,
+            __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        /*
+         * Find the woken entries with the `max_batch` smallest
+         * staging times, in a max-heap of arena indices.
+         */
+        oldest = imsm_list_get(&ctx->cache, max_batch);
+        keys = imsm_list_aux(oldest);
+        for (size_t i = 0; i < slab->element_count; i++) {
+                struct imsm_entry *entry;
+                uint64_t staged;
+
+                entry = (void *)(arena_base + i * slab->element_size);
+                if (entry->queue_id != ppoint_index ||
+                    (entry->version & 1) == 0)
+                        continue;
+
+                (*depth)++;
+                if (__atomic_load_n(&entry->wakeup_pending,
+                    __ATOMIC_RELAXED) == 0)
+                        continue;
+
+                num_woken++;
+                staged = imsm->staged_ns[i];
+                if (n < max_batch) {
+                        oldest[n] = (void *)(uintptr_t)i;
+                        keys[n] = staged;
+                        oldest_sift_up(oldest, keys, n++);
+                } else if (staged < keys[0]) {
+                        oldest[0] = (void *)(uintptr_t)i;
+                        keys[0] = staged;
+                        oldest_sift_down(oldest, keys, n, 0);
+                }
+        }
+
+        *scanned += slab->element_count;
+        /* Heapsort the batch, oldest first. */
+        for (size_t k = n; k > 1; k--) {
+                oldest_swap(oldest, keys, 0, k - 1);
+                oldest_sift_down(oldest, keys, k - 1, 0);
+        }
+
+        for (size_t k = 0; k < n; k++) {
+                const size_t i = (uintptr_t)oldest[k];
+                struct imsm_entry *entry;
+
+                entry = (void *)(arena_base + i * slab->element_size);
+                if (__atomic_exchange_n(&entry->wakeup_pending, 0,
+                    __ATOMIC_ACQUIRE) == 0)
+                        continue;
+
+                /* Give the wake-up back if the entry moved on. */
+                if (entry->queue_id != ppoint_index) {
+                        __atomic_store_n(&entry->wakeup_pending, 1,
+                            __ATOMIC_RELEASE);
+                        continue;
+                }
+
+                stage_out_entry(list_out, timed_out, ctx, ppoint_index, i,
+                    wheel, times, &now_ns);
+        }
+
+        imsm_list_put(&ctx->cache, oldest);
+        if (num_woken <= n)
+                return false;
+
+        __atomic_store_n(&imsm->queues[ppoint_index].pending, 1,
+            __ATOMIC_RELEASE);
+        return true;
+}
+
+/*
+ * Implements `imsm_stage_io`, `imsm_stage_io_timeout` when
+ * `timed_out` is non-NULL, and `imsm_stage_io_limited` when `limits`
+ * is non-NULL.
+ */
+static void **
+stage_io(struct imsm_ctx *ctx, struct imsm_ppoint_record ppoint,
+    void **list_in, uint64_t aux_match, uint64_t timeout_ns,
+    void ***timed_out, struct imsm_stage_limits *limits)
 {
+        struct imsm_timer_wheel *wheel = NULL;
+        uint64_t start_ns = 0;
         size_t ppoint_index;
+        size_t num_staged;
+        size_t scanned = 0, depth = 0, num_out;
+        bool count_skipped, poll_again;
         void **ret;
 
+        if (ctx->stats != NULL)
+                start_ns = monotonic_ns();
+
         ppoint_index = imsm_index(ctx, ppoint);
         assert(ppoint_index < UINT16_MAX && "Queue id too high");
+        IMSM_PROBE3(stage_entry, ppoint.ppoint->name, ppoint_index,
+            imsm_list_size(list_in));
+        if (ctx->imsm->queues[ppoint_index].ppoint != ppoint.ppoint)
+                __atomic_store_n(&ctx->imsm->queues[ppoint_index].ppoint,
+                    ppoint.ppoint, __ATOMIC_RELAXED);
+
+        if (timed_out != NULL) {
+                assert(ctx->worker_count <= 1 &&
+                    "Stage timeouts need a single worker per machine.");
+                wheel = imsm_timer_wheel(ctx->imsm);
+                *timed_out = NULL;
+        }
 
         /* Register new list entries in the queue. */
-        imsm_stage_in(ctx, ppoint_index, list_in, aux_match);
+        num_staged = imsm_stage_in(ctx, ppoint_index, list_in, aux_match,
+            wheel, timeout_ns);
+
+        /*
+         * Leave the queue to workers that handle this workload, and
+         * make sure they don't skip their next poll pass.
+         */
+        if (!imsm_ppoint_enabled(ctx, ppoint.ppoint)) {
+                if (num_staged > 0)
+                        imsm_wake(ctx->imsm);
+                IMSM_PROBE4(stage_exit, ppoint.ppoint->name, ppoint_index,
+                    num_staged, 0);
+                return NULL;
+        }
 
         ret = imsm_list_get(&ctx->cache, ctx->imsm->slab.element_count);
-        /* Populate `ret` with all active entries. */
-        imsm_stage_out(ret, ctx, ppoint_index);
+        if (wheel != NULL)
+                *timed_out = imsm_list_get(&ctx->cache,
+                    ctx->imsm->slab.element_count);
+
+        /*
+         * Fire due timers (deadlines or back-offs) first, so we
+         * dispatch them right away.
+         */
+        if (__atomic_load_n(&ctx->imsm->timers, __ATOMIC_RELAXED) != NULL)
+                imsm_timer_advance(ctx->imsm, monotonic_ns());
+
+        /*
+         * Populate `ret` with all active entries (or the oldest ones,
+         * up to the batch limit, and make sure someone polls again
+         * for the rest).  If another worker was scanning part of the
+         * queue, it may have missed the entries we just staged in:
+         * make sure we poll again.
+         */
+        if (limits != NULL && limits->max_batch > 0) {
+                if (imsm_stage_out_oldest(ret,
+                    (wheel != NULL) ? *timed_out : NULL, ctx, ppoint_index,
+                    limits->max_batch, &scanned, &depth))
+                        imsm_wake(ctx->imsm);
+        } else {
+                /* Only count skipped ranges if anyone reads `depth`. */
+                count_skipped = (ctx->stats != NULL ||
+                    (limits != NULL && limits->max_depth > 0));
+                poll_again = imsm_stage_out(ret,
+                    (wheel != NULL) ? *timed_out : NULL, ctx, ppoint_index,
+                    count_skipped, &scanned, &depth);
+                if (poll_again && num_staged > 0)
+                        __atomic_add_fetch(&ctx->imsm->change_count, 1,
+                            __ATOMIC_RELAXED);
+        }
+
+        /* Timed out entries left the queue as well. */
+        num_out = imsm_list_size(ret) +
+            ((wheel != NULL) ? imsm_list_size(*timed_out) : 0);
+
+        /* Don't count the entries we just dispatched as waiting. */
+        if (limits != NULL && limits->max_depth > 0)
+                __atomic_store_n(&limits->full,
+                    depth >= num_out + limits->max_depth, __ATOMIC_RELAXED);
+
+        if (ctx->stats != NULL)
+                imsm_stats_record(ctx->stats, ppoint.ppoint, ppoint_index,
+                    num_staged, num_out, monotonic_ns() - start_ns,
+                    scanned, depth);
+        IMSM_PROBE4(stage_exit, ppoint.ppoint->name, ppoint_index,
+            num_staged, imsm_list_size(ret));
+        return ret;
+}
+
+/*
+ * Implements `imsm_queue_drain`, and `imsm_queue_cancel` when
+ * `with_woken` is false.
+ */
+static void **
+queue_collect(struct imsm_ctx *ctx, struct imsm_ppoint_record ppoint,
+    bool with_woken)
+{
+        const struct imsm_slab *slab = &ctx->imsm->slab;
+        const uintptr_t arena_base = (uintptr_t)slab->arena;
+        size_t ppoint_index;
+        void **ret;
+
+        ppoint_index = imsm_index(ctx, ppoint);
+        assert(ppoint_index < UINT16_MAX && "Queue id too high");
+        ret = imsm_list_get(&ctx->cache, slab->element_count);
+        for (size_t i = 0; i < slab->element_count; i++) {
+                struct imsm_entry *entry;
+                bool success;
+
+                entry = (void *)(arena_base + i * slab->element_size);
+                if (entry->queue_id != ppoint_index ||
+                    (entry->version & 1) == 0)
+                        continue;
+
+                if (!with_woken &&
+                    __atomic_load_n(&entry->wakeup_pending,
+                    __ATOMIC_ACQUIRE) != 0)
+                        continue;
+
+                /*
+                 * Drop any pending wake-up.  Timers (and later
+                 * notifications) fire into the void once the entry
+                 * leaves the queue.
+                 */
+                __atomic_store_n(&entry->wakeup_pending, 0, __ATOMIC_RELAXED);
+                imsm_trace(IMSM_TRACE_DRAIN, ctx->imsm, entry, UINT16_MAX);
+                entry->queue_id = UINT16_MAX;
+                success = imsm_list_push(ret, (char *)entry + entry->offset,
+                    0);
+                assert(success);
+        }
+
         return ret;
 }
+
+void **
+imsm_queue_drain(struct imsm_ctx *ctx, struct imsm_ppoint_record ppoint)
+{
+
+        return queue_collect(ctx, ppoint, true);
+}
+
+void **
+imsm_queue_cancel(struct imsm_ctx *ctx, struct imsm_ppoint_record ppoint)
+{
+
+        return queue_collect(ctx, ppoint, false);
+}
+
+void **
+imsm_stage_io(struct imsm_ctx *ctx, struct imsm_ppoint_record ppoint,
+    void **list_in, uint64_t aux_match)
+{
+
+        return stage_io(ctx, ppoint, list_in, aux_match, 0, NULL, NULL);
+}
+
+void **
+imsm_stage_io_timeout(struct imsm_ctx *ctx, struct imsm_ppoint_record ppoint,
+    void **list_in, uint64_t aux_match, uint64_t timeout_ns,
+    void ***timed_out)
+{
+
+        return stage_io(ctx, ppoint, list_in, aux_match, timeout_ns,
+            timed_out, NULL);
+}
+
+void **
+imsm_stage_io_limited(struct imsm_ctx *ctx, struct imsm_ppoint_record ppoint,
+    void **list_in, uint64_t aux_match, uint64_t timeout_ns,
+    void ***timed_out, struct imsm_stage_limits *limits)
+{
+
+        return stage_io(ctx, ppoint, list_in, aux_match, timeout_ns,
+            timed_out, limits);
+}
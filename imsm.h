@@ -5,13 +5,19 @@
  */
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 
 #include "imsm_list.h"
 #include "imsm_ppoint.h"
 #include "imsm_slab.h"
+#include "imsm_timer.h"
+#include "imsm_trace.h"
 #include "imsm_wrapper.h"
 
 struct imsm_ctx;
+struct imsm_sojourn;
+struct imsm_sojourn_times;
+struct imsm_stats;
 
 /*
  * The first field in any IMSM state struct must be a `imsm_entry`.
@@ -22,8 +28,8 @@ struct imsm_entry {
         /* UINT16_MAX means no queue. */
         uint16_t queue_id;
         /*
-         * XXX: needs more range here... make this 16 bytes?  Could
-         * also use the bytes for timeouts / exponential backoff.
+         * XXX: needs more range here... make this 16 bytes?  Timeouts
+         * and back-off attempts live in a side array (imsm_timer.h).
          */
         uint8_t offset;
         uint8_t wakeup_pending;
@@ -40,6 +46,64 @@ struct imsm_ref {
         uint64_t bits;
 };
 
+/*
+ * Queue ids are 16 bit, and UINT16_MAX means no queue.
+ */
+#define IMSM_MAX_QUEUES UINT16_MAX
+
+/*
+ * With multiple workers, `imsm_stage_io` scans the arena in ranges
+ * of IMSM_SCAN_RANGE entries.
+ */
+#define IMSM_SCAN_RANGE 256
+
+/*
+ * Per-queue bookkeeping, indexed by queue id.  The `pending` flag is
+ * conservative: it may be set spuriously, but it is always set when
+ * an entry in the queue has a pending wake-up.
+ */
+struct imsm_queue {
+        /*
+         * For the program point of a `WITH_IMSM_REGION_IF_ACTIVE`
+         * region, 1 + the number of queue ids inside the region the
+         * last time it was executed, or 0 if it never was.
+         */
+        uint32_t region_span;
+        /* Non-zero if some entry in the queue may have been woken. */
+        uint8_t pending;
+        /*
+         * Program point of the last stage that used this queue id, for
+         * introspection.
+         */
+        const struct imsm_ppoint *ppoint;
+};
+
+/*
+ * Optional limits for a stage (see `imsm_stage_io_limited`).  The
+ * caller owns the struct, and usually keeps it with the state shared
+ * by the stage's workers, so that upstream stages can see `full`.
+ */
+struct imsm_stage_limits {
+        /*
+         * Maximum number of wake-ups to dispatch per call, or 0 for
+         * no limit.  Each call dispatches the entries staged in the
+         * queue the longest time ago first, and leaves the others
+         * pending for later calls.
+         */
+        size_t max_batch;
+        /*
+         * Number of entries left waiting in the queue after a call at
+         * which we consider the queue full, or 0 for no limit.
+         */
+        size_t max_depth;
+        /*
+         * Updated by each call, with atomic stores: whether the queue
+         * is full.  Staging in never fails; instead, upstream stages
+         * should read this flag (atomically) and hold back new work.
+         */
+        bool full;
+};
+
 /*
  * This base struct hold the global information for one immediate mode
  * state machine.  Use the IMSM(IMSM_TYPE_NAME, STATE_TYPE_NAME) macro
@@ -49,6 +113,58 @@ struct imsm {
         size_t global_index;
         struct imsm_slab slab;
         void (*poll_fn)(struct imsm_ctx *);
+        /* IMSM_MAX_QUEUES entries, lazily populated by the OS. */
+        struct imsm_queue *queues;
+        /*
+         * One word per range of IMSM_SCAN_RANGE entries: 1 + the id
+         * of the queue a worker is currently scanning the range for,
+         * or 0 if none.
+         */
+        uint32_t *range_scans;
+        size_t num_ranges;
+        /*
+         * One word per arena entry: when the entry was last staged
+         * into a queue, in CLOCK_MONOTONIC nanoseconds, or 0 if never.
+         * Only for introspection (imsm_dump.h).
+         */
+        uint64_t *staged_ns;
+        /*
+         * One pair of timestamps per arena entry, or NULL until some
+         * context records sojourn times (imsm_sojourn.h).
+         */
+        struct imsm_sojourn_times *sojourn_times;
+        /*
+         * Timing wheel for `IMSM_STAGE_TIMEOUT` deadlines, or NULL
+         * until a stage first sets one (imsm_timer.h).
+         */
+        struct imsm_timer_wheel *timers;
+        /*
+         * Optional formatter for the state structs, to describe live
+         * states in `imsm_dump`s (see `imsm_set_formatter`).
+         */
+        void (*format_fn)(FILE *, const void *state);
+        /*
+         * Generation counter, bumped (mod 2^32) by every wake-up, by
+         * `imsm_wake`, and by frees (which may unblock allocations).
+         * Driver workers wait for this counter to change, and skip
+         * poll passes while it hasn't since their last quiescent pass.
+         */
+        uint32_t change_count;
+        /* Number of workers that may be sleeping on `change_count`. */
+        uint32_t sleepers;
+        /* Non-zero once `imsm_stop` has been called. */
+        uint32_t stopping;
+        /*
+         * Eventfd signaled by `imsm_wake` when the machine is attached
+         * to an `imsm_mux`, -1 otherwise.  `wake_armed` is non-zero
+         * while a signal is pending, so that we only write to the
+         * eventfd once per mux poll.  `wake_users` counts the
+         * `imsm_wake` calls that may still write to `wake_fd`, so
+         * `imsm_mux_remove` can wait for them before closing it.
+         */
+        int wake_fd;
+        uint32_t wake_armed;
+        uint32_t wake_users;
 };
 
 /*
@@ -60,6 +176,35 @@ struct imsm_ctx {
         struct imsm *imsm;
         struct imsm_ppoint_record position;
         struct imsm_list_cache cache;
+        struct imsm_slab_cache slab_cache;
+        /*
+         * `change_count` at the start of our last poll pass that did
+         * not observe any change, if `quiescent_valid`.
+         */
+        uint32_t quiescent_count;
+        bool quiescent_valid;
+        /* Bitset of IMSM_WORKLOAD_MASK(workload) to execute; 0 for all. */
+        uint32_t workload_mask;
+        /*
+         * This context's index among the `worker_count` workers
+         * sharing the imsm.  A count of 0 or 1 means the context has
+         * the imsm to itself.  Workers start scanning the arena at
+         * their own "home" ranges.
+         */
+        uint32_t worker_index;
+        uint32_t worker_count;
+        /*
+         * If non-NULL, `imsm_stage_io` records per-program-point
+         * statistics in this shared memory region (imsm_stats.h).
+         * The context doesn't own the region.
+         */
+        struct imsm_stats *stats;
+        /*
+         * If non-NULL, `imsm_stage_io` records how long the entries it
+         * dispatches waited for their wake-up, and for the dispatch
+         * (imsm_sojourn.h).  The context doesn't own the recorder.
+         */
+        struct imsm_sojourn *sojourn;
 };
 
 /*
@@ -73,6 +218,12 @@ void imsm_init(struct imsm *, void *arena, size_t arena_size, size_t elsize,
     void (*init_fn)(void *), void (*deinit_fn)(void *),
     void (*poll_fn)(struct imsm_ctx *));
 
+/*
+ * Releases all the resources cached in an `imsm_ctx`.  The context
+ * may be reused afterwards.
+ */
+void imsm_ctx_deinit(struct imsm_ctx *);
+
 /*
  * Returns a packed reference to an imsm and a pointer managed by that
  * state machine, or a NULL reference on failure.
@@ -82,6 +233,23 @@ void imsm_init(struct imsm *, void *arena, size_t arena_size, size_t elsize,
  */
 struct imsm_ref imsm_refer(struct imsm_ctx *, void *);
 
+/*
+ * Returns the reference for the `object_index`th entry in `imsm`'s
+ * arena, as of the entry's (active) version `version`.
+ */
+struct imsm_ref imsm_refer_index(const struct imsm *, size_t object_index,
+    uint32_t version);
+
+/*
+ * Registered imsms have global indices in [1, IMSM_MAX_REGISTERED).
+ */
+#define IMSM_MAX_REGISTERED 1024
+
+/*
+ * Returns the registered imsm with global index `index`, or NULL.
+ */
+struct imsm *imsm_lookup(size_t index);
+
 /*
  * Returns the object encoded in the reference, if any.
  */
@@ -95,16 +263,84 @@ struct imsm_entry *imsm_deref(struct imsm_ref);
  */
 bool imsm_notify(struct imsm_ref);
 
+/*
+ * Wakes the objects for all `n` references in `refs`, like calling
+ * `imsm_notify` on each, but only signals each machine once per run
+ * of consecutive references to that machine.
+ *
+ * Returns the number of references that were valid or NULL.
+ */
+size_t imsm_notify_n(const struct imsm_ref *refs, size_t n);
+
+/*
+ * Signals new work that isn't associated with any specific state
+ * (e.g., a listening socket became readable), so that sleeping
+ * driver workers execute the imsm's poll function again.  Also
+ * signals the imsm's eventfd, if it is attached to an `imsm_mux`.
+ */
+void imsm_wake(struct imsm *);
+
 /*
  * Adds all records in `imsm_list_in` where the auxiliary value equals
  * `aux_match` to the queue identified by the current program point,
  * and returns a list of all the values associated with that queue
- * that (may) have been woken.
+ * that (may) have been woken.  If the context does not execute the
+ * program point's workload, returns an empty list without draining
+ * the queue.
  *
  * A NULL list is empty.
  */
 void **imsm_stage_io(struct imsm_ctx *, struct imsm_ppoint_record,
      void **list_in, uint64_t aux_match);
 
+/*
+ * Like `imsm_stage_io`, but also arms a timer for each entry staged
+ * in, to fire `timeout_ns` later (re-arming entries staged in again).
+ * Entries whose timer fires while they're still in the queue leave
+ * the queue, and go to the list stored in `*timed_out` rather than
+ * to the returned list.  `*timed_out` is NULL if the context does
+ * not execute the program point's workload.
+ *
+ * A deadline may fire while a worker still handles an entry the
+ * stage returned, since the entry stays in the queue until it's
+ * staged elsewhere.  Only use timeouts on machines driven by a
+ * single worker: with more, another worker could time out (and
+ * free) an entry that's still in use.
+ */
+void **imsm_stage_io_timeout(struct imsm_ctx *, struct imsm_ppoint_record,
+     void **list_in, uint64_t aux_match, uint64_t timeout_ns,
+     void ***timed_out);
+
+/*
+ * Like `imsm_stage_io_timeout`, but with `limits` on the number of
+ * wake-ups dispatched per call and on the queue's depth.  If
+ * `timed_out` is NULL, staged entries don't get a deadline, and
+ * `timeout_ns` is ignored.
+ */
+void **imsm_stage_io_limited(struct imsm_ctx *, struct imsm_ppoint_record,
+     void **list_in, uint64_t aux_match, uint64_t timeout_ns,
+     void ***timed_out, struct imsm_stage_limits *limits);
+
+/*
+ * Takes every state out of the queue identified by the current
+ * program point, woken or not, and returns them in a list: free them,
+ * or stage them elsewhere.  Call it in place of the program point's
+ * stage (e.g., to shed load, or to shut down), so that it gets the
+ * same queue.
+ *
+ * States the stage returned stay in its queue until they're staged
+ * elsewhere, so we also take those: only drain a queue while no other
+ * worker executes its program point, or holds states it returned.
+ */
+void **imsm_queue_drain(struct imsm_ctx *, struct imsm_ppoint_record);
+
+/*
+ * Like `imsm_queue_drain`, but only takes the states without a
+ * pending wake-up: woken states stay in the queue, for its stage to
+ * dispatch.
+ */
+void **imsm_queue_cancel(struct imsm_ctx *, struct imsm_ppoint_record);
+
 #include "imsm_ppoint.inl"
+#include "imsm_trace.inl"
 #include "imsm_slab.inl"
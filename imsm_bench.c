@@ -0,0 +1,544 @@
+#define _GNU_SOURCE
+
+/*
+ * Microbenchmarks for the core imsm primitives, across element
+ * strides and working set sizes.
+ *
+ * Each benchmark reports the best of REPETITIONS runs, in nanoseconds
+ * and (on x86) TSC cycles per operation.  The TSC ticks at a constant
+ * rate, which may differ from the core's actual clock rate.
+ *
+ * Usage: imsm_bench [-c] [FILTER]
+ *
+ * -c prints CSV instead of a table, and FILTER only runs benchmarks
+ * whose name contains that string.
+ */
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "imsm.h"
+
+#define REPETITIONS 5
+
+/* Element strides, in bytes, and the arena capacity for each. */
+#define MAX_ELEMENTS 16384
+static const size_t strides[] = { 64, 256, 1024 };
+
+/* Working set sizes (number of elements) for benchmarks that have one. */
+static const size_t sizes[] = { 256, MAX_ELEMENTS };
+
+/* Wake ratios, in percent, for the stage benchmark. */
+static const size_t wake_percents[] = { 0, 1, 10, 100 };
+
+/*
+ * Each benchmark accumulates the time for its timed sections in a
+ * `bench_timer`, and returns the number of operations it performed.
+ */
+struct bench_timer {
+        uint64_t ns;
+        uint64_t cycles;
+        uint64_t start_ns;
+        uint64_t start_cycles;
+};
+
+struct bench_params {
+        struct imsm *imsm;
+        size_t stride;
+        size_t size;
+        size_t param;
+};
+
+struct bench {
+        const char *name;
+        /* Does the benchmark depend on the stride?  On the size? */
+        bool uses_stride;
+        bool uses_size;
+        const size_t *params;
+        size_t num_params;
+        uint64_t (*fn)(struct imsm_ctx *, const struct bench_params *,
+            struct bench_timer *);
+};
+
+/* Keeps the compiler from optimising benchmarked work away. */
+static volatile uint64_t sink;
+
+static struct imsm machines[sizeof(strides) / sizeof(strides[0])];
+
+static void
+noop_poll(struct imsm_ctx *ctx)
+{
+
+        (void)ctx;
+        return;
+}
+
+static uint64_t
+now_ns(void)
+{
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return now.tv_sec * 1000 * 1000 * 1000ULL + now.tv_nsec;
+}
+
+static inline uint64_t
+read_cycles(void)
+{
+
+#if defined(__x86_64__) || defined(__i386__)
+        return __builtin_ia32_rdtsc();
+#else
+        return 0;
+#endif
+}
+
+static inline void
+timer_start(struct bench_timer *timer)
+{
+
+        timer->start_ns = now_ns();
+        timer->start_cycles = read_cycles();
+        return;
+}
+
+static inline void
+timer_stop(struct bench_timer *timer)
+{
+
+        timer->cycles += read_cycles() - timer->start_cycles;
+        timer->ns += now_ns() - timer->start_ns;
+        return;
+}
+
+/*
+ * Allocates then releases one element, over and over: the magazine
+ * fast paths.
+ */
+static uint64_t
+bench_get_put(struct imsm_ctx *ctx, const struct bench_params *params,
+    struct bench_timer *timer)
+{
+        const size_t iterations = 1000 * 1000;
+
+        timer_start(timer);
+        for (size_t i = 0; i < iterations; i++) {
+                struct imsm_entry *entry;
+
+                entry = imsm_get(ctx, params->imsm);
+                imsm_put(ctx, params->imsm, entry);
+        }
+
+        timer_stop(timer);
+        return iterations;
+}
+
+/*
+ * Same as get_put, with transition tracing enabled: each op records
+ * one `IMSM_TRACE_PUT` event.
+ */
+static uint64_t
+bench_get_put_traced(struct imsm_ctx *ctx, const struct bench_params *params,
+    struct bench_timer *timer)
+{
+        uint64_t ret;
+
+        imsm_trace_enable(0);
+        ret = bench_get_put(ctx, params, timer);
+        imsm_trace_disable();
+        return ret;
+}
+
+/*
+ * Allocates `size` elements one at a time, then releases them one at
+ * a time, so that we reload magazines from (and spill them to) the
+ * depot every SLAB_MAGAZINE_SIZE operations.  One op is a get and a
+ * put.
+ */
+static uint64_t
+bench_magazine_cycle(struct imsm_ctx *ctx, const struct bench_params *params,
+    struct bench_timer *timer)
+{
+        struct imsm_entry **entries;
+        const size_t rounds = (1 << 20) / params->size;
+
+        entries = calloc(params->size, sizeof(*entries));
+        assert(entries != NULL);
+
+        timer_start(timer);
+        for (size_t round = 0; round < rounds; round++) {
+                for (size_t i = 0; i < params->size; i++)
+                        entries[i] = imsm_get(ctx, params->imsm);
+                for (size_t i = 0; i < params->size; i++)
+                        imsm_put(ctx, params->imsm, entries[i]);
+        }
+
+        timer_stop(timer);
+        free(entries);
+        return rounds * params->size;
+}
+
+/*
+ * Releases `size` elements with one `imsm_put_n`.  One op is one
+ * element; only the `imsm_put_n` calls are timed.
+ */
+static uint64_t
+bench_put_n(struct imsm_ctx *ctx, const struct bench_params *params,
+    struct bench_timer *timer)
+{
+        struct imsm_entry **entries;
+        const size_t rounds = (1 << 20) / params->size;
+
+        entries = calloc(params->size, sizeof(*entries));
+        assert(entries != NULL);
+
+        for (size_t round = 0; round < rounds; round++) {
+                size_t n;
+
+                n = imsm_get_n(ctx, params->imsm, entries, params->size);
+                assert(n == params->size);
+                timer_start(timer);
+                imsm_put_n(ctx, params->imsm, entries, n);
+                timer_stop(timer);
+        }
+
+        free(entries);
+        return rounds * params->size;
+}
+
+/*
+ * Allocates `size` elements with one `imsm_get_n`.  One op is one
+ * element; only the `imsm_get_n` calls are timed.
+ */
+static uint64_t
+bench_get_n(struct imsm_ctx *ctx, const struct bench_params *params,
+    struct bench_timer *timer)
+{
+        struct imsm_entry **entries;
+        const size_t rounds = (1 << 20) / params->size;
+
+        entries = calloc(params->size, sizeof(*entries));
+        assert(entries != NULL);
+
+        for (size_t round = 0; round < rounds; round++) {
+                size_t n;
+
+                timer_start(timer);
+                n = imsm_get_n(ctx, params->imsm, entries, params->size);
+                timer_stop(timer);
+                assert(n == params->size);
+                imsm_put_n(ctx, params->imsm, entries, n);
+        }
+
+        free(entries);
+        return rounds * params->size;
+}
+
+/*
+ * Gets then puts back a list of capacity `param`.
+ */
+static uint64_t
+bench_list_get_put(struct imsm_ctx *ctx, const struct bench_params *params,
+    struct bench_timer *timer)
+{
+        const size_t iterations = 1000 * 1000;
+
+        timer_start(timer);
+        for (size_t i = 0; i < iterations; i++) {
+                void **list;
+
+                list = imsm_list_get(&ctx->cache, params->param);
+                imsm_list_put(&ctx->cache, list);
+        }
+
+        timer_stop(timer);
+        return iterations;
+}
+
+/*
+ * Gets 16 lists of capacity `param`, and recycles them all at once,
+ * like a poll pass.  One op is one list.
+ */
+static uint64_t
+bench_list_recycle(struct imsm_ctx *ctx, const struct bench_params *params,
+    struct bench_timer *timer)
+{
+        const size_t rounds = 1000 * 1000 / 16;
+
+        timer_start(timer);
+        for (size_t round = 0; round < rounds; round++) {
+                for (size_t i = 0; i < 16; i++)
+                        sink += (uintptr_t)imsm_list_get(&ctx->cache,
+                            params->param);
+                imsm_list_cache_recycle(&ctx->cache);
+        }
+
+        timer_stop(timer);
+        return rounds * 16;
+}
+
+/*
+ * Visits a sequence of program points with distinct 128-bit
+ * iterations, which all advance the state index.
+ */
+static uint64_t
+bench_index(struct imsm_ctx *ctx, const struct bench_params *params,
+    struct bench_timer *timer)
+{
+        const size_t iterations = 10 * 1000 * 1000;
+        struct imsm_ppoint_record record = IMSM_PPOINT_RECORD("bench_index");
+        uint64_t acc = 0;
+
+        (void)params;
+        ctx->position = (struct imsm_ppoint_record) { 0 };
+        timer_start(timer);
+        for (size_t i = 0; i < iterations; i++) {
+                record.iteration = ((__uint128_t)i << 64) | i;
+                acc += imsm_index(ctx, record);
+        }
+
+        timer_stop(timer);
+        ctx->position = (struct imsm_ppoint_record) { 0 };
+        sink += acc;
+        return iterations;
+}
+
+/*
+ * Encodes references to `size` live elements, then decodes them.
+ * One op is one encode and one decode.
+ */
+static uint64_t
+bench_refer_deref(struct imsm_ctx *ctx, const struct bench_params *params,
+    struct bench_timer *timer)
+{
+        struct imsm_entry **entries;
+        struct imsm_ref *refs;
+        const size_t rounds = (1 << 20) / params->size;
+        size_t n;
+
+        entries = calloc(params->size, sizeof(*entries));
+        refs = calloc(params->size, sizeof(*refs));
+        assert(entries != NULL && refs != NULL);
+        n = imsm_get_n(ctx, params->imsm, entries, params->size);
+        assert(n == params->size);
+
+        timer_start(timer);
+        for (size_t round = 0; round < rounds; round++) {
+                uintptr_t acc = 0;
+
+                for (size_t i = 0; i < n; i++)
+                        refs[i] = imsm_refer(ctx, entries[i]);
+                for (size_t i = 0; i < n; i++)
+                        acc += (uintptr_t)imsm_deref(refs[i]);
+                sink += acc;
+        }
+
+        timer_stop(timer);
+        imsm_put_n(ctx, params->imsm, entries, n);
+        free(refs);
+        free(entries);
+        return rounds * n;
+}
+
+/*
+ * Parks `size` elements in one stage, then wakes `param` percent of
+ * them (spread evenly) before each pass over the stage.  Only the
+ * `imsm_stage_io` calls are timed, and one op is one pass.
+ */
+static uint64_t
+bench_stage_io(struct imsm_ctx *ctx, const struct bench_params *params,
+    struct bench_timer *timer)
+{
+        const struct imsm_ppoint_record record =
+            IMSM_PPOINT_RECORD("bench_stage");
+        const size_t rounds = 1000;
+        struct imsm_entry **entries;
+        struct imsm_ref *refs;
+        size_t num_woken, n;
+        void **list;
+
+        entries = calloc(params->size, sizeof(*entries));
+        refs = calloc(params->size, sizeof(*refs));
+        assert(entries != NULL && refs != NULL);
+        n = imsm_get_n(ctx, params->imsm, entries, params->size);
+        assert(n == params->size);
+
+        list = imsm_list_get(&ctx->cache, n);
+        for (size_t i = 0; i < n; i++)
+                imsm_list_push(list, entries[i], 0);
+
+        /* Spread the wake-ups over the whole arena. */
+        num_woken = (n * params->param) / 100;
+        for (size_t i = 0; i < num_woken; i++)
+                refs[i] = imsm_refer(ctx, entries[(i * n) / num_woken]);
+
+        ctx->position = (struct imsm_ppoint_record) { 0 };
+        sink += imsm_list_size(imsm_stage_io(ctx, record, list, 0));
+        for (size_t round = 0; round < rounds; round++) {
+                void **woken;
+
+                imsm_list_cache_recycle(&ctx->cache);
+                ctx->position = (struct imsm_ppoint_record) { 0 };
+                imsm_notify_n(refs, num_woken);
+
+                timer_start(timer);
+                woken = imsm_stage_io(ctx, record, NULL, 0);
+                timer_stop(timer);
+                assert(imsm_list_size(woken) == num_woken);
+        }
+
+        imsm_list_cache_recycle(&ctx->cache);
+        ctx->position = (struct imsm_ppoint_record) { 0 };
+        imsm_put_n(ctx, params->imsm, entries, n);
+        free(refs);
+        free(entries);
+        return rounds;
+}
+
+static const size_t list_capacities[] = { 8, 64, 1024 };
+
+static const struct bench benches[] = {
+        { "get_put", true, false, NULL, 0, bench_get_put },
+        { "get_put_traced", true, false, NULL, 0, bench_get_put_traced },
+        { "magazine_cycle", true, true, NULL, 0, bench_magazine_cycle },
+        { "get_n", true, true, NULL, 0, bench_get_n },
+        { "put_n", true, true, NULL, 0, bench_put_n },
+        { "list_get_put", false, false, list_capacities,
+          sizeof(list_capacities) / sizeof(list_capacities[0]),
+          bench_list_get_put },
+        { "list_recycle", false, false, list_capacities,
+          sizeof(list_capacities) / sizeof(list_capacities[0]),
+          bench_list_recycle },
+        { "index", false, false, NULL, 0, bench_index },
+        { "refer_deref", true, true, NULL, 0, bench_refer_deref },
+        { "stage_io", true, true, wake_percents,
+          sizeof(wake_percents) / sizeof(wake_percents[0]), bench_stage_io },
+};
+
+/*
+ * Runs `bench` REPETITIONS times with `params`, and prints the best
+ * time per op.
+ */
+static void
+run_one(const struct bench *bench, const struct bench_params *params,
+    bool csv)
+{
+        struct imsm_ctx ctx = {
+                .imsm = params->imsm,
+        };
+        double best_ns = 0, best_cycles = 0;
+
+        for (size_t rep = 0; rep < REPETITIONS; rep++) {
+                struct bench_timer timer = { 0 };
+                uint64_t ops;
+                double ns, cycles;
+
+                ops = bench->fn(&ctx, params, &timer);
+                ns = (double)timer.ns / ops;
+                cycles = (double)timer.cycles / ops;
+                if (rep == 0 || ns < best_ns) {
+                        best_ns = ns;
+                        best_cycles = cycles;
+                }
+        }
+
+        imsm_ctx_deinit(&ctx);
+        if (csv) {
+                printf("%s,%zu,%zu,%zu,%.3f,%.2f\n", bench->name,
+                    bench->uses_stride ? params->stride : 0,
+                    bench->uses_size ? params->size : 0,
+                    params->param, best_ns, best_cycles);
+        } else {
+                printf("%-16s %8zu %8zu %8zu %12.3f %12.2f\n", bench->name,
+                    bench->uses_stride ? params->stride : 0,
+                    bench->uses_size ? params->size : 0,
+                    params->param, best_ns, best_cycles);
+        }
+
+        return;
+}
+
+/*
+ * Runs `bench` for all the relevant combinations of strides, sizes,
+ * and parameters.
+ */
+static void
+run_bench(const struct bench *bench, bool csv)
+{
+        size_t num_strides = bench->uses_stride ?
+            sizeof(strides) / sizeof(strides[0]) : 1;
+        size_t num_sizes = bench->uses_size ?
+            sizeof(sizes) / sizeof(sizes[0]) : 1;
+        size_t num_params = (bench->num_params > 0) ? bench->num_params : 1;
+
+        for (size_t i = 0; i < num_strides; i++) {
+                for (size_t j = 0; j < num_sizes; j++) {
+                        for (size_t k = 0; k < num_params; k++) {
+                                const struct bench_params params = {
+                                        .imsm = &machines[i],
+                                        .stride = strides[i],
+                                        .size = sizes[j],
+                                        .param = (bench->params != NULL) ?
+                                            bench->params[k] : 0,
+                                };
+
+                                run_one(bench, &params, csv);
+                        }
+                }
+        }
+
+        return;
+}
+
+int
+main(int argc, char **argv)
+{
+        const char *filter = NULL;
+        bool csv = false;
+        int opt;
+
+        while ((opt = getopt(argc, argv, "c")) != -1) {
+                switch (opt) {
+                case 'c':
+                        csv = true;
+                        break;
+                default:
+                        fprintf(stderr, "Usage: imsm_bench [-c] [FILTER]\n");
+                        return 1;
+                }
+        }
+
+        if (optind < argc)
+                filter = argv[optind];
+
+        for (size_t i = 0; i < sizeof(strides) / sizeof(strides[0]); i++) {
+                void *arena;
+
+                arena = calloc(MAX_ELEMENTS, strides[i]);
+                assert(arena != NULL && "Arena allocation failed.");
+                imsm_init(&machines[i], arena, MAX_ELEMENTS * strides[i],
+                    strides[i], NULL, NULL, noop_poll);
+        }
+
+        if (csv) {
+                printf("benchmark,stride,size,param,ns_per_op,cycles_per_op\n");
+        } else {
+                printf("%-16s %8s %8s %8s %12s %12s\n", "benchmark",
+                    "stride", "size", "param", "ns/op", "cycles/op");
+        }
+
+        for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+                if (filter != NULL && strstr(benches[i].name, filter) == NULL)
+                        continue;
+
+                run_bench(&benches[i], csv);
+        }
+
+        return 0;
+}
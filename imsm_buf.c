@@ -0,0 +1,140 @@
+#include "imsm_buf.h"
+
+#include <assert.h>
+#include <sys/mman.h>
+
+
+static size_t
+class_size(size_t size_class)
+{
+
+        return (size_t)IMSM_BUF_MIN_SIZE << (2 * size_class);
+}
+
+static void
+buf_init(void *vbuf)
+{
+        struct imsm_buf *buf = vbuf;
+
+        buf->refcount = 0;
+        return;
+}
+
+bool
+imsm_buf_pool_init(struct imsm_buf_pool *pool, size_t bytes_per_class)
+{
+        void *arenas[IMSM_BUF_NUM_CLASSES] = { NULL };
+        size_t arena_sizes[IMSM_BUF_NUM_CLASSES];
+
+        /*
+         * Map every arena before we set up any slab, so a failure
+         * only has mappings to undo.  Classes whose buffers are
+         * larger than `bytes_per_class` stay empty.
+         */
+        for (size_t i = 0; i < IMSM_BUF_NUM_CLASSES; i++) {
+                size_t size = class_size(i);
+
+                arena_sizes[i] = bytes_per_class - bytes_per_class % size;
+                if (arena_sizes[i] == 0)
+                        continue;
+
+                arenas[i] = mmap(NULL, arena_sizes[i], PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (arenas[i] == MAP_FAILED) {
+                        while (i-- > 0) {
+                                if (arenas[i] != NULL)
+                                        munmap(arenas[i], arena_sizes[i]);
+                        }
+
+                        return false;
+                }
+        }
+
+        for (size_t i = 0; i < IMSM_BUF_NUM_CLASSES; i++) {
+                size_t size = class_size(i);
+
+                imsm_slab_init(&pool->classes[i], arenas[i], arena_sizes[i],
+                    size, buf_init, NULL);
+                for (size_t j = 0; j < pool->classes[i].element_count; j++) {
+                        struct imsm_buf *buf;
+
+                        buf = (void *)((char *)arenas[i] + j * size);
+                        buf->capacity = size - sizeof(*buf);
+                        buf->size_class = i;
+                }
+        }
+
+        return true;
+}
+
+size_t
+imsm_buf_class_size(size_t min_capacity)
+{
+
+        for (size_t i = 0; i < IMSM_BUF_NUM_CLASSES; i++) {
+                if (class_size(i) - sizeof(struct imsm_buf) >= min_capacity)
+                        return class_size(i);
+        }
+
+        return 0;
+}
+
+struct imsm_buf *
+imsm_buf_get(struct imsm_buf_pool *pool, struct imsm_buf_cache *cache,
+    size_t min_capacity)
+{
+
+        for (size_t i = 0; i < IMSM_BUF_NUM_CLASSES; i++) {
+                struct imsm_buf *ret;
+
+                if (class_size(i) - sizeof(*ret) < min_capacity)
+                        continue;
+
+                ret = (struct imsm_buf *)imsm_slab_get(&pool->classes[i],
+                    &cache->classes[i]);
+                if (ret == NULL)
+                        continue;
+
+                assert(ret->refcount == 0);
+                ret->refcount = 1;
+                return ret;
+        }
+
+        return NULL;
+}
+
+struct imsm_buf *
+imsm_buf_ref(struct imsm_buf *buf)
+{
+
+        __atomic_add_fetch(&buf->refcount, 1, __ATOMIC_RELAXED);
+        return buf;
+}
+
+void
+imsm_buf_put(struct imsm_buf_pool *pool, struct imsm_buf_cache *cache,
+    struct imsm_buf *buf)
+{
+        size_t size_class;
+
+        if (buf == NULL)
+                return;
+
+        if (__atomic_sub_fetch(&buf->refcount, 1, __ATOMIC_ACQ_REL) != 0)
+                return;
+
+        size_class = buf->size_class;
+        assert(size_class < IMSM_BUF_NUM_CLASSES);
+        imsm_slab_put(&pool->classes[size_class], &cache->classes[size_class],
+            &buf->header);
+        return;
+}
+
+void
+imsm_buf_cache_flush(struct imsm_buf_pool *pool, struct imsm_buf_cache *cache)
+{
+
+        for (size_t i = 0; i < IMSM_BUF_NUM_CLASSES; i++)
+                imsm_slab_cache_release(&pool->classes[i], &cache->classes[i]);
+        return;
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+/*
+ * Pools of refcounted I/O buffers, in a few size classes, so that
+ * states only hold buffers while they need them instead of embedding
+ * them.  Each size class is an `imsm_slab`, with per-thread magazine
+ * caches, and buffers carry the same versioned `imsm_entry` header as
+ * state structs.
+ */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "imsm.h"
+
+/*
+ * Size classes hold 256, 1024, 4096 and 16384-byte buffers, header
+ * included.
+ */
+#define IMSM_BUF_NUM_CLASSES 4
+#define IMSM_BUF_MIN_SIZE 256
+
+struct imsm_buf {
+        struct imsm_entry header;
+        uint32_t refcount;
+        /* Usable bytes in `data`. */
+        uint32_t capacity;
+        uint8_t size_class;
+        char data[] __attribute__((__aligned__(16)));
+};
+
+struct imsm_buf_pool {
+        struct imsm_slab classes[IMSM_BUF_NUM_CLASSES];
+};
+
+/*
+ * Per-thread caches for a pool.
+ */
+struct imsm_buf_cache {
+        struct imsm_slab_cache classes[IMSM_BUF_NUM_CLASSES];
+};
+
+/*
+ * Initializes `pool` with `bytes_per_class` bytes of buffers in each
+ * size class, allocated with mmap.  Only the first cache line of each
+ * buffer is touched until the buffer is used.  Size classes whose
+ * buffers are larger than `bytes_per_class` are left empty, and
+ * `imsm_buf_get` never finds a buffer there.
+ *
+ * Returns false on allocation failure, without leaking any mapping.
+ */
+bool imsm_buf_pool_init(struct imsm_buf_pool *, size_t bytes_per_class);
+
+/*
+ * Returns the size, header included, of the smallest size class with
+ * at least `min_capacity` usable bytes, or 0 if no class is large
+ * enough.  Callers can use it to size `bytes_per_class`.
+ */
+size_t imsm_buf_class_size(size_t min_capacity);
+
+/*
+ * Returns a buffer with at least `min_capacity` usable bytes and a
+ * reference count of 1, from the smallest size class that fits and
+ * still has free buffers, or NULL if none does.
+ */
+struct imsm_buf *imsm_buf_get(struct imsm_buf_pool *, struct imsm_buf_cache *,
+    size_t min_capacity);
+
+/*
+ * Acquires another reference to `buf`, e.g., to hand it off to
+ * another stage without copying, and returns `buf`.
+ */
+struct imsm_buf *imsm_buf_ref(struct imsm_buf *buf);
+
+/*
+ * Releases one reference to `buf` (which may be NULL), and returns it
+ * to the pool once the last reference is gone.
+ */
+void imsm_buf_put(struct imsm_buf_pool *, struct imsm_buf_cache *,
+    struct imsm_buf *buf);
+
+/*
+ * Returns all the buffers cached in `cache` to the pool.
+ */
+void imsm_buf_cache_flush(struct imsm_buf_pool *, struct imsm_buf_cache *);
@@ -0,0 +1,355 @@
+#define _GNU_SOURCE
+
+#include "imsm_driver.h"
+
+#include <errno.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "imsm.h"
+#include "imsm_sojourn.h"
+#include "imsm_stats.h"
+#include "imsm_timer.h"
+
+#define DEFAULT_MAX_SLEEP_NS (1000 * 1000 * 1000ULL)
+
+/*
+ * Backoff sleeps start at 1 us, and we never spin for more than
+ * 2^MAX_SPIN_SHIFT pause instructions at once.
+ */
+#define MIN_BACKOFF_NS 1000ULL
+#define MAX_SPIN_SHIFT 10
+
+struct driver_worker {
+        pthread_t thread;
+        const struct imsm_driver_opts *opts;
+        struct imsm_ctx ctx;
+};
+
+/*
+ * Fills in defaults for `opts_in`, which may be NULL.
+ */
+static struct imsm_driver_opts
+driver_opts_normalize(const struct imsm_driver_opts *opts_in)
+{
+        struct imsm_driver_opts opts = {
+                .idle_policy = IMSM_IDLE_SLEEP,
+        };
+
+        if (opts_in != NULL)
+                opts = *opts_in;
+        if (opts.num_workers == 0)
+                opts.num_workers = 1;
+        if (opts.max_sleep_ns == 0)
+                opts.max_sleep_ns = DEFAULT_MAX_SLEEP_NS;
+        return opts;
+}
+
+static inline void
+spin_pause(void)
+{
+
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+        return;
+}
+
+static bool
+driver_stopping(const struct imsm *imsm)
+{
+
+        return __atomic_load_n(&imsm->stopping, __ATOMIC_ACQUIRE) != 0;
+}
+
+/*
+ * Spins for up to 2^`shift` pauses, or until the change counter
+ * moves away from `snapshot`.
+ */
+static void
+driver_spin(const struct imsm *imsm, uint32_t snapshot, uint32_t shift)
+{
+
+        if (shift > MAX_SPIN_SHIFT)
+                shift = MAX_SPIN_SHIFT;
+
+        for (size_t i = 0, n = 1UL << shift; i < n; i++) {
+                if (__atomic_load_n(&imsm->change_count,
+                    __ATOMIC_RELAXED) != snapshot)
+                        return;
+                spin_pause();
+        }
+
+        return;
+}
+
+/*
+ * Blocks for up to `timeout_ns`, or until the change counter moves
+ * away from `snapshot`.
+ */
+static void
+driver_sleep(struct imsm *imsm, uint32_t snapshot, uint64_t timeout_ns)
+{
+        const struct timespec timeout = {
+                .tv_sec = timeout_ns / (1000 * 1000 * 1000ULL),
+                .tv_nsec = timeout_ns % (1000 * 1000 * 1000ULL),
+        };
+
+        /* See `imsm_wake` for the other side of the handshake. */
+        __atomic_add_fetch(&imsm->sleepers, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&imsm->change_count, __ATOMIC_SEQ_CST) == snapshot)
+                syscall(SYS_futex, &imsm->change_count, FUTEX_WAIT_PRIVATE,
+                    snapshot, &timeout, NULL, 0);
+        __atomic_sub_fetch(&imsm->sleepers, 1, __ATOMIC_SEQ_CST);
+        return;
+}
+
+/*
+ * Returns how long we should block for after `idle_passes`
+ * consecutive poll passes without any change, after spinning if
+ * the policy says so.
+ */
+static uint64_t
+driver_idle_timeout(const struct imsm_driver_opts *opts,
+    const struct imsm *imsm, uint32_t snapshot, uint32_t idle_passes)
+{
+        uint32_t shift;
+        uint64_t ret;
+
+        if (idle_passes == 0)
+                return 0;
+
+        switch (opts->idle_policy) {
+        case IMSM_IDLE_BACKOFF:
+                if (idle_passes <= opts->spin_limit) {
+                        driver_spin(imsm, snapshot, idle_passes);
+                        return 0;
+                }
+
+                shift = idle_passes - opts->spin_limit - 1;
+                if (shift >= 63 ||
+                    (MIN_BACKOFF_NS << shift) >> shift != MIN_BACKOFF_NS)
+                        return opts->max_sleep_ns;
+
+                ret = MIN_BACKOFF_NS << shift;
+                return (ret < opts->max_sleep_ns) ? ret : opts->max_sleep_ns;
+
+        case IMSM_IDLE_SLEEP:
+                return opts->max_sleep_ns;
+
+        case IMSM_IDLE_BUSY_POLL:
+        default:
+                return 0;
+        }
+}
+
+static void
+driver_loop(struct imsm_ctx *ctx, const struct imsm_driver_opts *opts)
+{
+        struct imsm *imsm = ctx->imsm;
+        uint32_t idle_passes = 0;
+
+        /* Create the region on the worker's thread, to record its tid. */
+        if (opts->export_stats)
+                ctx->stats = imsm_stats_create(ctx);
+        if (opts->record_sojourn && ctx->sojourn == NULL)
+                ctx->sojourn = imsm_sojourn_create(ctx);
+
+        while (!driver_stopping(imsm)) {
+                uint32_t snapshot;
+                uint64_t timeout, next_timer;
+
+                /* Fire due timeouts, and don't block past the next one. */
+                next_timer = imsm_timer_poll(imsm);
+                snapshot = __atomic_load_n(&imsm->change_count,
+                    __ATOMIC_ACQUIRE);
+                timeout = driver_idle_timeout(opts, imsm, snapshot,
+                    idle_passes);
+                if (timeout > next_timer)
+                        timeout = next_timer;
+                if (opts->wait_fn != NULL)
+                        opts->wait_fn(ctx, timeout, opts->wait_arg);
+                else if (timeout > 0)
+                        driver_sleep(imsm, snapshot, timeout);
+
+                imsm_poll_if_changed(ctx);
+
+                if (__atomic_load_n(&imsm->change_count,
+                    __ATOMIC_ACQUIRE) != snapshot)
+                        idle_passes = 0;
+                else if (idle_passes < UINT32_MAX)
+                        idle_passes++;
+        }
+
+        imsm_stats_destroy(ctx->stats);
+        ctx->stats = NULL;
+        return;
+}
+
+static void *
+driver_worker_main(void *arg)
+{
+        struct driver_worker *worker = arg;
+
+        driver_loop(&worker->ctx, worker->opts);
+        return NULL;
+}
+
+void
+imsm_poll(struct imsm_ctx *ctx)
+{
+
+        ctx->imsm->poll_fn(ctx);
+        imsm_list_cache_recycle(&ctx->cache);
+        ctx->position = (struct imsm_ppoint_record) { 0 };
+        return;
+}
+
+bool
+imsm_poll_if_changed(struct imsm_ctx *ctx)
+{
+        struct imsm *imsm = ctx->imsm;
+        uint32_t generation;
+
+        generation = __atomic_load_n(&imsm->change_count, __ATOMIC_ACQUIRE);
+        if (ctx->quiescent_valid && ctx->quiescent_count == generation)
+                return false;
+
+        imsm_poll(ctx);
+
+        /*
+         * If nothing changed during the pass, there's no point in
+         * polling again until something does.
+         */
+        ctx->quiescent_valid = (__atomic_load_n(&imsm->change_count,
+            __ATOMIC_ACQUIRE) == generation);
+        ctx->quiescent_count = generation;
+        return true;
+}
+
+int
+imsm_run(struct imsm *imsm, const struct imsm_driver_opts *opts_in)
+{
+        const struct imsm_driver_opts opts = driver_opts_normalize(opts_in);
+        struct driver_worker *workers;
+        size_t num_started;
+        int ret = 0;
+
+        workers = calloc(opts.num_workers, sizeof(*workers));
+        if (workers == NULL)
+                return ENOMEM;
+
+        for (size_t i = 0; i < opts.num_workers; i++) {
+                workers[i].opts = &opts;
+                workers[i].ctx.imsm = imsm;
+                workers[i].ctx.worker_index = i;
+                workers[i].ctx.worker_count = opts.num_workers;
+                if (opts.workload_masks != NULL)
+                        workers[i].ctx.workload_mask = opts.workload_masks[i];
+        }
+
+        /* The caller's thread is worker 0. */
+        for (num_started = 1; num_started < opts.num_workers; num_started++) {
+                struct driver_worker *worker = &workers[num_started];
+
+                ret = pthread_create(&worker->thread, NULL,
+                    driver_worker_main, worker);
+                if (ret != 0) {
+                        imsm_stop(imsm);
+                        break;
+                }
+        }
+
+        if (ret == 0)
+                driver_loop(&workers[0].ctx, &opts);
+
+        for (size_t i = 1; i < num_started; i++)
+                pthread_join(workers[i].thread, NULL);
+
+        for (size_t i = 0; i < opts.num_workers; i++)
+                imsm_ctx_deinit(&workers[i].ctx);
+
+        free(workers);
+        return ret;
+}
+
+int
+imsm_run_sharded(struct imsm *const *shards, size_t num_shards,
+    const struct imsm_driver_opts *opts_in)
+{
+        struct imsm_driver_opts opts = driver_opts_normalize(opts_in);
+        struct driver_worker *workers;
+        cpu_set_t allowed;
+        size_t num_cpus = 0;
+        size_t num_started;
+        int cpus[CPU_SETSIZE];
+        int ret = 0;
+
+        /* Each shard has exactly one worker, with every workload. */
+        opts.num_workers = 1;
+        opts.workload_masks = NULL;
+
+        CPU_ZERO(&allowed);
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+                for (int i = 0; i < CPU_SETSIZE; i++) {
+                        if (CPU_ISSET(i, &allowed))
+                                cpus[num_cpus++] = i;
+                }
+        }
+
+        workers = calloc(num_shards, sizeof(*workers));
+        if (workers == NULL)
+                return ENOMEM;
+
+        for (num_started = 0; num_started < num_shards; num_started++) {
+                struct driver_worker *worker = &workers[num_started];
+                pthread_attr_t attr;
+
+                worker->opts = &opts;
+                worker->ctx.imsm = shards[num_started];
+
+                pthread_attr_init(&attr);
+                if (num_cpus > 0) {
+                        cpu_set_t pinned;
+
+                        CPU_ZERO(&pinned);
+                        CPU_SET(cpus[num_started % num_cpus], &pinned);
+                        pthread_attr_setaffinity_np(&attr,
+                            sizeof(pinned), &pinned);
+                }
+
+                ret = pthread_create(&worker->thread, &attr,
+                    driver_worker_main, worker);
+                pthread_attr_destroy(&attr);
+                if (ret != 0)
+                        break;
+        }
+
+        if (ret != 0) {
+                for (size_t i = 0; i < num_shards; i++)
+                        imsm_stop(shards[i]);
+        }
+
+        for (size_t i = 0; i < num_started; i++) {
+                pthread_join(workers[i].thread, NULL);
+                imsm_ctx_deinit(&workers[i].ctx);
+        }
+
+        free(workers);
+        return ret;
+}
+
+void
+imsm_stop(struct imsm *imsm)
+{
+
+        __atomic_store_n(&imsm->stopping, 1, __ATOMIC_RELEASE);
+        imsm_wake(imsm);
+        return;
+}
@@ -0,0 +1,122 @@
+#pragma once
+
+/*
+ * Reusable driver loop for immediate mode state machines.
+ */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct imsm;
+struct imsm_ctx;
+
+/*
+ * What driver workers do after a poll pass that did not observe any
+ * change in the imsm's change counter.
+ */
+enum imsm_idle_policy {
+        /* Always poll again immediately. */
+        IMSM_IDLE_BUSY_POLL = 0,
+        /*
+         * Spin for `spin_limit` idle passes, then sleep for
+         * exponentially longer periods, up to `max_sleep_ns`.
+         */
+        IMSM_IDLE_BACKOFF,
+        /* Sleep for up to `max_sleep_ns` after the first idle pass. */
+        IMSM_IDLE_SLEEP,
+};
+
+struct imsm_driver_opts {
+        /* Number of workers, including the calling thread.  0 means 1. */
+        size_t num_workers;
+        enum imsm_idle_policy idle_policy;
+        /* Number of idle passes we spin for before sleeping. */
+        uint32_t spin_limit;
+        /* Upper bound on sleep durations.  0 means one second. */
+        uint64_t max_sleep_ns;
+        /*
+         * If non-NULL, workers call `wait_fn` before each poll pass
+         * instead of sleeping on the change counter.  `wait_fn`
+         * should block for at most `timeout_ns` waiting for external
+         * events (e.g., with epoll_wait(2)), and signal them with
+         * `imsm_notify` or `imsm_wake`.  A 0 timeout must not block.
+         */
+        void (*wait_fn)(struct imsm_ctx *, uint64_t timeout_ns, void *arg);
+        void *wait_arg;
+        /*
+         * If non-NULL, an array of `num_workers` workload masks (see
+         * `enum imsm_workload`): worker i only executes stages for
+         * the workloads in `workload_masks[i]`, and passes entries
+         * for other stages through to their queue.  A 0 mask, like a
+         * NULL array, executes everything.
+         */
+        const uint32_t *workload_masks;
+        /*
+         * If true, each worker exports per-program-point statistics
+         * for its context in its own shared memory region, for the
+         * duration of the run (see imsm_stats.h).
+         */
+        bool export_stats;
+        /*
+         * If true, each worker records per-program-point sojourn time
+         * histograms (see imsm_sojourn.h), which outlive the run.
+         */
+        bool record_sojourn;
+};
+
+/*
+ * Executes one poll pass for the context's imsm: calls the poll
+ * function, recycles the pass's imsm_lists, and resets the position.
+ */
+void imsm_poll(struct imsm_ctx *);
+
+/*
+ * Executes one poll pass with `imsm_poll`, unless the imsm's
+ * generation counter (`change_count`) hasn't moved since the
+ * context's last quiescent pass, i.e., the last pass during which
+ * nothing notified, woke, or freed anything in the imsm.
+ *
+ * Returns whether the poll function was called.
+ */
+bool imsm_poll_if_changed(struct imsm_ctx *);
+
+/*
+ * Executes the `imsm`'s poll function in a loop, on `opts->num_workers`
+ * threads (the caller's and new ones), until `imsm_stop` is called.
+ * Each worker has its own `imsm_ctx`.  `opts` may be NULL for a
+ * single worker that sleeps when idle.  Workers fire the imsm's due
+ * timeouts (imsm_timer.h) before waiting, and never wait past the
+ * next one.
+ *
+ * When more than one worker shares a machine, each wake-up must be
+ * armed by the worker that currently handles the state (e.g., with
+ * EPOLLONESHOT): a stray wake-up could otherwise dispatch the same
+ * state on two workers at once.  Stage deadlines aren't armed that
+ * way, so they need a single worker.
+ *
+ * Returns 0 once all workers have exited, or an error number if
+ * the worker threads could not be created.
+ */
+int imsm_run(struct imsm *, const struct imsm_driver_opts *);
+
+/*
+ * Executes each of the `num_shards` imsms in `shards` on its own
+ * worker thread, pinned to a CPU in the calling thread's affinity
+ * set (round-robin), until all shards are stopped with `imsm_stop`.
+ * Shards share nothing with each other, so every shard should have
+ * its own arena and event sources.  `opts->num_workers` and
+ * `opts->workload_masks` are ignored.
+ *
+ * Returns 0 once all shards have exited, or an error number if the
+ * shard threads could not be created.
+ */
+int imsm_run_sharded(struct imsm *const *shards, size_t num_shards,
+    const struct imsm_driver_opts *);
+
+/*
+ * Asks all workers in `imsm_run` (or the shard's worker in
+ * `imsm_run_sharded`) to exit after their current poll pass.
+ * Workers blocked in `wait_fn` only notice once it returns.
+ * Stopping is permanent.
+ */
+void imsm_stop(struct imsm *);
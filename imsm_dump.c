@@ -0,0 +1,343 @@
+#define _GNU_SOURCE
+
+#include "imsm_dump.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "imsm_sojourn.h"
+
+/* Number of states we snapshot at a time. */
+#define SNAPSHOT_CHUNK 4096
+
+/*
+ * Same clock as `imsm->staged_ns`.
+ */
+static uint64_t
+now_ns(void)
+{
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return now.tv_sec * 1000 * 1000 * 1000ULL + now.tv_nsec;
+}
+
+size_t
+imsm_snapshot(struct imsm *imsm, size_t *cursor,
+    struct imsm_state_info *dst, size_t capacity)
+{
+        struct imsm_ctx ctx = {
+                .imsm = imsm,
+        };
+        const size_t element_count = imsm->slab.element_count;
+        const uint64_t now = now_ns();
+        size_t i, ret = 0;
+
+        for (i = *cursor; i < element_count && ret < capacity; i++) {
+                const struct imsm_ppoint *ppoint = NULL;
+                struct imsm_entry *entry;
+                uint64_t staged, age = 0;
+                uint32_t version;
+                uint16_t queue_id;
+                uint8_t wakeup_pending;
+
+                entry = imsm_traverse(&ctx, i);
+                if (entry == NULL)
+                        continue;
+
+                /*
+                 * Seqlock-style read: only keep the fields if the
+                 * entry's version didn't change while we read them.
+                 */
+                version = __atomic_load_n(&entry->version, __ATOMIC_ACQUIRE);
+                queue_id = __atomic_load_n(&entry->queue_id, __ATOMIC_RELAXED);
+                wakeup_pending = __atomic_load_n(&entry->wakeup_pending,
+                    __ATOMIC_RELAXED);
+                staged = __atomic_load_n(&imsm->staged_ns[i],
+                    __ATOMIC_RELAXED);
+                __atomic_thread_fence(__ATOMIC_ACQUIRE);
+                if ((version & 1) == 0 ||
+                    __atomic_load_n(&entry->version, __ATOMIC_RELAXED) !=
+                    version)
+                        continue;
+
+                /* `staged_ns` is stale until the state enters a queue. */
+                if (queue_id < IMSM_MAX_QUEUES) {
+                        ppoint = __atomic_load_n(&imsm->queues[queue_id].ppoint,
+                            __ATOMIC_RELAXED);
+                        if (staged != 0 && now > staged)
+                                age = now - staged;
+                }
+
+                dst[ret++] = (struct imsm_state_info) {
+                        .ref = imsm_refer_index(imsm, i, version),
+                        .state = entry,
+                        .object_index = i,
+                        .queue_id = queue_id,
+                        .wakeup_pending = (wakeup_pending != 0),
+                        .ppoint = ppoint,
+                        .age_ns = age,
+                };
+        }
+
+        *cursor = i;
+        return ret;
+}
+
+void
+imsm_set_formatter(struct imsm *imsm, void (*format_fn)(FILE *, const void *))
+{
+
+        __atomic_store_n(&imsm->format_fn, format_fn, __ATOMIC_RELEASE);
+        return;
+}
+
+/*
+ * Sorts by queue id, then oldest first.
+ */
+static int
+info_queue_cmp(const void *x, const void *y)
+{
+        const struct imsm_state_info *a = x;
+        const struct imsm_state_info *b = y;
+
+        if (a->queue_id != b->queue_id)
+                return (a->queue_id < b->queue_id) ? -1 : 1;
+
+        if (a->age_ns != b->age_ns)
+                return (a->age_ns > b->age_ns) ? -1 : 1;
+
+        return 0;
+}
+
+/*
+ * Sorts oldest first.
+ */
+static int
+info_age_cmp(const void *x, const void *y)
+{
+        const struct imsm_state_info *a = x;
+        const struct imsm_state_info *b = y;
+
+        if (a->age_ns != b->age_ns)
+                return (a->age_ns > b->age_ns) ? -1 : 1;
+
+        return (a->object_index < b->object_index) ? -1 : 1;
+}
+
+/*
+ * Returns all the live states of `imsm` in a new array, and stores
+ * their number in `*n`.
+ */
+static struct imsm_state_info *
+snapshot_all(struct imsm *imsm, size_t *n)
+{
+        struct imsm_state_info *ret = NULL;
+        size_t cursor = 0, capacity = 0;
+
+        *n = 0;
+        while (cursor < imsm->slab.element_count) {
+                if (capacity - *n < SNAPSHOT_CHUNK) {
+                        struct imsm_state_info *grown;
+
+                        capacity += SNAPSHOT_CHUNK + capacity / 2;
+                        grown = realloc(ret, capacity * sizeof(*ret));
+                        if (grown == NULL)
+                                break;
+
+                        ret = grown;
+                }
+
+                *n += imsm_snapshot(imsm, &cursor, &ret[*n], SNAPSHOT_CHUNK);
+        }
+
+        return ret;
+}
+
+static void
+print_location(FILE *out, const struct imsm_ppoint *ppoint)
+{
+        char location[64];
+        const char *file;
+
+        if (ppoint == NULL) {
+                fprintf(out, "%-24s %-28s", "?", "");
+                return;
+        }
+
+        file = (ppoint->file != NULL) ? strrchr(ppoint->file, '/') : NULL;
+        file = (file != NULL) ? file + 1 : ppoint->file;
+        snprintf(location, sizeof(location), "%s:%zu",
+            (file != NULL) ? file : "", ppoint->lineno);
+        fprintf(out, "%-24s %-28s",
+            (ppoint->name != NULL) ? ppoint->name : "", location);
+        return;
+}
+
+static void
+dump_imsm(FILE *out, struct imsm *imsm, uint64_t min_age_ns)
+{
+        void (*format_fn)(FILE *, const void *);
+        struct imsm_state_info *infos;
+        size_t n;
+
+        infos = snapshot_all(imsm, &n);
+        fprintf(out, "imsm %zu: %zu live states out of %zu\n",
+            imsm->global_index, n, imsm->slab.element_count);
+        if (n == 0) {
+                free(infos);
+                return;
+        }
+
+        fprintf(out, "  %5s %-24s %-28s %8s %12s\n", "queue", "stage",
+            "location", "states", "oldest (ms)");
+        qsort(infos, n, sizeof(*infos), info_queue_cmp);
+        for (size_t begin = 0, end; begin < n; begin = end) {
+                const struct imsm_state_info *first = &infos[begin];
+
+                for (end = begin + 1;
+                     end < n && infos[end].queue_id == first->queue_id;
+                     end++)
+                        ;
+
+                if (first->queue_id == UINT16_MAX) {
+                        fprintf(out, "  %5s %-24s %-28s %8zu\n", "-",
+                            "(no queue)", "", end - begin);
+                        continue;
+                }
+
+                fprintf(out, "  %5u ", (unsigned int)first->queue_id);
+                print_location(out, first->ppoint);
+                fprintf(out, " %8zu %12.3f\n", end - begin,
+                    first->age_ns * 1e-6);
+        }
+
+        imsm_sojourn_print(out, imsm);
+        format_fn = __atomic_load_n(&imsm->format_fn, __ATOMIC_ACQUIRE);
+        qsort(infos, n, sizeof(*infos), info_age_cmp);
+        for (size_t i = 0; i < n && infos[i].age_ns >= min_age_ns; i++) {
+                const struct imsm_state_info *info = &infos[i];
+
+                fprintf(out, "  state %#llx index %zu queue ",
+                    (unsigned long long)info->ref.bits, info->object_index);
+                if (info->queue_id == UINT16_MAX)
+                        fprintf(out, "-");
+                else
+                        fprintf(out, "%u (%s)", (unsigned int)info->queue_id,
+                            (info->ppoint != NULL && info->ppoint->name != NULL)
+                            ? info->ppoint->name : "?");
+                fprintf(out, " age %.3f ms%s", info->age_ns * 1e-6,
+                    info->wakeup_pending ? " woken" : "");
+                if (format_fn != NULL) {
+                        fprintf(out, ": ");
+                        format_fn(out, info->state);
+                }
+
+                fprintf(out, "\n");
+        }
+
+        free(infos);
+        return;
+}
+
+void
+imsm_dump(FILE *out, uint64_t min_age_ns)
+{
+
+        for (size_t i = 1; i < IMSM_MAX_REGISTERED; i++) {
+                struct imsm *imsm = imsm_lookup(i);
+
+                if (imsm != NULL)
+                        dump_imsm(out, imsm, min_age_ns);
+        }
+
+        fflush(out);
+        return;
+}
+
+static struct {
+        int pipe[2];
+        FILE *out;
+        uint64_t min_age_ns;
+} dump_trigger = {
+        .pipe = { -1, -1 },
+};
+
+static void
+dump_signal_handler(int signo)
+{
+        int saved_errno = errno;
+        char byte = 0;
+        ssize_t r;
+
+        (void)signo;
+        r = write(dump_trigger.pipe[1], &byte, 1);
+        (void)r;
+        errno = saved_errno;
+        return;
+}
+
+static void *
+dump_thread(void *arg)
+{
+
+        (void)arg;
+        for (;;) {
+                char buf[64];
+                ssize_t r;
+
+                r = read(dump_trigger.pipe[0], buf, sizeof(buf));
+                if (r < 0 && errno == EINTR)
+                        continue;
+                if (r <= 0)
+                        return NULL;
+
+                imsm_dump(dump_trigger.out, dump_trigger.min_age_ns);
+        }
+}
+
+int
+imsm_dump_on_signal(int signo, FILE *out, uint64_t min_age_ns)
+{
+        struct sigaction action = {
+                .sa_handler = dump_signal_handler,
+                .sa_flags = SA_RESTART,
+        };
+        pthread_attr_t attr;
+        pthread_t thread;
+        int r;
+
+        if (dump_trigger.pipe[0] >= 0) {
+                errno = EBUSY;
+                return -1;
+        }
+
+        if (pipe2(dump_trigger.pipe, O_CLOEXEC) < 0)
+                return -1;
+
+        /* A burst of signals only needs one dump: never block the handler. */
+        fcntl(dump_trigger.pipe[1], F_SETFL, O_NONBLOCK);
+        dump_trigger.out = out;
+        dump_trigger.min_age_ns = min_age_ns;
+
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        r = pthread_create(&thread, &attr, dump_thread, NULL);
+        pthread_attr_destroy(&attr);
+        if (r != 0) {
+                close(dump_trigger.pipe[0]);
+                close(dump_trigger.pipe[1]);
+                dump_trigger.pipe[0] = dump_trigger.pipe[1] = -1;
+                errno = r;
+                return -1;
+        }
+
+        sigemptyset(&action.sa_mask);
+        return sigaction(signo, &action, NULL);
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+/*
+ * Introspection of live states.
+ *
+ * All the states of an imsm live in its slab's arena, so we can list
+ * them without any cooperation from the code that owns them: for each
+ * active entry, we report the queue it waits in, the program point of
+ * that queue, and how long ago it was staged there.
+ *
+ * Snapshots read entry headers while driver workers update them, and
+ * only keep entries whose version didn't change while we read them;
+ * they never block workers.  The result is a good approximation of
+ * the machine's state, not an atomic snapshot.
+ */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "imsm.h"
+
+struct imsm_state_info {
+        struct imsm_ref ref;
+        /* Live state struct; may change while we look at it. */
+        const void *state;
+        size_t object_index;
+        /* UINT16_MAX if the state isn't in any queue. */
+        uint16_t queue_id;
+        bool wakeup_pending;
+        /* Program point of `queue_id`'s stage, or NULL if unknown. */
+        const struct imsm_ppoint *ppoint;
+        /* Time since the state was staged in its queue, 0 if never. */
+        uint64_t age_ns;
+};
+
+/*
+ * Copies the status of up to `capacity` active states of `imsm` to
+ * `dst`, starting the scan at arena index `*cursor`, and advances
+ * `*cursor` past the last entry we examined.  The scan is complete
+ * once `*cursor` reaches `imsm->slab.element_count`.
+ *
+ * Returns the number of states written to `dst`.
+ */
+size_t imsm_snapshot(struct imsm *, size_t *cursor,
+    struct imsm_state_info *dst, size_t capacity);
+
+/*
+ * Registers a function to describe `imsm`'s states in dumps.  It is
+ * called from the dumping thread, on states that driver workers may
+ * be updating, so it should only print plain fields, and never follow
+ * pointers that might be freed concurrently.
+ */
+void imsm_set_formatter(struct imsm *, void (*)(FILE *, const void *state));
+
+/*
+ * Prints a summary of every registered imsm's live states, grouped by
+ * queue, the imsm's sojourn time quantiles, if any context records
+ * them, and each state that has been in its queue for at least
+ * `min_age_ns`, oldest first, to `out`.
+ */
+void imsm_dump(FILE *out, uint64_t min_age_ns);
+
+/*
+ * Installs a handler for `signo` that makes a background thread call
+ * `imsm_dump(out, min_age_ns)`: the handler only writes to a pipe, so
+ * the dump never runs in signal context, or on a driver thread.
+ *
+ * Returns 0 on success, -1 (with errno) on failure.
+ */
+int imsm_dump_on_signal(int signo, FILE *out, uint64_t min_age_ns);
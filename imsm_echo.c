@@ -3,6 +3,8 @@
 #include <assert.h>
 #include <errno.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -14,35 +16,122 @@
 #include <unistd.h>
 
 #include "imsm.h"
+#include "imsm_buf.h"
+#include "imsm_driver.h"
+#include "imsm_dump.h"
+#include "imsm_gather.h"
 
 #define ACCEPT_BUFFER 32
 
 #define BUF_SIZE 200
 
+/*
+ * With a single worker, connections have 10 seconds to send their
+ * line once accepted, and as long to read back its echo.
+ */
+#define ECHO_TIMEOUT_NS (10 * 1000 * 1000 * 1000ULL)
+
+/*
+ * When we run out of buffers, connections back off for 1 ms at
+ * first, then up to 100 ms between attempts.
+ */
+#define BUF_BACKOFF_NS (1000 * 1000ULL)
+#define BUF_BACKOFF_MAX_NS (100 * 1000 * 1000ULL)
+
 enum io_result {
         IO_RESULT_DONE = 0,
         IO_RESULT_RETRY,
+        /* Retry once the state's back-off delay is over. */
+        IO_RESULT_BACKOFF,
         IO_RESULT_ABORT
 };
 
 struct echo_state {
         struct imsm_entry header;
         int fd;
+        /*
+         * EPOLLIN and EPOLLOUT bits for edge-triggered registrations:
+         * set by epoll events, cleared when a syscall would block.
+         */
+        uint32_t ready;
         uint8_t in_index;
         uint8_t newline_index;
-        uint8_t out_index;
-        char buf[BUF_SIZE];
+        /*
+         * Only attached while we're reading or writing a line, so
+         * idle connections don't pin any buffer.
+         */
+        struct imsm_buf *buf;
+        struct imsm_gather out;
 };
 
-static int accept_fd;
-static int epoll_fd;
+/*
+ * Allow up to 128 concurrent echo state machines per shard.
+ */
+#define NUM_ECHO_STATES 128
+
+/*
+ * Each stage dispatches at most 32 states per poll, and we stop
+ * accepting connections while half the states wait to write back to
+ * slow peers.
+ */
+#define ECHO_MAX_BATCH 32
+#define ECHO_MAX_WRITE_DEPTH (NUM_ECHO_STATES / 2)
 
-static IMSM(, struct echo_state) echo;
+/*
+ * Each shard is a fully independent echo server, with its own state
+ * machine, listening socket, and epoll set.  The threaded mode runs
+ * multiple workers on a single shard.
+ *
+ * Shards with a single worker register each connection once, with
+ * EPOLLET, and track readiness in the states.  With multiple workers,
+ * only the worker that handles a state may arm its wake-ups, so we
+ * re-arm with EPOLLONESHOT after every retry instead.
+ */
+struct echo_shard {
+        IMSM(, struct echo_state) echo;
+        int accept_fd;
+        int epoll_fd;
+        bool edge_triggered;
+        /*
+         * Set by the (edge-triggered) accept fd's events, and left
+         * set while we couldn't drain the backlog.
+         */
+        bool accept_ready;
+        /* Number of allocated echo states. */
+        size_t num_live;
+        struct echo_state *backing;
+        struct imsm_buf_pool bufs;
+        /* One buffer cache per worker, indexed by `worker_index`. */
+        struct imsm_buf_cache *buf_caches;
+        struct imsm_stage_limits read_limits;
+        struct imsm_stage_limits write_limits;
+};
 
 /*
- * Allow up to 128 concurrent echo state machines.
+ * Returns the shard for the context's state machine.
  */
-static struct echo_state backing[128];
+static struct echo_shard *
+echo_shard_of(struct imsm_ctx *ctx)
+{
+
+        return (struct echo_shard *)((char *)ctx->imsm -
+            __builtin_offsetof(struct echo_shard, echo.imsm));
+}
+
+/*
+ * Detaches the state's I/O buffer, if any, and returns it to the
+ * shard's pool.
+ */
+static void
+echo_state_release_buf(struct imsm_ctx *ctx, struct echo_state *state)
+{
+        struct echo_shard *shard = echo_shard_of(ctx);
+
+        imsm_buf_put(&shard->bufs, &shard->buf_caches[ctx->worker_index],
+            state->buf);
+        state->buf = NULL;
+        return;
+}
 
 static void
 echo_state_init(void *vstate)
@@ -50,9 +139,11 @@ echo_state_init(void *vstate)
         struct echo_state *state = vstate;
 
         state->fd = -1;
+        state->ready = 0;
         state->in_index = 0;
         state->newline_index = 0;
-        state->out_index = 0;
+        state->buf = NULL;
+        imsm_gather_reset(&state->out);
         return;
 }
 
@@ -61,6 +152,8 @@ echo_state_deinit(void *vstate)
 {
         struct echo_state *state = vstate;
 
+        assert(state->buf == NULL &&
+            "Echo states must release their buffer before IMSM_PUT.");
         if (state->fd >= 0)
                 close(state->fd);
 
@@ -69,18 +162,36 @@ echo_state_deinit(void *vstate)
 }
 
 /*
- * Attaches the accept fd to the epoll fd.
+ * Describes a live state for `imsm_dump`: only plain fields, since
+ * the state may change under us.
+ */
+static void
+echo_state_format(FILE *out, const void *vstate)
+{
+        const struct echo_state *state = vstate;
+
+        fprintf(out, "fd %d ready %#x read %u newline %u%s",
+            state->fd, (unsigned int)state->ready,
+            (unsigned int)state->in_index, (unsigned int)state->newline_index,
+            (state->buf != NULL) ? " buffered" : "");
+        return;
+}
+
+/*
+ * Attaches the shard's accept fd to its epoll fd.  We only want to
+ * hear about new connections: `accept_ready` remembers any backlog
+ * we couldn't accept yet.
  */
 static void
-attach_accept_fd(void)
+attach_accept_fd(struct echo_shard *shard)
 {
         struct epoll_event event = {
-                .events = EPOLLIN,
+                .events = EPOLLIN | EPOLLET,
                 .data.u64 = 0,
         };
         int r;
 
-        r = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, accept_fd, &event);
+        r = epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, shard->accept_fd, &event);
         if (r < 0) {
                 perror("epoll_ctl");
                 abort();
@@ -90,16 +201,22 @@ attach_accept_fd(void)
 }
 
 /*
- * Registers `fd` with the epoll fd, without waiting on any event in
- * particular.
+ * Registers `fd` with the shard's epoll fd.  Edge-triggered shards
+ * wait for all events for `ref` once and for all; otherwise, we don't
+ * wait on any event in particular until `epoll_arm`.
  */
 static void
-epoll_register(int fd)
+epoll_register(struct echo_shard *shard, struct imsm_ref ref, int fd)
 {
         struct epoll_event event = { 0 };
         int r;
 
-        r = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+        if (shard->edge_triggered) {
+                event.events = EPOLLET | EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+                event.data.u64 = ref.bits;
+        }
+
+        r = epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, fd, &event);
         if (r < 0) {
                 perror("epollctl");
                 abort();
@@ -114,7 +231,8 @@ epoll_register(int fd)
  * epoll handling loop wake the corresponding echo state machine.
  */
 static void
-epoll_arm(struct imsm_ref ref, int fd, uint32_t events)
+epoll_arm(struct echo_shard *shard, struct imsm_ref ref, int fd,
+    uint32_t events)
 {
         struct epoll_event event = {
                 .events = events | EPOLLONESHOT,
@@ -122,7 +240,7 @@ epoll_arm(struct imsm_ref ref, int fd, uint32_t events)
         };
         int r;
 
-        r = epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event);
+        r = epoll_ctl(shard->epoll_fd, EPOLL_CTL_MOD, fd, &event);
         if (r < 0) {
                 perror("epoll_ctl");
                 abort();
@@ -135,6 +253,7 @@ static void
 handle_io_result(struct echo_state **done, struct imsm_ctx *ctx,
     struct echo_state *current, uint32_t events, enum io_result result)
 {
+        struct echo_shard *shard = echo_shard_of(ctx);
         IMSM_CTX_PTR(ctx);
 
         switch (result) {
@@ -143,18 +262,72 @@ handle_io_result(struct echo_state **done, struct imsm_ctx *ctx,
                         break;
 
                 case IO_RESULT_RETRY:
-                        epoll_arm(IMSM_REFER(current), current->fd, events);
+                        /* Edge-triggered states will get an event. */
+                        if (!shard->edge_triggered)
+                                epoll_arm(shard, IMSM_REFER(current),
+                                    current->fd, events);
+                        break;
+
+                case IO_RESULT_BACKOFF:
+                        /* The timing wheel will wake the state up. */
                         break;
 
                 case IO_RESULT_ABORT:
                 default:
-                        IMSM_PUT(&echo, current);
+                        echo_state_release_buf(ctx, current);
+                        IMSM_PUT(&shard->echo, current);
+                        __atomic_sub_fetch(&shard->num_live, 1,
+                            __ATOMIC_RELAXED);
                         break;
         }
 
         return;
 }
 
+/*
+ * Closes connections that timed out in a stage.
+ */
+static void
+close_timed_out(struct imsm_ctx *ctx, struct echo_state **timed_out)
+{
+        struct echo_shard *shard = echo_shard_of(ctx);
+        IMSM_CTX_PTR(ctx);
+
+        imsm_list_foreach(current, timed_out)
+                echo_state_release_buf(ctx, current);
+        __atomic_sub_fetch(&shard->num_live, imsm_list_size(timed_out),
+            __ATOMIC_RELAXED);
+        IMSM_PUT_N(&shard->echo, timed_out, imsm_list_size(timed_out));
+        return;
+}
+
+/*
+ * Calls `fn` on `state` until it's done, or fails, or would block.
+ *
+ * With edge-triggered registrations, we must keep going until the
+ * syscall would block (which clears the relevant `ready` bit), and
+ * don't even try while that bit is clear.
+ */
+static enum io_result
+perform_io(struct imsm_ctx *ctx, struct echo_state *state, uint32_t ready_bit,
+    enum io_result (*fn)(struct imsm_ctx *, struct echo_state *))
+{
+        struct echo_shard *shard = echo_shard_of(ctx);
+        enum io_result result;
+
+        if (!shard->edge_triggered)
+                return fn(ctx, state);
+
+        do {
+                if ((state->ready & ready_bit) == 0)
+                        return IO_RESULT_RETRY;
+
+                result = fn(ctx, state);
+        } while (result == IO_RESULT_RETRY);
+
+        return result;
+}
+
 #define echo_list_map(IN, EVENTS, VAR, EXPRESSION)                      \
         ({                                                              \
                 struct echo_state *const *list_in_ = (IN);              \
@@ -170,69 +343,156 @@ handle_io_result(struct echo_state **done, struct imsm_ctx *ctx,
         })
 
 /*
- * Accepts up to `batch_limit` new connections and returns them as an
- * imsm_list of echo states.
+ * Returns how many connections we should accept in this pass: the
+ * listening socket's backlog, capped by the number of free echo
+ * states and by ACCEPT_BUFFER.
+ */
+static size_t
+accept_batch_size(struct echo_shard *shard, size_t *backlog)
+{
+        struct tcp_info info;
+        socklen_t info_size = sizeof(info);
+        size_t live, ret;
+
+        live = __atomic_load_n(&shard->num_live, __ATOMIC_RELAXED);
+        ret = (live < NUM_ECHO_STATES) ? NUM_ECHO_STATES - live : 0;
+        if (ret > ACCEPT_BUFFER)
+                ret = ACCEPT_BUFFER;
+
+        /*
+         * For listening sockets, `tcpi_unacked` is the accept queue's
+         * length.  If we can't get it, assume there's always more, and
+         * accept until EAGAIN.  We need the backlog even when we're out
+         * of states: a full accept queue won't trigger any new edge.
+         */
+        *backlog = SIZE_MAX;
+        if (getsockopt(shard->accept_fd, IPPROTO_TCP, TCP_INFO,
+            &info, &info_size) == 0)
+                *backlog = info.tcpi_unacked;
+
+        return (*backlog < ret) ? *backlog : ret;
+}
+
+/*
+ * Accepts a batch of new connections if the accept fd is ready, and
+ * returns them as an imsm_list of echo states.  We only accept a
+ * connection once we hold a state for it: if we run out, the rest of
+ * the batch stays in the kernel's backlog.  We also leave new
+ * connections in the backlog while the write stage is full.
  */
 static struct echo_state **
-accept_new_connections(struct imsm_ctx *ctx, size_t batch_limit)
+accept_new_connections(struct imsm_ctx *ctx)
 {
+        struct echo_shard *shard = echo_shard_of(ctx);
         struct echo_state **ret;
+        size_t batch_size, backlog;
+        size_t num_accepted = 0;
+        bool out_of_states = false;
         IMSM_CTX_PTR(ctx);
 
-        ret = IMSM_LIST_GET(struct echo_state, batch_limit);
-        for (size_t i = 0; i < batch_limit; i++) {
+        if (__atomic_load_n(&shard->write_limits.full, __ATOMIC_RELAXED) ||
+            !__atomic_exchange_n(&shard->accept_ready, false,
+            __ATOMIC_ACQUIRE))
+                return NULL;
+
+        batch_size = accept_batch_size(shard, &backlog);
+        ret = IMSM_LIST_GET(struct echo_state, batch_size);
+        for (; num_accepted < batch_size; num_accepted++) {
                 struct echo_state *state;
                 int new_connection;
                 bool success;
 
-                state = IMSM_GET(&echo);
-                if (state == NULL)
+                /*
+                 * Other workers' caches may hold the remaining free
+                 * states.  Leave the connection in the backlog until
+                 * one of them is released.
+                 */
+                state = IMSM_GET(&shard->echo);
+                if (state == NULL) {
+                        out_of_states = true;
                         break;
+                }
 
-                new_connection = accept4(accept_fd, NULL, NULL,
+                new_connection = accept4(shard->accept_fd, NULL, NULL,
                     SOCK_NONBLOCK | SOCK_CLOEXEC);
                 if (new_connection < 0) {
                         if (errno != EAGAIN && errno != EWOULDBLOCK)
                                 perror("accept4");
-                        IMSM_PUT(&echo, state);
+                        IMSM_PUT(&shard->echo, state);
                         break;
                 }
 
-                epoll_register(new_connection);
+                __atomic_add_fetch(&shard->num_live, 1, __ATOMIC_RELAXED);
+                /* Optimistically try to read before the first event. */
                 state->fd = new_connection;
+                state->ready = EPOLLIN | EPOLLOUT;
+                epoll_register(shard, IMSM_REFER(state), new_connection);
                 state->in_index = 0;
                 state->newline_index = 0;
-                state->out_index = 0;
                 success = imsm_list_push(ret, state, 0);
                 assert(success && "imsm_list_push failed.");
         }
 
+        /*
+         * If we couldn't drain the backlog, come back in the next
+         * pass or, if we're out of states, once a state is released
+         * (which bumps the generation counter).  When our get failed
+         * with free states left, they're in other workers' caches:
+         * the wake-up lets these workers accept instead.
+         */
+        if (out_of_states ||
+            (num_accepted == batch_size && batch_size < backlog)) {
+                __atomic_store_n(&shard->accept_ready, true,
+                    __ATOMIC_RELEASE);
+                if (__atomic_load_n(&shard->num_live, __ATOMIC_RELAXED) <
+                    NUM_ECHO_STATES)
+                        imsm_wake(ctx->imsm);
+        }
+
         return ret;
 }
 
 /*
  * Attempts to read a line (or 200 characters) for this echo state
- * machine.
+ * machine.  The state only gets a buffer once there is something to
+ * read, and gives it back if it hasn't read anything yet when the
+ * socket runs dry.  If all buffers are in use, the state backs off
+ * and tries again later.
  */
 static enum io_result
-read_one_line(struct echo_state *state)
+read_one_line(struct imsm_ctx *ctx, struct echo_state *state)
 {
+        struct echo_shard *shard = echo_shard_of(ctx);
         void *dst;
         char *newline;
         size_t to_read;
         ssize_t num_recv;
 
-        if (state->in_index >= sizeof(state->buf)) {
-                state->newline_index = sizeof(state->buf);
+        if (state->in_index >= BUF_SIZE) {
+                state->newline_index = BUF_SIZE;
                 return IO_RESULT_DONE;
         }
 
-        dst = &state->buf[state->in_index];
-        to_read = sizeof(state->buf) - state->in_index;
+        if (state->buf == NULL) {
+                state->buf = imsm_buf_get(&shard->bufs,
+                    &shard->buf_caches[ctx->worker_index], BUF_SIZE);
+                if (state->buf == NULL) {
+                        imsm_backoff(ctx, state, BUF_BACKOFF_NS,
+                            BUF_BACKOFF_MAX_NS);
+                        return IO_RESULT_BACKOFF;
+                }
+        }
+
+        dst = &state->buf->data[state->in_index];
+        to_read = BUF_SIZE - state->in_index;
         num_recv = recv(state->fd, dst, to_read, MSG_DONTWAIT);
         if (num_recv < 0) {
-                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                        state->ready &= ~EPOLLIN;
+                        if (state->in_index == 0)
+                                echo_state_release_buf(ctx, state);
                         return IO_RESULT_RETRY;
+                }
 
                 perror("recv");
                 return IO_RESULT_ABORT;
@@ -241,11 +501,11 @@ read_one_line(struct echo_state *state)
         state->in_index += num_recv;
         newline = memchr(dst, '\n', num_recv);
         if (newline != NULL) {
-                state->newline_index = newline - &state->buf[0];
+                state->newline_index = newline - &state->buf->data[0];
                 return IO_RESULT_DONE;
         }
 
-        if (num_recv == 0 || state->in_index == sizeof(state->buf)) {
+        if (num_recv == 0 || state->in_index == BUF_SIZE) {
                 state->newline_index = state->in_index;
                 return IO_RESULT_DONE;
         }
@@ -253,12 +513,31 @@ read_one_line(struct echo_state *state)
         return IO_RESULT_RETRY;
 }
 
+/*
+ * Queues the echo state machine's line, followed by a newline, in
+ * its output gather once the line is fully read.
+ */
+static enum io_result
+queue_echo(struct echo_state *state, enum io_result result)
+{
+        static const char newline[1] = "\n";
+
+        if (result != IO_RESULT_DONE)
+                return result;
+
+        imsm_gather_reset(&state->out);
+        imsm_gather_push(&state->out, state->buf->data, state->newline_index);
+        imsm_gather_push(&state->out, newline, sizeof(newline));
+        return result;
+}
+
 /*
  * Reads data for echo state machines until their buffer size is
  * exhausted, or a newline character is found.
  *
  * `accepted` state machines are added to the set of echo state
- * machines waiting to read the first line.
+ * machines waiting to read the first line.  With a single worker,
+ * they're closed if they don't get there within ECHO_TIMEOUT_NS.
  *
  * Returns a list of state machines that have fully read their
  * input line and are ready to spit it back to the peer.
@@ -266,53 +545,67 @@ read_one_line(struct echo_state *state)
 static struct echo_state **
 read_first_line(struct imsm_ctx *ctx, struct echo_state **accepted)
 {
+        struct echo_shard *shard = echo_shard_of(ctx);
+        struct echo_state **ready, **timed_out;
         IMSM_CTX_PTR(ctx);
 
         IMSM_REGION("read_first_line");
-        return echo_list_map(IMSM_STAGE("ready_to_read", accepted, 0),
-            EPOLLIN | EPOLLRDHUP, current, read_one_line(current));
+        if (shard->edge_triggered) {
+                ready = IMSM_STAGE_TIMEOUT_LIMITED("ready_to_read",
+                    accepted, 0, ECHO_TIMEOUT_NS, &timed_out,
+                    &shard->read_limits);
+                close_timed_out(ctx, timed_out);
+        } else {
+                /* Deadlines need a single worker (see imsm_timer.h). */
+                ready = IMSM_STAGE_LIMITED("ready_to_read", accepted, 0,
+                    &shard->read_limits);
+        }
+
+        return echo_list_map(ready, EPOLLIN | EPOLLRDHUP, current,
+            queue_echo(current,
+                perform_io(ctx, current, EPOLLIN, read_one_line)));
 }
 
 /*
- * Attemps to write (the rest of) the echo state machine's line to the
- * remote peer.
+ * Attemps to write (the rest of) the echo state machine's line and
+ * newline to the remote peer, with a single syscall.
  */
 static enum io_result
-write_one_line(struct echo_state *state)
+write_one_line(struct imsm_ctx *ctx, struct echo_state *state)
 {
-        void *buf = &state->buf[state->out_index];
-        size_t to_write;
         ssize_t sent;
 
-        if (state->out_index >= state->newline_index)
+        (void)ctx;
+        if (imsm_gather_pending(&state->out) == 0)
                 return IO_RESULT_DONE;
 
-        to_write = state->newline_index - state->out_index;
-        sent = send(state->fd, buf, to_write, MSG_DONTWAIT | MSG_NOSIGNAL);
+        sent = imsm_gather_flush(&state->out, state->fd);
         if (sent < 0) {
-                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                        state->ready &= ~EPOLLOUT;
                         return IO_RESULT_RETRY;
+                }
 
-                perror("send");
+                perror("sendmsg");
                 return IO_RESULT_ABORT;
         }
 
         if (sent == 0)
                 return IO_RESULT_DONE;
 
-        state->out_index += sent;
-        if (state->out_index < state->newline_index)
+        if (imsm_gather_pending(&state->out) > 0)
                 return IO_RESULT_RETRY;
 
         return IO_RESULT_DONE;
 }
 
 /*
- * Spits back the echo line to the remote for all echo state machines
- * that are ready to write.
+ * Spits back the echo line and a newline to the remote for all echo
+ * state machines that are ready to write.
  *
  * `fully_read` are added to the the list of state machines ready to
- * write.
+ * write.  With a single worker, they're closed if they can't write
+ * within ECHO_TIMEOUT_NS.
  *
  * Returns a list of all state machines have fully written their echo
  * line.
@@ -320,93 +613,118 @@ write_one_line(struct echo_state *state)
 static struct echo_state **
 echo_line(struct imsm_ctx *ctx, struct echo_state **fully_read)
 {
+        struct echo_shard *shard = echo_shard_of(ctx);
+        struct echo_state **ready, **timed_out;
         IMSM_CTX_PTR(ctx);
 
         IMSM_REGION("echo_line");
-        return echo_list_map(IMSM_STAGE("ready_to_write", fully_read, 0),
-            EPOLLOUT | EPOLLRDHUP, current, write_one_line(current));
-}
-
-static enum io_result
-print_one_newline(struct echo_state *state)
-{
-        static const char buf[1] = "\n";
-        ssize_t sent;
-
-        sent = send(state->fd, buf, sizeof(buf), MSG_DONTWAIT | MSG_NOSIGNAL);
-        if (sent < 0) {
-                if (errno == EAGAIN || errno == EWOULDBLOCK)
-                        return IO_RESULT_RETRY;
-
-                perror("send");
-                return IO_RESULT_ABORT;
+        if (shard->edge_triggered) {
+                ready = IMSM_STAGE_TIMEOUT_LIMITED("ready_to_write",
+                    fully_read, 0, ECHO_TIMEOUT_NS, &timed_out,
+                    &shard->write_limits);
+                close_timed_out(ctx, timed_out);
+        } else {
+                /* Deadlines need a single worker (see imsm_timer.h). */
+                ready = IMSM_STAGE_LIMITED("ready_to_write", fully_read, 0,
+                    &shard->write_limits);
         }
 
-        return IO_RESULT_DONE;
+        return echo_list_map(ready, EPOLLOUT | EPOLLRDHUP, current,
+            perform_io(ctx, current, EPOLLOUT, write_one_line));
 }
 
-static struct echo_state **
-print_newline(struct imsm_ctx *ctx, struct echo_state **fully_written)
+/*
+ * Fully scans the echo state machine once.
+ */
+static void
+echo_fn(struct imsm_ctx *ctx)
 {
+        struct echo_shard *shard = echo_shard_of(ctx);
+        struct echo_state **accepted, **fully_read, **done;
         IMSM_CTX_PTR(ctx);
 
-        IMSM_REGION("print_newline");
-        return echo_list_map(IMSM_STAGE("ready_to_newline", fully_written, 0),
-            EPOLLOUT | EPOLLRDHUP, current, print_one_newline(current));
+        accepted = accept_new_connections(ctx);
+        fully_read = read_first_line(ctx, accepted);
+        done = echo_line(ctx, fully_read);
+
+        imsm_list_foreach(current, done)
+                echo_state_release_buf(ctx, current);
+        __atomic_sub_fetch(&shard->num_live, imsm_list_size(done),
+            __ATOMIC_RELAXED);
+        IMSM_PUT_N(&shard->echo, done, imsm_list_size(done));
+        return;
 }
 
 /*
- * Fully scans the echo state machine once.
+ * Records the readiness bits in an edge-triggered `events` for the
+ * state in `ref`.  Only the shard's single worker reads or writes
+ * `ready`, so we don't need atomics.
  */
 static void
-echo_fn(struct imsm_ctx *ctx)
+update_readiness(struct imsm_ref ref, uint32_t events)
 {
-        struct echo_state **accepted, **fully_read, **echoed, **done;
-        IMSM_CTX_PTR(ctx);
+        struct echo_state *state;
 
-        accepted = accept_new_connections(ctx, ACCEPT_BUFFER);
-        fully_read = read_first_line(ctx, accepted);
-        echoed = echo_line(ctx, fully_read);
-        done = print_newline(ctx, echoed);
+        /* `header` is the first member of `struct echo_state`. */
+        state = (struct echo_state *)imsm_deref(ref);
+        if (state == NULL)
+                return;
+
+        /* Let the stages see errors and hang-ups with a syscall. */
+        if (events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))
+                events |= EPOLLIN | EPOLLOUT;
 
-        IMSM_PUT_N(&echo, done, imsm_list_size(done));
+        state->ready |= events & (EPOLLIN | EPOLLOUT);
         return;
 }
 
+/*
+ * Waits for epoll events for up to `timeout_ns`, and wakes the
+ * corresponding echo state machines.
+ */
 static void
-run_echo_loop(void)
+echo_wait(struct imsm_ctx *ctx, uint64_t timeout_ns, void *arg)
 {
-        struct imsm_ctx ctx = {
-                .imsm = &echo.imsm,
-        };
+        struct echo_shard *shard = echo_shard_of(ctx);
+        struct epoll_event events[32];
+        int timeout_ms;
+        int r;
 
-        for (;;) {
-                struct epoll_event events[32];
-                int r;
+        (void)arg;
+        /* Round up to the next millisecond, without overflowing. */
+        if (timeout_ns > 1000 * 1000 * 1000ULL)
+                timeout_ns = 1000 * 1000 * 1000ULL;
+        timeout_ms = (timeout_ns + 999999) / 1000000;
+
+        r = epoll_wait(shard->epoll_fd, events,
+                       sizeof(events) / sizeof(events[0]),
+                       timeout_ms);
+        if (r < 0 && errno != EINTR) {
+                perror("epoll");
+                abort();
+        }
 
-                r = epoll_wait(epoll_fd, events, sizeof(events) / sizeof(events[0]),
-                               1000);
-                if (r < 0 && errno != EINTR) {
-                        perror("epoll");
-                        abort();
-                }
+        for (size_t i = 0, n = (r > 0) ? r : 0; i < n; i++) {
+                struct imsm_ref ref = { events[i].data.u64 };
 
-                if (r > 0) {
-                        for (size_t i = 0, n = r; i < n; i++)
-                                imsm_notify((struct imsm_ref){events[i].data.u64});
+                /* The NULL reference is the accept fd. */
+                if (ref.bits == 0) {
+                        __atomic_store_n(&shard->accept_ready, true,
+                            __ATOMIC_RELEASE);
+                        imsm_wake(ctx->imsm);
+                        continue;
                 }
 
-                echo.imsm.poll_fn(&ctx);
-                imsm_list_cache_recycle(&ctx.cache);
-                ctx.position = (struct imsm_ppoint_record) { 0 };
+                if (shard->edge_triggered)
+                        update_readiness(ref, events[i].events);
+                imsm_notify(ref);
         }
 
-        imsm_list_cache_deinit(&ctx.cache);
         return;
 }
 
 static int
-make_accept_fd(int port)
+make_accept_fd(int port, bool reuse_port)
 {
         struct sockaddr_in sock = { 0 };
         int one = 1;
@@ -427,6 +745,13 @@ make_accept_fd(int port)
                 abort();
         }
 
+        /* Let the kernel spread incoming connections between shards. */
+        if (reuse_port &&
+            setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+                perror("setsockopt");
+                abort();
+        }
+
         if (bind(fd, (struct sockaddr *)&sock, sizeof(sock)) < 0) {
                 perror("bind");
                 abort();
@@ -437,28 +762,164 @@ make_accept_fd(int port)
                 abort();
         }
 
-        printf("Listening on port %i\n", port);
         return fd;
 }
 
-int
-main(int argc, char **argv)
+/*
+ * Initializes a shard with its own arena, listening socket and epoll
+ * set.
+ */
+static void
+echo_shard_init(struct echo_shard *shard, int port, bool reuse_port,
+    size_t num_workers)
 {
 
-        if (argc < 2)
-                return -1;
-
-        accept_fd = make_accept_fd(atoi(argv[1]));
-        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
-        if (epoll_fd < 0) {
+        shard->accept_fd = make_accept_fd(port, reuse_port);
+        shard->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (shard->epoll_fd < 0) {
                 perror("epoll_create");
                 abort();
         }
 
-        attach_accept_fd();
+        attach_accept_fd(shard);
+        shard->edge_triggered = (num_workers <= 1);
+        shard->accept_ready = true;
+        shard->read_limits = (struct imsm_stage_limits) {
+                .max_batch = ECHO_MAX_BATCH,
+        };
+        shard->write_limits = (struct imsm_stage_limits) {
+                .max_batch = ECHO_MAX_BATCH,
+                .max_depth = ECHO_MAX_WRITE_DEPTH,
+        };
+
+        shard->backing = calloc(NUM_ECHO_STATES, sizeof(*shard->backing));
+        if (shard->backing == NULL) {
+                perror("calloc");
+                abort();
+        }
 
-        IMSM_INIT(&echo, header, backing, sizeof(backing),
+        /*
+         * Enough BUF_SIZE buffers for every state.  Larger classes get
+         * as many bytes, so they only hold a few buffers each.
+         */
+        shard->buf_caches = calloc(num_workers, sizeof(*shard->buf_caches));
+        if (shard->buf_caches == NULL ||
+            !imsm_buf_pool_init(&shard->bufs,
+                NUM_ECHO_STATES * imsm_buf_class_size(BUF_SIZE))) {
+                perror("imsm_buf_pool_init");
+                abort();
+        }
+
+        IMSM_INIT(&shard->echo, header, shard->backing,
+            NUM_ECHO_STATES * sizeof(*shard->backing),
             echo_state_init, echo_state_deinit, echo_fn);
-        run_echo_loop();
+        imsm_set_formatter(&shard->echo.imsm, echo_state_format);
+        return;
+}
+
+static const struct imsm_driver_opts echo_driver_opts = {
+        .idle_policy = IMSM_IDLE_SLEEP,
+        .wait_fn = echo_wait,
+        .export_stats = true,
+        .record_sojourn = true,
+};
+
+/*
+ * Runs `num_workers` threads on a single shared echo state machine.
+ */
+static void
+run_echo_threaded(int port, size_t num_workers)
+{
+        struct imsm_driver_opts opts = echo_driver_opts;
+        struct echo_shard *shard;
+        int r;
+
+        shard = calloc(1, sizeof(*shard));
+        if (shard == NULL) {
+                perror("calloc");
+                abort();
+        }
+
+        echo_shard_init(shard, port, false, num_workers);
+        printf("Listening on port %i\n", port);
+
+        opts.num_workers = num_workers;
+        r = imsm_run(&shard->echo.imsm, &opts);
+        if (r != 0) {
+                errno = r;
+                perror("imsm_run");
+                abort();
+        }
+
+        return;
+}
+
+/*
+ * Runs `num_shards` independent echo state machines, each pinned to
+ * its own CPU, with its own SO_REUSEPORT listening socket.
+ */
+static void
+run_echo_sharded(int port, size_t num_shards)
+{
+        struct echo_shard *shards;
+        struct imsm **machines;
+        int r;
+
+        shards = calloc(num_shards, sizeof(*shards));
+        machines = calloc(num_shards, sizeof(*machines));
+        if (shards == NULL || machines == NULL) {
+                perror("calloc");
+                abort();
+        }
+
+        for (size_t i = 0; i < num_shards; i++) {
+                echo_shard_init(&shards[i], port, true, 1);
+                machines[i] = &shards[i].echo.imsm;
+        }
+
+        printf("Listening on port %i with %zu shards\n", port, num_shards);
+        r = imsm_run_sharded(machines, num_shards, &echo_driver_opts);
+        if (r != 0) {
+                errno = r;
+                perror("imsm_run_sharded");
+                abort();
+        }
+
+        return;
+}
+
+/*
+ * Usage: imsm_echo PORT [NUM_THREADS [threaded|sharded]]
+ *
+ * The threaded mode (default) runs NUM_THREADS workers on one state
+ * machine, and the sharded mode one state machine per thread.
+ *
+ * SIGUSR1 dumps every live connection state to stderr.
+ */
+int
+main(int argc, char **argv)
+{
+        size_t num_threads = 1;
+        bool sharded = false;
+        int port;
+
+        if (argc < 2)
+                return -1;
+
+        port = atoi(argv[1]);
+        if (argc > 2)
+                num_threads = strtoul(argv[2], NULL, 10);
+        if (num_threads == 0)
+                num_threads = 1;
+        if (argc > 3)
+                sharded = (strcmp(argv[3], "sharded") == 0);
+
+        if (imsm_dump_on_signal(SIGUSR1, stderr, 0) < 0)
+                perror("imsm_dump_on_signal");
+
+        if (sharded)
+                run_echo_sharded(port, num_threads);
+        else
+                run_echo_threaded(port, num_threads);
         return 0;
 }
@@ -0,0 +1,439 @@
+#define _GNU_SOURCE
+
+/*
+ * Load generator for imsm_echo: opens many loopback connections,
+ * sends one line on each (the echo server answers one line per
+ * connection), and records the latency until the echoed line comes
+ * back and the server closes the connection.
+ *
+ * In closed-loop mode (the default), each of the CONNECTIONS slots
+ * starts a new request as soon as its previous one completes.  In
+ * open-loop mode (-r RATE), requests are scheduled at a fixed rate,
+ * regardless of completions, and latencies are measured from each
+ * request's scheduled start, so a stalled server can't hide its
+ * queueing delay by slowing the generator down.
+ *
+ * Prints a human-readable summary to stderr, and a one-line JSON
+ * object to stdout, to compare runs over time.
+ */
+#include <assert.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "imsm_hist.h"
+
+#define LINE_SIZE 64
+
+/* How long we wait for in-flight requests once the run is over. */
+#define DRAIN_NS (2 * 1000 * 1000 * 1000ULL)
+
+enum conn_state {
+        CONN_IDLE = 0,
+        CONN_CONNECTING,
+        CONN_WAITING,
+};
+
+struct conn {
+        int fd;
+        enum conn_state state;
+        uint8_t line_size;
+        uint8_t received;
+        /* When the request started, or was scheduled to. */
+        uint64_t start_ns;
+        char line[LINE_SIZE];
+        char reply[LINE_SIZE];
+};
+
+struct load {
+        struct sockaddr_in server;
+        int epoll_fd;
+        size_t num_conns;
+        struct conn *conns;
+        /* Stack of idle connection slots. */
+        size_t num_idle;
+        size_t *idle;
+        uint64_t next_seq;
+        uint64_t num_started;
+        uint64_t num_completed;
+        uint64_t num_errors;
+        struct imsm_hist latencies;
+};
+
+static uint64_t
+now_ns(void)
+{
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return now.tv_sec * 1000 * 1000 * 1000ULL + now.tv_nsec;
+}
+
+/*
+ * Closes `conn`'s socket, and returns its slot to the idle stack.
+ */
+static void
+conn_release(struct load *load, struct conn *conn)
+{
+
+        if (conn->fd >= 0)
+                close(conn->fd);
+
+        conn->fd = -1;
+        conn->state = CONN_IDLE;
+        load->idle[load->num_idle++] = conn - load->conns;
+        return;
+}
+
+static void
+conn_fail(struct load *load, struct conn *conn)
+{
+
+        load->num_errors++;
+        conn_release(load, conn);
+        return;
+}
+
+/*
+ * Sends the request line once the connection is established.  The
+ * line is short enough to always fit in an empty socket buffer.
+ */
+static void
+conn_send(struct load *load, struct conn *conn)
+{
+        struct epoll_event event = {
+                .events = EPOLLIN | EPOLLRDHUP,
+                .data.ptr = conn,
+        };
+        ssize_t sent;
+
+        sent = send(conn->fd, conn->line, conn->line_size, MSG_NOSIGNAL);
+        if (sent != conn->line_size) {
+                conn_fail(load, conn);
+                return;
+        }
+
+        if (epoll_ctl(load->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event) < 0) {
+                perror("epoll_ctl");
+                abort();
+        }
+
+        conn->state = CONN_WAITING;
+        return;
+}
+
+/*
+ * Starts a new request on an idle slot, with latency measured from
+ * `start_ns`.
+ */
+static void
+conn_start(struct load *load, uint64_t start_ns)
+{
+        struct epoll_event event = {
+                .events = EPOLLOUT,
+        };
+        struct conn *conn;
+        int r;
+
+        assert(load->num_idle > 0);
+        conn = &load->conns[load->idle[--load->num_idle]];
+        conn->start_ns = start_ns;
+        conn->received = 0;
+        conn->line_size = snprintf(conn->line, sizeof(conn->line),
+            "hello %llu\n", (unsigned long long)load->next_seq++);
+        load->num_started++;
+
+        conn->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+            0);
+        if (conn->fd < 0) {
+                perror("socket");
+                abort();
+        }
+
+        r = connect(conn->fd, (struct sockaddr *)&load->server,
+            sizeof(load->server));
+        if (r < 0 && errno != EINPROGRESS) {
+                conn_fail(load, conn);
+                return;
+        }
+
+        event.data.ptr = conn;
+        if (epoll_ctl(load->epoll_fd, EPOLL_CTL_ADD, conn->fd, &event) < 0) {
+                perror("epoll_ctl");
+                abort();
+        }
+
+        conn->state = CONN_CONNECTING;
+        return;
+}
+
+/*
+ * Reads the echoed line until the server closes the connection, and
+ * records the request's latency if it's correct.
+ */
+static void
+conn_receive(struct load *load, struct conn *conn)
+{
+
+        for (;;) {
+                ssize_t r;
+
+                r = recv(conn->fd, &conn->reply[conn->received],
+                    sizeof(conn->reply) - conn->received, MSG_DONTWAIT);
+                if (r < 0) {
+                        if (errno == EAGAIN || errno == EWOULDBLOCK)
+                                return;
+
+                        conn_fail(load, conn);
+                        return;
+                }
+
+                if (r > 0) {
+                        conn->received += r;
+                        if (conn->received < sizeof(conn->reply))
+                                continue;
+                }
+
+                /* EOF, or a reply longer than any line we send. */
+                break;
+        }
+
+        if (conn->received != conn->line_size ||
+            memcmp(conn->reply, conn->line, conn->line_size) != 0) {
+                conn_fail(load, conn);
+                return;
+        }
+
+        imsm_hist_record(&load->latencies, now_ns() - conn->start_ns);
+        load->num_completed++;
+        conn_release(load, conn);
+        return;
+}
+
+static void
+conn_handle(struct load *load, struct conn *conn, uint32_t events)
+{
+        int error = 0;
+        socklen_t error_size = sizeof(error);
+
+        switch (conn->state) {
+        case CONN_CONNECTING:
+                if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR,
+                    &error, &error_size) < 0 || error != 0 ||
+                    (events & (EPOLLERR | EPOLLHUP)) != 0) {
+                        conn_fail(load, conn);
+                        return;
+                }
+
+                conn_send(load, conn);
+                return;
+
+        case CONN_WAITING:
+                conn_receive(load, conn);
+                return;
+
+        case CONN_IDLE:
+        default:
+                return;
+        }
+}
+
+/*
+ * Starts as many requests as are due (open-loop) or as we have idle
+ * slots (closed-loop), and returns how many milliseconds we may
+ * block for until the next one is due.
+ */
+static int
+start_requests(struct load *load, uint64_t now, uint64_t begin,
+    uint64_t period_ns)
+{
+        uint64_t due;
+
+        if (period_ns == 0) {
+                while (load->num_idle > 0)
+                        conn_start(load, now);
+                return 100;
+        }
+
+        /*
+         * Request i is scheduled at begin + i * period.  Requests
+         * that are due while all slots are busy start as soon as a
+         * slot frees up, but keep their scheduled start time.
+         */
+        for (;;) {
+                due = begin + load->num_started * period_ns;
+                if (due > now || load->num_idle == 0)
+                        break;
+
+                conn_start(load, due);
+        }
+
+        if (load->num_idle == 0)
+                return 100;
+
+        return (due - now) / (1000 * 1000);
+}
+
+static void
+run_load(struct load *load, double seconds, double rate)
+{
+        const uint64_t duration_ns = seconds * 1e9;
+        const uint64_t period_ns = (rate > 0) ? 1e9 / rate : 0;
+        struct epoll_event events[256];
+        uint64_t begin, now;
+        bool running = true;
+
+        begin = now_ns();
+        now = begin;
+        while (running || load->num_idle < load->num_conns) {
+                int timeout_ms = 100;
+                int r;
+
+                if (running && now - begin >= duration_ns)
+                        running = false;
+
+                if (running)
+                        timeout_ms = start_requests(load, now, begin,
+                            period_ns);
+                else if (now - begin >= duration_ns + DRAIN_NS)
+                        break;
+
+                r = epoll_wait(load->epoll_fd, events,
+                    sizeof(events) / sizeof(events[0]), timeout_ms);
+                if (r < 0 && errno != EINTR) {
+                        perror("epoll_wait");
+                        abort();
+                }
+
+                for (size_t i = 0, n = (r > 0) ? r : 0; i < n; i++)
+                        conn_handle(load, events[i].data.ptr,
+                            events[i].events);
+
+                now = now_ns();
+        }
+
+        return;
+}
+
+/*
+ * Makes sure we can open `num_conns` sockets (plus a few more).
+ */
+static void
+raise_fd_limit(size_t num_conns)
+{
+        struct rlimit limit;
+
+        if (getrlimit(RLIMIT_NOFILE, &limit) < 0)
+                return;
+
+        if (limit.rlim_cur >= num_conns + 16)
+                return;
+
+        limit.rlim_cur = num_conns + 16;
+        if (limit.rlim_max != RLIM_INFINITY && limit.rlim_cur > limit.rlim_max)
+                limit.rlim_cur = limit.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &limit) < 0)
+                perror("setrlimit");
+        return;
+}
+
+static void
+usage(void)
+{
+
+        fprintf(stderr,
+            "Usage: imsm_echo_load [-c CONNECTIONS] [-d SECONDS] [-r RATE] PORT\n"
+            "\n"
+            "  -c  concurrent connections (default 1000)\n"
+            "  -d  run duration in seconds (default 5)\n"
+            "  -r  open-loop request rate per second (default: closed loop)\n");
+        exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+        struct load load = { 0 };
+        size_t num_conns = 1000;
+        double seconds = 5;
+        double rate = 0;
+        int opt;
+
+        while ((opt = getopt(argc, argv, "c:d:r:")) != -1) {
+                switch (opt) {
+                case 'c':
+                        num_conns = strtoul(optarg, NULL, 10);
+                        break;
+                case 'd':
+                        seconds = strtod(optarg, NULL);
+                        break;
+                case 'r':
+                        rate = strtod(optarg, NULL);
+                        break;
+                default:
+                        usage();
+                }
+        }
+
+        if (optind + 1 != argc || num_conns == 0 || seconds <= 0)
+                usage();
+
+        load.server.sin_family = AF_INET;
+        load.server.sin_port = htons(atoi(argv[optind]));
+        load.server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        raise_fd_limit(num_conns);
+        load.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        load.num_conns = num_conns;
+        load.conns = calloc(num_conns, sizeof(*load.conns));
+        load.idle = calloc(num_conns, sizeof(*load.idle));
+        if (load.epoll_fd < 0 || load.conns == NULL || load.idle == NULL) {
+                perror("init");
+                abort();
+        }
+
+        for (size_t i = num_conns; i-- > 0; ) {
+                load.conns[i].fd = -1;
+                load.idle[load.num_idle++] = i;
+        }
+
+        run_load(&load, seconds, rate);
+
+        fprintf(stderr,
+            "%llu requests in %.1f s (%.0f/s), %llu errors, %llu incomplete\n"
+            "latency (us): p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f "
+            "p99.99 %.1f max %.1f\n",
+            (unsigned long long)load.num_completed, seconds,
+            load.num_completed / seconds,
+            (unsigned long long)load.num_errors,
+            (unsigned long long)(load.num_started - load.num_completed -
+                load.num_errors),
+            imsm_hist_quantile(&load.latencies, 0.5) * 1e-3,
+            imsm_hist_quantile(&load.latencies, 0.9) * 1e-3,
+            imsm_hist_quantile(&load.latencies, 0.99) * 1e-3,
+            imsm_hist_quantile(&load.latencies, 0.999) * 1e-3,
+            imsm_hist_quantile(&load.latencies, 0.9999) * 1e-3,
+            load.latencies.max * 1e-3);
+
+        printf("{\"mode\": \"%s\", \"connections\": %zu, "
+            "\"target_rate\": %.1f, \"duration_s\": %.3f, "
+            "\"completed\": %llu, \"errors\": %llu, \"throughput\": %.1f, "
+            "\"latency_ns\": ",
+            (rate > 0) ? "open" : "closed", num_conns, rate, seconds,
+            (unsigned long long)load.num_completed,
+            (unsigned long long)load.num_errors,
+            load.num_completed / seconds);
+        imsm_hist_print_json(stdout, &load.latencies);
+        printf("}\n");
+        return 0;
+}
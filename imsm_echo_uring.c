@@ -0,0 +1,850 @@
+#define _GNU_SOURCE
+
+/*
+ * Echo server with the same stages as imsm_echo.c, on top of io_uring
+ * instead of epoll and non-blocking syscalls.
+ *
+ * Stages don't perform any I/O syscall themselves: they queue one
+ * submission per state in the batch, with the state's `imsm_ref` as
+ * user data.  The driver's wait function then submits everything and
+ * reaps completions in a single `io_uring_enter`, and wakes the
+ * completed states with `imsm_notify_n`.
+ *
+ * We talk to the kernel directly, without liburing.
+ */
+#include <assert.h>
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "imsm.h"
+#include "imsm_driver.h"
+
+#define ACCEPT_BUFFER 32
+
+#define BUF_SIZE 200
+
+/*
+ * Allow up to 128 concurrent echo state machines per shard.
+ */
+#define NUM_ECHO_STATES 128
+
+/*
+ * Each state has at most one operation in flight, plus one accept
+ * (and its cancellation) per shard.
+ */
+#define RING_ENTRIES 256
+
+/*
+ * Completions for the accept fd carry this user data.  It can't
+ * collide with real references: the NULL reference never refers to
+ * any state.
+ */
+#define ACCEPT_USER_DATA 0
+
+/*
+ * User data for the cancellation of a multishot accept.  UINT64_MAX
+ * decodes to global index 4095, past the imsm registry, so it's never
+ * a valid reference either.
+ */
+#define CANCEL_USER_DATA UINT64_MAX
+
+enum io_result {
+        IO_RESULT_DONE = 0,
+        /* Submitted an operation; the state will be woken on completion. */
+        IO_RESULT_PENDING,
+        IO_RESULT_ABORT
+};
+
+struct echo_state {
+        struct imsm_entry header;
+        int fd;
+        /* Result of the last completed operation, if `in_flight`. */
+        int32_t result;
+        bool in_flight;
+        uint8_t in_index;
+        uint8_t newline_index;
+        uint8_t out_index;
+        char buf[BUF_SIZE];
+};
+
+/*
+ * Userspace view of an io_uring's submission and completion rings.
+ */
+struct uring {
+        int fd;
+        /* Number of SQEs we queued but haven't submitted yet. */
+        unsigned int to_submit;
+        /* Our copy of the SQ tail, published in `uring_enter`. */
+        unsigned int sq_local_tail;
+
+        unsigned int *sq_head;
+        unsigned int *sq_tail;
+        unsigned int *sq_array;
+        unsigned int sq_mask;
+        unsigned int sq_entries;
+        struct io_uring_sqe *sqes;
+
+        unsigned int *cq_head;
+        unsigned int *cq_tail;
+        unsigned int cq_mask;
+        struct io_uring_cqe *cqes;
+};
+
+/*
+ * Each shard is a fully independent echo server, with its own state
+ * machine, listening socket, and ring.
+ */
+struct echo_shard {
+        IMSM(, struct echo_state) echo;
+        struct uring ring;
+        int accept_fd;
+        bool accept_in_flight;
+        /* Use multishot accepts, until the kernel says it can't. */
+        bool accept_multishot;
+        bool accept_cancelling;
+        /*
+         * Accepted connections that don't have a state yet.  We stop
+         * accepting once we have ACCEPT_BUFFER of these, but a
+         * multishot accept may deliver more before it's cancelled.
+         */
+        size_t num_accepted;
+        size_t accepted_capacity;
+        int *accepted;
+        struct echo_state *backing;
+};
+
+/*
+ * Returns the shard for the context's state machine.
+ */
+static struct echo_shard *
+echo_shard_of(struct imsm_ctx *ctx)
+{
+
+        return (struct echo_shard *)((char *)ctx->imsm -
+            __builtin_offsetof(struct echo_shard, echo.imsm));
+}
+
+static void
+echo_state_init(void *vstate)
+{
+        struct echo_state *state = vstate;
+
+        state->fd = -1;
+        state->result = 0;
+        state->in_flight = false;
+        state->in_index = 0;
+        state->newline_index = 0;
+        state->out_index = 0;
+        return;
+}
+
+static void
+echo_state_deinit(void *vstate)
+{
+        struct echo_state *state = vstate;
+
+        assert(!state->in_flight &&
+            "States must not be released with operations in flight.");
+        if (state->fd >= 0)
+                close(state->fd);
+
+        echo_state_init(state);
+        return;
+}
+
+static void *
+uring_mmap(int fd, size_t size, off_t offset)
+{
+        void *ret;
+
+        ret = mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, fd, offset);
+        if (ret == MAP_FAILED) {
+                perror("mmap");
+                abort();
+        }
+
+        return ret;
+}
+
+static void
+uring_init(struct uring *ring, unsigned int entries)
+{
+        struct io_uring_params params = { 0 };
+        size_t sq_size, cq_size;
+        char *sq_ptr, *cq_ptr;
+
+        ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+        if (ring->fd < 0) {
+                perror("io_uring_setup");
+                abort();
+        }
+
+        sq_size = params.sq_off.array +
+            params.sq_entries * sizeof(unsigned int);
+        cq_size = params.cq_off.cqes +
+            params.cq_entries * sizeof(struct io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+                if (cq_size > sq_size)
+                        sq_size = cq_size;
+                sq_ptr = uring_mmap(ring->fd, sq_size, IORING_OFF_SQ_RING);
+                cq_ptr = sq_ptr;
+        } else {
+                sq_ptr = uring_mmap(ring->fd, sq_size, IORING_OFF_SQ_RING);
+                cq_ptr = uring_mmap(ring->fd, cq_size, IORING_OFF_CQ_RING);
+        }
+
+        ring->sq_head = (void *)(sq_ptr + params.sq_off.head);
+        ring->sq_tail = (void *)(sq_ptr + params.sq_off.tail);
+        ring->sq_array = (void *)(sq_ptr + params.sq_off.array);
+        ring->sq_mask = *(unsigned int *)(sq_ptr + params.sq_off.ring_mask);
+        ring->sq_entries = params.sq_entries;
+        ring->sqes = uring_mmap(ring->fd,
+            params.sq_entries * sizeof(struct io_uring_sqe),
+            IORING_OFF_SQES);
+        ring->sq_local_tail = *ring->sq_tail;
+
+        ring->cq_head = (void *)(cq_ptr + params.cq_off.head);
+        ring->cq_tail = (void *)(cq_ptr + params.cq_off.tail);
+        ring->cq_mask = *(unsigned int *)(cq_ptr + params.cq_off.ring_mask);
+        ring->cqes = (void *)(cq_ptr + params.cq_off.cqes);
+        return;
+}
+
+/*
+ * Submits all queued SQEs, and waits for up to `timeout_ns` until at
+ * least `wait_nr` completions are available.
+ */
+static void
+uring_enter(struct uring *ring, unsigned int wait_nr, uint64_t timeout_ns)
+{
+        struct __kernel_timespec ts = {
+                .tv_sec = timeout_ns / (1000 * 1000 * 1000ULL),
+                .tv_nsec = timeout_ns % (1000 * 1000 * 1000ULL),
+        };
+        struct io_uring_getevents_arg arg = {
+                .ts = (uintptr_t)&ts,
+        };
+        unsigned int flags = 0;
+        int r;
+
+        /* Publish the SQEs before the kernel looks at the tail. */
+        __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+        if (wait_nr > 0)
+                flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+
+        r = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, wait_nr,
+            flags, &arg, sizeof(arg));
+        if (r < 0) {
+                if (errno == ETIME || errno == EINTR ||
+                    errno == EAGAIN || errno == EBUSY)
+                        return;
+
+                perror("io_uring_enter");
+                abort();
+        }
+
+        ring->to_submit -= r;
+        return;
+}
+
+/*
+ * Returns a zeroed SQE, which will be submitted by the next
+ * `uring_enter`.  Flushes the submission queue if it's full.
+ */
+static struct io_uring_sqe *
+uring_get_sqe(struct uring *ring)
+{
+        struct io_uring_sqe *sqe;
+        unsigned int index;
+
+        while (ring->sq_local_tail -
+            __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >=
+            ring->sq_entries)
+                uring_enter(ring, 0, 0);
+
+        index = ring->sq_local_tail & ring->sq_mask;
+        sqe = &ring->sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        ring->sq_array[index] = index;
+        ring->sq_local_tail++;
+        ring->to_submit++;
+        return sqe;
+}
+
+/*
+ * Arms a (multishot, if possible) accept for the shard.  A multishot
+ * accept keeps posting a completion per connection, without any
+ * further submission, until it fails or we cancel it.
+ */
+static void
+submit_accept(struct echo_shard *shard)
+{
+        struct io_uring_sqe *sqe = uring_get_sqe(&shard->ring);
+
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = shard->accept_fd;
+        sqe->accept_flags = SOCK_CLOEXEC;
+        if (shard->accept_multishot)
+                sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->user_data = ACCEPT_USER_DATA;
+        shard->accept_in_flight = true;
+        return;
+}
+
+/*
+ * Asks the kernel to stop the shard's multishot accept.
+ */
+static void
+submit_accept_cancel(struct echo_shard *shard)
+{
+        struct io_uring_sqe *sqe = uring_get_sqe(&shard->ring);
+
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = ACCEPT_USER_DATA;
+        sqe->user_data = CANCEL_USER_DATA;
+        shard->accept_cancelling = true;
+        return;
+}
+
+/*
+ * Queues a `recv` or `send` of `len` bytes at `buf` for `state`.
+ */
+static void
+submit_io(struct echo_shard *shard, struct imsm_ref ref,
+    struct echo_state *state, uint8_t opcode, const void *buf, size_t len)
+{
+        struct io_uring_sqe *sqe = uring_get_sqe(&shard->ring);
+
+        sqe->opcode = opcode;
+        sqe->fd = state->fd;
+        sqe->addr = (uintptr_t)buf;
+        sqe->len = len;
+        sqe->msg_flags = (opcode == IORING_OP_SEND) ? MSG_NOSIGNAL : 0;
+        sqe->user_data = ref.bits;
+        state->in_flight = true;
+        return;
+}
+
+/*
+ * Returns the result of `state`'s completed operation, and marks it
+ * as no longer in flight.
+ */
+static int32_t
+consume_result(struct echo_state *state)
+{
+
+        assert(state->in_flight);
+        state->in_flight = false;
+        return state->result;
+}
+
+static void
+handle_io_result(struct echo_state **done, struct imsm_ctx *ctx,
+    struct echo_state *current, enum io_result result)
+{
+        struct echo_shard *shard = echo_shard_of(ctx);
+        IMSM_CTX_PTR(ctx);
+
+        switch (result) {
+                case IO_RESULT_DONE:
+                        imsm_list_push(done, current, 0);
+                        break;
+
+                case IO_RESULT_PENDING:
+                        break;
+
+                case IO_RESULT_ABORT:
+                default:
+                        IMSM_PUT(&shard->echo, current);
+                        break;
+        }
+
+        return;
+}
+
+#define echo_list_map(IN, VAR, EXPRESSION)                              \
+        ({                                                              \
+                struct echo_state *const *list_in_ = (IN);              \
+                struct echo_state **list_out_ =                         \
+                        IMSM_LIST_GET(struct echo_state,                \
+                                      imsm_list_size(list_in_));        \
+                                                                        \
+                                                                        \
+                imsm_list_foreach(VAR, list_in_)                        \
+                        handle_io_result(list_out_, IMSM_CTX_PTR_VAR,   \
+                            VAR, (EXPRESSION));                         \
+                list_out_;                                              \
+        })
+
+/*
+ * Turns accepted connections into new echo states, as long as we
+ * have free states, and makes sure an accept is in flight iff we have
+ * room for more connections.
+ *
+ * States are only allocated for connections that already arrived, and
+ * the batch size adapts to the number of connections the kernel
+ * delivered, up to the free slab capacity.
+ */
+static struct echo_state **
+accept_new_connections(struct imsm_ctx *ctx)
+{
+        struct echo_shard *shard = echo_shard_of(ctx);
+        struct echo_state **ret;
+        size_t num_consumed = 0;
+        IMSM_CTX_PTR(ctx);
+
+        ret = IMSM_LIST_GET(struct echo_state, shard->num_accepted);
+        while (num_consumed < shard->num_accepted) {
+                struct echo_state *state;
+                bool success;
+
+                state = IMSM_GET(&shard->echo);
+                if (state == NULL)
+                        break;
+
+                state->fd = shard->accepted[num_consumed++];
+                success = imsm_list_push(ret, state, 0);
+                assert(success && "imsm_list_push failed.");
+        }
+
+        shard->num_accepted -= num_consumed;
+        memmove(&shard->accepted[0], &shard->accepted[num_consumed],
+            shard->num_accepted * sizeof(shard->accepted[0]));
+
+        if (shard->num_accepted < ACCEPT_BUFFER) {
+                if (!shard->accept_in_flight)
+                        submit_accept(shard);
+        } else if (shard->accept_in_flight && shard->accept_multishot &&
+            !shard->accept_cancelling) {
+                /* Leave the rest of the storm in the kernel's backlog. */
+                submit_accept_cancel(shard);
+        }
+
+        return ret;
+}
+
+/*
+ * Consumes the result of the last `recv` for this echo state machine,
+ * if any, and submits another one unless we have a full line (or 200
+ * characters).
+ */
+static enum io_result
+read_one_line(struct echo_shard *shard, struct imsm_ref ref,
+    struct echo_state *state)
+{
+        void *dst = &state->buf[state->in_index];
+        char *newline;
+        int32_t num_recv;
+
+        if (!state->in_flight)
+                goto submit;
+
+        num_recv = consume_result(state);
+        if (num_recv < 0) {
+                if (num_recv == -EAGAIN || num_recv == -EINTR)
+                        goto submit;
+
+                errno = -num_recv;
+                perror("recv");
+                return IO_RESULT_ABORT;
+        }
+
+        state->in_index += num_recv;
+        newline = memchr(dst, '\n', num_recv);
+        if (newline != NULL) {
+                state->newline_index = newline - &state->buf[0];
+                return IO_RESULT_DONE;
+        }
+
+        if (num_recv == 0 || state->in_index == sizeof(state->buf)) {
+                state->newline_index = state->in_index;
+                return IO_RESULT_DONE;
+        }
+
+submit:
+        if (state->in_index >= sizeof(state->buf)) {
+                state->newline_index = sizeof(state->buf);
+                return IO_RESULT_DONE;
+        }
+
+        submit_io(shard, ref, state, IORING_OP_RECV,
+            &state->buf[state->in_index],
+            sizeof(state->buf) - state->in_index);
+        return IO_RESULT_PENDING;
+}
+
+/*
+ * Reads data for echo state machines until their buffer size is
+ * exhausted, or a newline character is found.
+ *
+ * `accepted` state machines are added to the set of echo state
+ * machines waiting to read the first line.
+ *
+ * Returns a list of state machines that have fully read their
+ * input line and are ready to spit it back to the peer.
+ */
+static struct echo_state **
+read_first_line(struct imsm_ctx *ctx, struct echo_state **accepted)
+{
+        struct echo_shard *shard = echo_shard_of(ctx);
+        IMSM_CTX_PTR(ctx);
+
+        IMSM_REGION("read_first_line");
+        return echo_list_map(IMSM_STAGE("ready_to_read", accepted, 0),
+            current, read_one_line(shard, IMSM_REFER(current), current));
+}
+
+/*
+ * Consumes the result of the last `send` for this echo state machine,
+ * if any, and submits another one for the rest of the line.
+ */
+static enum io_result
+write_one_line(struct echo_shard *shard, struct imsm_ref ref,
+    struct echo_state *state)
+{
+        int32_t sent;
+
+        if (state->in_flight) {
+                sent = consume_result(state);
+                if (sent < 0 && sent != -EAGAIN && sent != -EINTR) {
+                        errno = -sent;
+                        perror("send");
+                        return IO_RESULT_ABORT;
+                }
+
+                if (sent == 0)
+                        return IO_RESULT_DONE;
+
+                if (sent > 0)
+                        state->out_index += sent;
+        }
+
+        if (state->out_index >= state->newline_index)
+                return IO_RESULT_DONE;
+
+        submit_io(shard, ref, state, IORING_OP_SEND,
+            &state->buf[state->out_index],
+            state->newline_index - state->out_index);
+        return IO_RESULT_PENDING;
+}
+
+/*
+ * Spits back the echo line to the remote for all echo state machines
+ * that are ready to write.
+ *
+ * `fully_read` are added to the the list of state machines ready to
+ * write.
+ *
+ * Returns a list of all state machines have fully written their echo
+ * line.
+ */
+static struct echo_state **
+echo_line(struct imsm_ctx *ctx, struct echo_state **fully_read)
+{
+        struct echo_shard *shard = echo_shard_of(ctx);
+        IMSM_CTX_PTR(ctx);
+
+        IMSM_REGION("echo_line");
+        return echo_list_map(IMSM_STAGE("ready_to_write", fully_read, 0),
+            current, write_one_line(shard, IMSM_REFER(current), current));
+}
+
+static enum io_result
+print_one_newline(struct echo_shard *shard, struct imsm_ref ref,
+    struct echo_state *state)
+{
+        static const char buf[1] = "\n";
+        int32_t sent;
+
+        if (!state->in_flight) {
+                submit_io(shard, ref, state, IORING_OP_SEND,
+                    buf, sizeof(buf));
+                return IO_RESULT_PENDING;
+        }
+
+        sent = consume_result(state);
+        if (sent < 0) {
+                if (sent == -EAGAIN || sent == -EINTR) {
+                        submit_io(shard, ref, state, IORING_OP_SEND,
+                            buf, sizeof(buf));
+                        return IO_RESULT_PENDING;
+                }
+
+                errno = -sent;
+                perror("send");
+                return IO_RESULT_ABORT;
+        }
+
+        return IO_RESULT_DONE;
+}
+
+static struct echo_state **
+print_newline(struct imsm_ctx *ctx, struct echo_state **fully_written)
+{
+        struct echo_shard *shard = echo_shard_of(ctx);
+        IMSM_CTX_PTR(ctx);
+
+        IMSM_REGION("print_newline");
+        return echo_list_map(IMSM_STAGE("ready_to_newline", fully_written, 0),
+            current, print_one_newline(shard, IMSM_REFER(current), current));
+}
+
+/*
+ * Fully scans the echo state machine once.
+ */
+static void
+echo_fn(struct imsm_ctx *ctx)
+{
+        struct echo_shard *shard = echo_shard_of(ctx);
+        struct echo_state **accepted, **fully_read, **echoed, **done;
+        IMSM_CTX_PTR(ctx);
+
+        accepted = accept_new_connections(ctx);
+        fully_read = read_first_line(ctx, accepted);
+        echoed = echo_line(ctx, fully_read);
+        done = print_newline(ctx, echoed);
+
+        IMSM_PUT_N(&shard->echo, done, imsm_list_size(done));
+        return;
+}
+
+/*
+ * Appends `fd` to the shard's accepted connections.
+ */
+static void
+push_accepted(struct echo_shard *shard, int fd)
+{
+
+        if (shard->num_accepted == shard->accepted_capacity) {
+                size_t capacity = 2 * shard->accepted_capacity;
+                int *accepted;
+
+                accepted = realloc(shard->accepted,
+                    capacity * sizeof(*accepted));
+                if (accepted == NULL) {
+                        perror("realloc");
+                        abort();
+                }
+
+                shard->accepted = accepted;
+                shard->accepted_capacity = capacity;
+        }
+
+        shard->accepted[shard->num_accepted++] = fd;
+        return;
+}
+
+/*
+ * Handles a completion for the shard's accept operation.
+ */
+static void
+handle_accept(struct echo_shard *shard, int32_t result, uint32_t flags)
+{
+
+        /* Multishot accepts stay armed while they set F_MORE. */
+        if ((flags & IORING_CQE_F_MORE) == 0)
+                shard->accept_in_flight = false;
+
+        if (result >= 0) {
+                push_accepted(shard, result);
+        } else if (result == -EINVAL && shard->accept_multishot) {
+                /* Older kernels: fall back to one accept at a time. */
+                shard->accept_multishot = false;
+        } else if (result != -EAGAIN && result != -EINTR &&
+            result != -ECANCELED) {
+                errno = -result;
+                perror("accept");
+        }
+
+        imsm_wake(&shard->echo.imsm);
+        return;
+}
+
+/*
+ * Submits all queued operations, waits for completions for up to
+ * `timeout_ns`, and wakes the corresponding echo state machines.
+ */
+static void
+echo_wait(struct imsm_ctx *ctx, uint64_t timeout_ns, void *arg)
+{
+        struct echo_shard *shard = echo_shard_of(ctx);
+        struct uring *ring = &shard->ring;
+        struct imsm_ref refs[RING_ENTRIES];
+        unsigned int head, tail;
+        size_t num_refs = 0;
+
+        (void)arg;
+        uring_enter(ring, (timeout_ns > 0) ? 1 : 0, timeout_ns);
+
+        head = *ring->cq_head;
+        tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+                const struct io_uring_cqe *cqe =
+                    &ring->cqes[head & ring->cq_mask];
+                struct imsm_ref ref = { cqe->user_data };
+                struct imsm_entry *entry;
+
+                if (ref.bits == ACCEPT_USER_DATA) {
+                        handle_accept(shard, cqe->res, cqe->flags);
+                        continue;
+                }
+
+                if (ref.bits == CANCEL_USER_DATA) {
+                        shard->accept_cancelling = false;
+                        continue;
+                }
+
+                /* `header` is the first member of `struct echo_state`. */
+                entry = imsm_deref(ref);
+                assert(entry != NULL &&
+                    "Operation completed for a dead state.");
+                ((struct echo_state *)entry)->result = cqe->res;
+
+                refs[num_refs++] = ref;
+                if (num_refs == RING_ENTRIES) {
+                        imsm_notify_n(refs, num_refs);
+                        num_refs = 0;
+                }
+        }
+
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        imsm_notify_n(refs, num_refs);
+        return;
+}
+
+static int
+make_accept_fd(int port, bool reuse_port)
+{
+        struct sockaddr_in sock = { 0 };
+        int one = 1;
+        int fd;
+
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+                perror("socket");
+                abort();
+        }
+
+        sock.sin_family = AF_INET;
+        sock.sin_port = htons(port);
+        sock.sin_addr.s_addr = htonl(INADDR_ANY);
+
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0) {
+                perror("setsockopt");
+                abort();
+        }
+
+        /* Let the kernel spread incoming connections between shards. */
+        if (reuse_port &&
+            setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+                perror("setsockopt");
+                abort();
+        }
+
+        if (bind(fd, (struct sockaddr *)&sock, sizeof(sock)) < 0) {
+                perror("bind");
+                abort();
+        }
+
+        if (listen(fd, ACCEPT_BUFFER) < 0) {
+                perror("listen");
+                abort();
+        }
+
+        return fd;
+}
+
+/*
+ * Initializes a shard with its own arena, listening socket and ring.
+ */
+static void
+echo_shard_init(struct echo_shard *shard, int port, bool reuse_port)
+{
+
+        shard->accept_fd = make_accept_fd(port, reuse_port);
+        uring_init(&shard->ring, RING_ENTRIES);
+        shard->accept_multishot = true;
+        shard->accepted_capacity = ACCEPT_BUFFER;
+        shard->accepted = calloc(shard->accepted_capacity,
+            sizeof(*shard->accepted));
+        if (shard->accepted == NULL) {
+                perror("calloc");
+                abort();
+        }
+
+        shard->backing = calloc(NUM_ECHO_STATES, sizeof(*shard->backing));
+        if (shard->backing == NULL) {
+                perror("calloc");
+                abort();
+        }
+
+        IMSM_INIT(&shard->echo, header, shard->backing,
+            NUM_ECHO_STATES * sizeof(*shard->backing),
+            echo_state_init, echo_state_deinit, echo_fn);
+        return;
+}
+
+/*
+ * Usage: imsm_echo_uring PORT [NUM_SHARDS]
+ *
+ * Each shard owns a ring, so shards have exactly one worker each.
+ */
+int
+main(int argc, char **argv)
+{
+        const struct imsm_driver_opts opts = {
+                .idle_policy = IMSM_IDLE_SLEEP,
+                .wait_fn = echo_wait,
+                .export_stats = true,
+        };
+        struct echo_shard *shards;
+        struct imsm **machines;
+        size_t num_shards = 1;
+        int port;
+        int r;
+
+        if (argc < 2)
+                return -1;
+
+        port = atoi(argv[1]);
+        if (argc > 2)
+                num_shards = strtoul(argv[2], NULL, 10);
+        if (num_shards == 0)
+                num_shards = 1;
+
+        shards = calloc(num_shards, sizeof(*shards));
+        machines = calloc(num_shards, sizeof(*machines));
+        if (shards == NULL || machines == NULL) {
+                perror("calloc");
+                abort();
+        }
+
+        for (size_t i = 0; i < num_shards; i++) {
+                echo_shard_init(&shards[i], port, num_shards > 1);
+                machines[i] = &shards[i].echo.imsm;
+        }
+
+        printf("Listening on port %i with %zu shards\n", port, num_shards);
+        r = imsm_run_sharded(machines, num_shards, &opts);
+        if (r != 0) {
+                errno = r;
+                perror("imsm_run_sharded");
+                abort();
+        }
+
+        return 0;
+}
@@ -0,0 +1,100 @@
+#include "imsm_gather.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+void
+imsm_gather_reset(struct imsm_gather *gather)
+{
+
+        gather->first = 0;
+        gather->count = 0;
+        return;
+}
+
+bool
+imsm_gather_push(struct imsm_gather *gather, const void *base, size_t len)
+{
+        size_t index;
+
+        if (len == 0)
+                return true;
+
+        /* Slide pending iovecs back to the front if we ran out of room. */
+        if (gather->first + gather->count >= IMSM_GATHER_MAX_IOVECS) {
+                for (size_t i = 0; i < gather->count; i++)
+                        gather->iovecs[i] = gather->iovecs[gather->first + i];
+                gather->first = 0;
+        }
+
+        if (gather->count >= IMSM_GATHER_MAX_IOVECS)
+                return false;
+
+        index = gather->first + gather->count++;
+        gather->iovecs[index] = (struct iovec) {
+                .iov_base = (void *)base,
+                .iov_len = len,
+        };
+        return true;
+}
+
+size_t
+imsm_gather_pending(const struct imsm_gather *gather)
+{
+        size_t ret = 0;
+
+        for (size_t i = 0; i < gather->count; i++)
+                ret += gather->iovecs[gather->first + i].iov_len;
+
+        return ret;
+}
+
+/*
+ * Consumes the first `written` pending bytes.
+ */
+static void
+gather_consume(struct imsm_gather *gather, size_t written)
+{
+
+        while (written > 0) {
+                struct iovec *iov = &gather->iovecs[gather->first];
+
+                assert(gather->count > 0);
+                if (written < iov->iov_len) {
+                        iov->iov_base = (char *)iov->iov_base + written;
+                        iov->iov_len -= written;
+                        return;
+                }
+
+                written -= iov->iov_len;
+                gather->first++;
+                gather->count--;
+        }
+
+        if (gather->count == 0)
+                gather->first = 0;
+        return;
+}
+
+ssize_t
+imsm_gather_flush(struct imsm_gather *gather, int fd)
+{
+        struct msghdr msg = {
+                .msg_iov = &gather->iovecs[gather->first],
+                .msg_iovlen = gather->count,
+        };
+        ssize_t ret;
+
+        if (gather->count == 0)
+                return 0;
+
+        ret = sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (ret < 0 && errno == ENOTSOCK)
+                ret = writev(fd, msg.msg_iov, msg.msg_iovlen);
+        if (ret < 0)
+                return ret;
+
+        gather_consume(gather, ret);
+        return ret;
+}
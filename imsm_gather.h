@@ -0,0 +1,51 @@
+#pragma once
+
+/*
+ * Output gather buffers for stages: stages queue iovecs in the state,
+ * and a later stage flushes everything with one `sendmsg` (or
+ * `writev`) per state and pass.
+ */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define IMSM_GATHER_MAX_IOVECS 4
+
+/*
+ * Embed a `struct imsm_gather` in state structs.  Queued iovecs only
+ * refer to their data: it must live until the gather is flushed.
+ */
+struct imsm_gather {
+        /* Pending iovecs are iovecs[first, first + count). */
+        uint8_t first;
+        uint8_t count;
+        struct iovec iovecs[IMSM_GATHER_MAX_IOVECS];
+};
+
+/*
+ * Drops all pending iovecs.
+ */
+void imsm_gather_reset(struct imsm_gather *);
+
+/*
+ * Queues `len` bytes at `base` after the pending iovecs.
+ *
+ * Returns false if the gather is full.
+ */
+bool imsm_gather_push(struct imsm_gather *, const void *base, size_t len);
+
+/*
+ * Returns the number of bytes left to flush.
+ */
+size_t imsm_gather_pending(const struct imsm_gather *);
+
+/*
+ * Writes as much of the pending data as possible to `fd` with one
+ * non-blocking syscall (`sendmsg` without SIGPIPE for sockets,
+ * `writev` otherwise), and consumes what was written.
+ *
+ * Returns the number of bytes written, or -1 with errno set.
+ */
+ssize_t imsm_gather_flush(struct imsm_gather *, int fd);
@@ -0,0 +1,155 @@
+#include "imsm_hist.h"
+
+#include <assert.h>
+#include <string.h>
+
+#define SUB_BUCKETS (1ULL << IMSM_HIST_SUB_BITS)
+
+/*
+ * Values below SUB_BUCKETS map to their own bucket.  Larger values
+ * with their most significant bit at `k` map to the sub-bucket of
+ * their top IMSM_HIST_SUB_BITS + 1 bits, in the (k - SUB_BITS + 1)th
+ * group of SUB_BUCKETS buckets.
+ */
+static size_t
+bucket_of(uint64_t value)
+{
+        unsigned int shift;
+
+        if (value < SUB_BUCKETS)
+                return value;
+
+        shift = (63 - __builtin_clzll(value)) - IMSM_HIST_SUB_BITS;
+        return (shift + 1) * SUB_BUCKETS + ((value >> shift) - SUB_BUCKETS);
+}
+
+/*
+ * Returns the largest value that maps to `bucket`.
+ */
+static uint64_t
+bucket_max(size_t bucket)
+{
+        uint64_t group = bucket / SUB_BUCKETS;
+        uint64_t sub = bucket % SUB_BUCKETS;
+        unsigned int shift;
+
+        if (group == 0)
+                return bucket;
+
+        shift = group - 1;
+        return ((SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+void
+imsm_hist_reset(struct imsm_hist *hist)
+{
+
+        memset(hist, 0, sizeof(*hist));
+        return;
+}
+
+void
+imsm_hist_record(struct imsm_hist *hist, uint64_t value)
+{
+
+        if (hist->count == 0 || value < hist->min)
+                hist->min = value;
+        if (value > hist->max)
+                hist->max = value;
+
+        hist->count++;
+        hist->sum += value;
+        hist->buckets[bucket_of(value)]++;
+        return;
+}
+
+void
+imsm_hist_merge(struct imsm_hist *dst, const struct imsm_hist *src)
+{
+
+        if (src->count == 0)
+                return;
+
+        if (dst->count == 0 || src->min < dst->min)
+                dst->min = src->min;
+        if (src->max > dst->max)
+                dst->max = src->max;
+
+        dst->count += src->count;
+        dst->sum += src->sum;
+        for (size_t i = 0; i < IMSM_HIST_NUM_BUCKETS; i++)
+                dst->buckets[i] += src->buckets[i];
+        return;
+}
+
+uint64_t
+imsm_hist_quantile(const struct imsm_hist *hist, double q)
+{
+        uint64_t rank, seen = 0;
+
+        if (hist->count == 0)
+                return 0;
+
+        if (q <= 0)
+                return hist->min;
+        if (q >= 1)
+                return hist->max;
+
+        /* The rank-th smallest value, counting from 1. */
+        rank = (uint64_t)(q * hist->count);
+        if (rank < q * hist->count)
+                rank++;
+        if (rank == 0)
+                rank = 1;
+
+        for (size_t i = 0; i < IMSM_HIST_NUM_BUCKETS; i++) {
+                uint64_t ret;
+
+                seen += hist->buckets[i];
+                if (seen < rank)
+                        continue;
+
+                ret = bucket_max(i);
+                if (ret < hist->min)
+                        return hist->min;
+                return (ret < hist->max) ? ret : hist->max;
+        }
+
+        assert(0 && "Histogram bucket counts don't add up to its count.");
+        return hist->max;
+}
+
+double
+imsm_hist_mean(const struct imsm_hist *hist)
+{
+
+        if (hist->count == 0)
+                return 0;
+
+        return (double)hist->sum / hist->count;
+}
+
+void
+imsm_hist_print_json(FILE *stream, const struct imsm_hist *hist)
+{
+        static const struct {
+                const char *name;
+                double q;
+        } quantiles[] = {
+                { "p50", 0.5 },
+                { "p90", 0.9 },
+                { "p99", 0.99 },
+                { "p99.9", 0.999 },
+                { "p99.99", 0.9999 },
+        };
+
+        fprintf(stream, "{\"count\": %llu, \"min\": %llu, \"mean\": %.1f",
+            (unsigned long long)hist->count, (unsigned long long)hist->min,
+            imsm_hist_mean(hist));
+        for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++)
+                fprintf(stream, ", \"%s\": %llu", quantiles[i].name,
+                    (unsigned long long)imsm_hist_quantile(hist,
+                        quantiles[i].q));
+        fprintf(stream, ", \"max\": %llu}", (unsigned long long)hist->max);
+        return;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+/*
+ * Log-linear (HDR-style) histograms of 64-bit values, e.g., latencies
+ * in nanoseconds.  Each power of two is split in
+ * 2^IMSM_HIST_SUB_BITS linear sub-buckets, so recorded values are
+ * exact up to 2^IMSM_HIST_SUB_BITS, and within 1/2^IMSM_HIST_SUB_BITS
+ * (~3%) of the true value beyond that.
+ */
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define IMSM_HIST_SUB_BITS 5
+#define IMSM_HIST_NUM_BUCKETS \
+        ((65 - IMSM_HIST_SUB_BITS) << IMSM_HIST_SUB_BITS)
+
+/*
+ * Zero-initialised histograms are empty.  Histograms aren't
+ * thread-safe: give each thread its own, and merge them.
+ */
+struct imsm_hist {
+        uint64_t count;
+        /* Sum of all values, modulo 2^64. */
+        uint64_t sum;
+        uint64_t min;
+        uint64_t max;
+        uint64_t buckets[IMSM_HIST_NUM_BUCKETS];
+};
+
+/*
+ * Empties `hist`.
+ */
+void imsm_hist_reset(struct imsm_hist *hist);
+
+/*
+ * Records one occurrence of `value`.
+ */
+void imsm_hist_record(struct imsm_hist *hist, uint64_t value);
+
+/*
+ * Adds all the values recorded in `src` to `dst`.
+ */
+void imsm_hist_merge(struct imsm_hist *dst, const struct imsm_hist *src);
+
+/*
+ * Returns the smallest value v such that at least a fraction `q` of
+ * the recorded values are in the same sub-bucket as v or below, up
+ * to the sub-bucket's precision, or 0 if the histogram is empty.
+ * `q` = 0 returns the minimum and `q` = 1 the maximum.
+ */
+uint64_t imsm_hist_quantile(const struct imsm_hist *hist, double q);
+
+/*
+ * Returns the arithmetic mean of the recorded values, or 0 if the
+ * histogram is empty.
+ */
+double imsm_hist_mean(const struct imsm_hist *hist);
+
+/*
+ * Prints a one-line JSON object with the count, min, mean, max, and
+ * the p50 through p99.99 quantiles of `hist` to `stream`, without a
+ * trailing newline.
+ */
+void imsm_hist_print_json(FILE *stream, const struct imsm_hist *hist);
@@ -4,6 +4,8 @@
 #include <stdlib.h>
 #include <sys/queue.h>
 
+#include "imsm_sdt.h"
+
 extern size_t (imsm_list_size)(void **);
 extern size_t (imsm_list_size)(void **);
 extern bool (imsm_list_set_size)(void **, size_t);
@@ -66,6 +68,7 @@ imsm_list_get_slow(struct imsm_list_cache *cache, size_t capacity_index)
         struct imsm_list_cache_head *active;
         size_t rounded = (1ULL << capacity_index) - 2;
 
+        IMSM_PROBE1(list_get_slow, capacity_index);
         if (capacity_index <= 1)
                 return NULL;
 
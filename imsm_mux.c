@@ -0,0 +1,253 @@
+#include "imsm_mux.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "imsm.h"
+#include "imsm_driver.h"
+#include "imsm_timer.h"
+
+#define MUX_BATCH 64
+
+static inline void
+spin_pause(void)
+{
+
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+        return;
+}
+
+struct mux_slot {
+        struct imsm *imsm;
+        struct imsm_ctx ctx;
+};
+
+struct imsm_mux {
+        int epoll_fd;
+        /*
+         * Attached machines, indexed by their global index in the
+         * imsm registry.  Epoll events carry that index as well.
+         */
+        struct mux_slot **slots;
+        size_t num_slots;
+};
+
+struct imsm_mux *
+imsm_mux_create(void)
+{
+        struct imsm_mux *mux;
+
+        mux = calloc(1, sizeof(*mux));
+        if (mux == NULL)
+                return NULL;
+
+        mux->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (mux->epoll_fd < 0) {
+                free(mux);
+                return NULL;
+        }
+
+        return mux;
+}
+
+void
+imsm_mux_destroy(struct imsm_mux *mux)
+{
+
+        if (mux == NULL)
+                return;
+
+        for (size_t i = 0; i < mux->num_slots; i++) {
+                if (mux->slots[i] != NULL)
+                        imsm_mux_remove(mux, mux->slots[i]->imsm);
+        }
+
+        close(mux->epoll_fd);
+        free(mux->slots);
+        free(mux);
+        return;
+}
+
+/*
+ * Makes sure `mux->slots` can be indexed with `index`.
+ */
+static bool
+mux_reserve(struct imsm_mux *mux, size_t index)
+{
+        struct mux_slot **slots;
+        size_t num_slots = mux->num_slots;
+
+        if (index < num_slots)
+                return true;
+
+        while (num_slots <= index)
+                num_slots = (num_slots < 16) ? 16 : 2 * num_slots;
+
+        slots = realloc(mux->slots, num_slots * sizeof(*slots));
+        if (slots == NULL)
+                return false;
+
+        for (size_t i = mux->num_slots; i < num_slots; i++)
+                slots[i] = NULL;
+
+        mux->slots = slots;
+        mux->num_slots = num_slots;
+        return true;
+}
+
+bool
+imsm_mux_add(struct imsm_mux *mux, struct imsm *imsm)
+{
+        struct epoll_event event = {
+                .events = EPOLLIN,
+                .data.u64 = imsm->global_index,
+        };
+        struct mux_slot *slot;
+        int fd;
+
+        if (imsm_lookup(imsm->global_index) != imsm ||
+            imsm->wake_fd >= 0) {
+                errno = EINVAL;
+                return false;
+        }
+
+        if (!mux_reserve(mux, imsm->global_index))
+                return false;
+
+        slot = calloc(1, sizeof(*slot));
+        if (slot == NULL)
+                return false;
+
+        /* Start signaled, so that we poll the machine at least once. */
+        fd = eventfd(1, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (fd < 0)
+                goto fail;
+
+        if (epoll_ctl(mux->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+                int error = errno;
+
+                close(fd);
+                errno = error;
+                goto fail;
+        }
+
+        slot->imsm = imsm;
+        slot->ctx.imsm = imsm;
+        mux->slots[imsm->global_index] = slot;
+
+        __atomic_store_n(&imsm->wake_armed, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&imsm->wake_fd, fd, __ATOMIC_RELEASE);
+        return true;
+
+fail:
+        free(slot);
+        return false;
+}
+
+void
+imsm_mux_remove(struct imsm_mux *mux, struct imsm *imsm)
+{
+        struct mux_slot *slot;
+        int fd;
+
+        if (imsm->global_index >= mux->num_slots)
+                return;
+
+        slot = mux->slots[imsm->global_index];
+        if (slot == NULL || slot->imsm != imsm)
+                return;
+
+        fd = __atomic_exchange_n(&imsm->wake_fd, -1, __ATOMIC_SEQ_CST);
+        /*
+         * Wakers that loaded the old fd may still write to it: wait
+         * for them before closing the eventfd (and letting another
+         * open reuse its number).
+         */
+        while (__atomic_load_n(&imsm->wake_users, __ATOMIC_SEQ_CST) != 0)
+                spin_pause();
+
+        __atomic_store_n(&imsm->wake_armed, 0, __ATOMIC_RELEASE);
+        epoll_ctl(mux->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+        close(fd);
+
+        mux->slots[imsm->global_index] = NULL;
+        imsm_ctx_deinit(&slot->ctx);
+        free(slot);
+        return;
+}
+
+int
+imsm_mux_poll(struct imsm_mux *mux, int timeout_ms)
+{
+        struct epoll_event events[MUX_BATCH];
+        int num_polled = 0;
+        int r;
+
+        /*
+         * Fire due timeouts (which signals their machine's eventfd),
+         * and don't sleep past the next one.
+         */
+        for (size_t i = 0; i < mux->num_slots; i++) {
+                uint64_t next_ns;
+                int next_ms;
+
+                if (mux->slots[i] == NULL)
+                        continue;
+
+                next_ns = imsm_timer_poll(mux->slots[i]->imsm);
+                if (next_ns == UINT64_MAX)
+                        continue;
+
+                /* Round up to the next millisecond, without overflowing. */
+                if (next_ns > 1000 * 1000 * 1000ULL)
+                        next_ns = 1000 * 1000 * 1000ULL;
+                next_ms = (next_ns + 999999) / 1000000;
+                if (timeout_ms < 0 || next_ms < timeout_ms)
+                        timeout_ms = next_ms;
+        }
+
+        r = epoll_wait(mux->epoll_fd, events, MUX_BATCH, timeout_ms);
+        if (r < 0)
+                return (errno == EINTR) ? 0 : -1;
+
+        for (int i = 0; i < r; i++) {
+                size_t index = events[i].data.u64;
+                struct mux_slot *slot;
+                uint64_t count;
+                ssize_t read_r;
+
+                if (index >= mux->num_slots)
+                        continue;
+
+                slot = mux->slots[index];
+                /* An earlier poll function may have removed the machine. */
+                if (slot == NULL)
+                        continue;
+
+                read_r = read(slot->imsm->wake_fd, &count, sizeof(count));
+                (void)read_r;
+
+                /*
+                 * Disarm before polling: wake-ups during the poll pass
+                 * signal the eventfd again, and we'll come back.
+                 */
+                __atomic_store_n(&slot->imsm->wake_armed, 0, __ATOMIC_SEQ_CST);
+                imsm_poll(&slot->ctx);
+                num_polled++;
+        }
+
+        return num_polled;
+}
+
+int
+imsm_mux_fd(const struct imsm_mux *mux)
+{
+
+        return mux->epoll_fd;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+/*
+ * Multiplexes the poll loops of many immediate mode state machines
+ * in one thread, with one eventfd per machine.
+ */
+#include <stdbool.h>
+#include <stddef.h>
+
+struct imsm;
+struct imsm_mux;
+
+/*
+ * Returns a new, empty, multiplexer, or NULL on failure.
+ */
+struct imsm_mux *imsm_mux_create(void);
+
+/*
+ * Detaches all machines from the multiplexer, and releases its
+ * resources.
+ */
+void imsm_mux_destroy(struct imsm_mux *);
+
+/*
+ * Attaches `imsm` to the multiplexer: `imsm_wake` (and thus
+ * `imsm_notify`) now signals the machine's eventfd.  A machine may
+ * only be attached to one multiplexer, and must not also be driven
+ * by `imsm_run`.  Newly attached machines are polled once on the
+ * next `imsm_mux_poll`.
+ *
+ * Returns false on failure, with errno set.
+ */
+bool imsm_mux_add(struct imsm_mux *, struct imsm *);
+
+/*
+ * Detaches `imsm` from the multiplexer.  Must not be called from
+ * `imsm`'s own poll function.  Other threads may keep calling
+ * `imsm_wake` on `imsm`: we wait for in-flight wakers to finish
+ * with the eventfd before closing it.
+ */
+void imsm_mux_remove(struct imsm_mux *, struct imsm *);
+
+/*
+ * Waits for up to `timeout_ms` (as for epoll_wait(2)) until at least
+ * one attached machine was woken, and executes one poll pass (see
+ * `imsm_poll`) for each woken machine only.  Each machine has its own
+ * `imsm_ctx`, owned by the multiplexer.  We first fire the machines'
+ * due timeouts (imsm_timer.h), and never wait past the next one.
+ *
+ * Returns the number of machines polled, or -1 on error.
+ */
+int imsm_mux_poll(struct imsm_mux *, int timeout_ms);
+
+/*
+ * Returns an epoll fd that is readable when `imsm_mux_poll` has work
+ * to do, e.g., to nest the multiplexer in another event loop.
+ */
+int imsm_mux_fd(const struct imsm_mux *);
@@ -0,0 +1,306 @@
+#include "imsm_pool.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "imsm.h"
+
+#define DEFAULT_CHUNK_SIZE 64
+
+/*
+ * Each participant (the caller is participant 0) owns a contiguous
+ * range of chunks, and steals from the others' once it's exhausted.
+ * Keep ranges on their own cache line: they're hammered with
+ * fetch-and-add.
+ */
+struct pool_range {
+        size_t next;
+        size_t end;
+} __attribute__((__aligned__(64)));
+
+struct pool_worker {
+        pthread_t thread;
+        struct imsm_pool *pool;
+        size_t index;
+        struct imsm_ctx ctx;
+};
+
+struct imsm_pool {
+        pthread_mutex_t lock;
+        pthread_cond_t start;
+        pthread_cond_t done;
+        /* Bumped for every new job, under `lock`. */
+        uint64_t generation;
+        /* Number of helpers still working on the current job. */
+        size_t active;
+        bool stopping;
+
+        size_t num_threads;
+        size_t chunk_size;
+
+        /* Current job. */
+        imsm_pool_map_fn fn;
+        void *arg;
+        void **list_in;
+        size_t list_size;
+        unsigned int *results;
+        size_t results_capacity;
+
+        /* num_threads + 1 ranges. */
+        struct pool_range *ranges;
+        struct pool_worker *workers;
+};
+
+static void
+pool_run_chunk(struct imsm_pool *pool, struct imsm_ctx *ctx, size_t chunk)
+{
+        void **const list_in = pool->list_in;
+        unsigned int *const results = pool->results;
+        size_t begin = chunk * pool->chunk_size;
+        size_t end = begin + pool->chunk_size;
+
+        if (end > pool->list_size)
+                end = pool->list_size;
+
+        for (size_t i = begin; i < end; i++) {
+                if (list_in[i] == NULL)
+                        continue;
+
+                results[i] = pool->fn(ctx, list_in[i], pool->arg);
+        }
+
+        return;
+}
+
+/*
+ * Executes chunks until all ranges are exhausted, starting with our
+ * own range.
+ */
+static void
+pool_work(struct imsm_pool *pool, struct imsm_ctx *ctx, size_t self)
+{
+        size_t num_ranges = pool->num_threads + 1;
+
+        for (size_t k = 0; k < num_ranges; k++) {
+                struct pool_range *range = &pool->ranges[(self + k) % num_ranges];
+
+                for (;;) {
+                        size_t chunk;
+
+                        chunk = __atomic_fetch_add(&range->next, 1,
+                            __ATOMIC_RELAXED);
+                        if (chunk >= range->end)
+                                break;
+
+                        pool_run_chunk(pool, ctx, chunk);
+                }
+        }
+
+        return;
+}
+
+static void *
+pool_worker_main(void *arg)
+{
+        struct pool_worker *worker = arg;
+        struct imsm_pool *pool = worker->pool;
+        uint64_t seen = 0;
+
+        pthread_mutex_lock(&pool->lock);
+        for (;;) {
+                while (!pool->stopping && pool->generation == seen)
+                        pthread_cond_wait(&pool->start, &pool->lock);
+
+                if (pool->stopping)
+                        break;
+
+                seen = pool->generation;
+                pthread_mutex_unlock(&pool->lock);
+
+                pool_work(pool, &worker->ctx, worker->index);
+                imsm_list_cache_recycle(&worker->ctx.cache);
+
+                pthread_mutex_lock(&pool->lock);
+                if (--pool->active == 0)
+                        pthread_cond_signal(&pool->done);
+        }
+
+        pthread_mutex_unlock(&pool->lock);
+        return NULL;
+}
+
+struct imsm_pool *
+imsm_pool_create(struct imsm *imsm, size_t num_threads, size_t chunk_size)
+{
+        struct imsm_pool *pool;
+
+        pool = calloc(1, sizeof(*pool));
+        if (pool == NULL)
+                return NULL;
+
+        pool->num_threads = num_threads;
+        pool->chunk_size = (chunk_size != 0) ? chunk_size : DEFAULT_CHUNK_SIZE;
+        pool->ranges = aligned_alloc(__alignof__(struct pool_range),
+            (num_threads + 1) * sizeof(*pool->ranges));
+        pool->workers = calloc(num_threads, sizeof(*pool->workers));
+        if (pool->ranges == NULL ||
+            (num_threads > 0 && pool->workers == NULL))
+                goto fail;
+
+        pthread_mutex_init(&pool->lock, NULL);
+        pthread_cond_init(&pool->start, NULL);
+        pthread_cond_init(&pool->done, NULL);
+        for (size_t i = 0; i < num_threads; i++) {
+                struct pool_worker *worker = &pool->workers[i];
+
+                worker->pool = pool;
+                worker->index = i + 1;
+                worker->ctx.imsm = imsm;
+                if (pthread_create(&worker->thread, NULL,
+                    pool_worker_main, worker) != 0) {
+                        pool->num_threads = i;
+                        imsm_pool_destroy(pool);
+                        return NULL;
+                }
+        }
+
+        return pool;
+
+fail:
+        free(pool->ranges);
+        free(pool->workers);
+        free(pool);
+        return NULL;
+}
+
+void
+imsm_pool_destroy(struct imsm_pool *pool)
+{
+
+        if (pool == NULL)
+                return;
+
+        pthread_mutex_lock(&pool->lock);
+        pool->stopping = true;
+        pthread_cond_broadcast(&pool->start);
+        pthread_mutex_unlock(&pool->lock);
+
+        for (size_t i = 0; i < pool->num_threads; i++) {
+                pthread_join(pool->workers[i].thread, NULL);
+                imsm_ctx_deinit(&pool->workers[i].ctx);
+        }
+
+        pthread_cond_destroy(&pool->done);
+        pthread_cond_destroy(&pool->start);
+        pthread_mutex_destroy(&pool->lock);
+        free(pool->results);
+        free(pool->ranges);
+        free(pool->workers);
+        free(pool);
+        return;
+}
+
+/*
+ * Makes sure `pool->results` can hold `n` results.
+ */
+static bool
+pool_reserve_results(struct imsm_pool *pool, size_t n)
+{
+        unsigned int *results;
+        size_t capacity = pool->results_capacity;
+
+        if (n <= capacity)
+                return true;
+
+        while (capacity < n)
+                capacity = (capacity < 64) ? 64 : 2 * capacity;
+
+        results = realloc(pool->results, capacity * sizeof(*results));
+        if (results == NULL)
+                return false;
+
+        pool->results = results;
+        pool->results_capacity = capacity;
+        return true;
+}
+
+void
+imsm_pool_map(struct imsm_pool *pool, struct imsm_ctx *ctx, void **list_in,
+    imsm_pool_map_fn fn, void *arg, void ***lists_out, size_t num_out)
+{
+        size_t counts[UINT8_MAX + 1] = { 0 };
+        size_t n = imsm_list_size(list_in);
+        size_t num_chunks, num_ranges;
+        bool success;
+
+        assert(num_out > 0 && num_out <= UINT8_MAX + 1);
+
+        /* `pool_work` writes one result per element, in every build. */
+        if (!pool_reserve_results(pool, n)) {
+                perror("imsm_pool_map");
+                abort();
+        }
+
+        pool->fn = fn;
+        pool->arg = arg;
+        pool->list_in = list_in;
+        pool->list_size = n;
+
+        num_chunks = (n + pool->chunk_size - 1) / pool->chunk_size;
+        num_ranges = pool->num_threads + 1;
+        for (size_t i = 0; i < num_ranges; i++) {
+                pool->ranges[i].next = (num_chunks * i) / num_ranges;
+                pool->ranges[i].end = (num_chunks * (i + 1)) / num_ranges;
+        }
+
+        /* Don't wake everyone up for a single chunk. */
+        if (num_chunks <= 1 || pool->num_threads == 0) {
+                pool_work(pool, ctx, 0);
+        } else {
+                pthread_mutex_lock(&pool->lock);
+                pool->generation++;
+                pool->active = pool->num_threads;
+                pthread_cond_broadcast(&pool->start);
+                pthread_mutex_unlock(&pool->lock);
+
+                pool_work(pool, ctx, 0);
+
+                pthread_mutex_lock(&pool->lock);
+                while (pool->active > 0)
+                        pthread_cond_wait(&pool->done, &pool->lock);
+                pthread_mutex_unlock(&pool->lock);
+        }
+
+        /*
+         * Merge results serially, in list order.  Output indices are
+         * checked in every build: an invalid one would otherwise
+         * write past `counts` and `lists_out`.
+         */
+        for (size_t i = 0; i < n; i++) {
+                if (list_in[i] == NULL)
+                        continue;
+
+                if (pool->results[i] >= num_out)
+                        abort();
+
+                counts[pool->results[i]]++;
+        }
+
+        for (size_t i = 0; i < num_out; i++)
+                lists_out[i] = imsm_list_get(&ctx->cache, counts[i]);
+
+        for (size_t i = 0; i < n; i++) {
+                if (list_in[i] == NULL)
+                        continue;
+
+                success = imsm_list_push(lists_out[pool->results[i]],
+                    list_in[i], imsm_list_aux(list_in)[i]);
+                assert(success);
+        }
+
+        return;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+/*
+ * Work-stealing pool to map over large imsm_lists in parallel.
+ */
+#include <assert.h>
+#include <stddef.h>
+
+#include "imsm_list.h"
+
+struct imsm;
+struct imsm_ctx;
+struct imsm_pool;
+
+/*
+ * Map functions receive the pool worker's context, one list element,
+ * and the caller's argument, and return the index of the output list
+ * for that element.
+ *
+ * They execute concurrently with each other and with the caller:
+ * they may allocate temporary lists from their context, and
+ * allocate or deallocate from the slab, but must only mutate the
+ * element they were handed.
+ */
+typedef unsigned int (*imsm_pool_map_fn)(struct imsm_ctx *, void *elem,
+    void *arg);
+
+/*
+ * Returns a new pool of `num_threads` helper threads for `imsm`, or
+ * NULL on failure.  Each helper has its own `imsm_ctx`.
+ *
+ * Lists are split in chunks of `chunk_size` elements (0 for a
+ * default of 64).
+ */
+struct imsm_pool *imsm_pool_create(struct imsm *, size_t num_threads,
+    size_t chunk_size);
+
+/*
+ * Stops the helper threads, and releases their resources.
+ */
+void imsm_pool_destroy(struct imsm_pool *);
+
+/*
+ * Calls `fn` on every element of `list_in`, and pushes each element
+ * to `lists_out[fn(...)]`, preserving the relative order of elements.
+ * The `num_out` output lists are allocated from `ctx`'s list cache,
+ * and `num_out` must be at most 256.  NULL entries in `list_in` are
+ * skipped.  Aborts if `fn` returns an index of `num_out` or more, or
+ * if we can't allocate room for the results.
+ *
+ * The calling thread helps with the work; other threads must not
+ * call `imsm_pool_map` on the same pool concurrently.
+ *
+ * See IMSM_POOL_MAP for a type-safe version.
+ */
+void imsm_pool_map(struct imsm_pool *, struct imsm_ctx *, void **list_in,
+    imsm_pool_map_fn fn, void *arg, void ***lists_out, size_t num_out);
+
+/*
+ * IMSM_POOL_MAP(POOL, LIST_IN, FN, ARG, LISTS_OUT) maps `FN` over
+ * `LIST_IN` in parallel, and populates the LISTS_OUT array of lists
+ * of the same type as LIST_IN.
+ */
+#define IMSM_POOL_MAP(POOL, LIST_IN, FN, ARG, LISTS_OUT)                \
+        ({                                                              \
+                __typeof__(**(LIST_IN)) **pool_list_in_ = (LIST_IN);    \
+                                                                        \
+                static_assert(__builtin_types_compatible_p(             \
+                    __typeof__((LISTS_OUT)[0]), __typeof__(pool_list_in_)), \
+                    "Output lists must match the input list's type.");  \
+                imsm_pool_map((POOL), (IMSM_CTX_PTR_VAR),               \
+                    (void **)pool_list_in_, (FN), (ARG),                \
+                    (void ***)(LISTS_OUT),                              \
+                    sizeof(LISTS_OUT) / sizeof((LISTS_OUT)[0]));        \
+        })
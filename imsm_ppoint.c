@@ -1,5 +1,8 @@
 #include "imsm_ppoint.h"
 
+#include <assert.h>
+#include <stdbool.h>
+
 #include "imsm.h"
 
 extern size_t imsm_index(struct imsm_ctx *ctx,
@@ -9,3 +12,59 @@ extern struct imsm_unwind_record imsm_region_push(struct imsm_ctx *,
     struct imsm_ppoint_record);
 
 extern void imsm_region_pop(const struct imsm_unwind_record *);
+
+extern bool imsm_ppoint_enabled(const struct imsm_ctx *,
+    const struct imsm_ppoint *);
+
+struct imsm_unwind_record
+imsm_region_push_if_active(struct imsm_ctx *ctx,
+    struct imsm_ppoint_record record, const void *const *lists_in, size_t n)
+{
+        const struct imsm_queue *queues = ctx->imsm->queues;
+        struct imsm_unwind_record ret;
+        size_t region_index;
+        uint32_t span;
+        bool active;
+
+        /* The region itself gets a state index to key its span. */
+        region_index = imsm_index(ctx, record);
+        assert(region_index < IMSM_MAX_QUEUES && "Queue id too high");
+
+        ret = imsm_region_push(ctx, record);
+        ret.position.index = region_index;
+
+        /* We must execute regions at least once to learn their span. */
+        span = queues[region_index].region_span;
+        active = (span == 0);
+        for (size_t i = 0; i < n && !active; i++)
+                active = imsm_list_size((void **)lists_in[i]) > 0;
+
+        for (size_t i = region_index + 1, end = region_index + span;
+             i < end && !active; i++)
+                active = __atomic_load_n(&queues[i].pending,
+                    __ATOMIC_ACQUIRE) != 0;
+
+        if (!active)
+                ret.scratch = IMSM_UNWIND_SKIPPED;
+        return ret;
+}
+
+void
+imsm_region_pop_if_active(const struct imsm_unwind_record *unwind)
+{
+        struct imsm_ctx *ctx = unwind->context;
+        struct imsm_queue *region = &ctx->imsm->queues[unwind->position.index];
+        size_t begin = unwind->position.index + 1;
+
+        if (unwind->scratch == IMSM_UNWIND_SKIPPED) {
+                /* Pretend we visited every state index in the region. */
+                ctx->position.index = begin + region->region_span - 1;
+        } else {
+                assert(ctx->position.index >= begin);
+                assert(ctx->position.index - begin < IMSM_MAX_QUEUES);
+                region->region_span = 1 + (ctx->position.index - begin);
+        }
+
+        imsm_region_pop(unwind);
+        return;
+}
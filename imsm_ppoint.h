@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -31,6 +32,24 @@ inline struct imsm_unwind_record imsm_region_push(struct imsm_ctx *,
 
 inline void imsm_region_pop(const struct imsm_unwind_record *);
 
+/*
+ * Like `imsm_region_push`, but the returned record's `scratch` field
+ * is non-zero if the region may be skipped: no queue in the region
+ * has any pending wake-up, and all `n` imsm_lists in `lists_in` are
+ * empty.  The region's program point always consumes one state index,
+ * so that skipping a region yields the same indices as executing it.
+ *
+ * Regions pushed with `imsm_region_push_if_active` must be unwound
+ * with `imsm_region_pop_if_active`.
+ *
+ * See WITH_IMSM_REGION_IF_ACTIVE(LOC_INFO, LISTS...) for a convenient
+ * wrapper.
+ */
+struct imsm_unwind_record imsm_region_push_if_active(struct imsm_ctx *,
+    struct imsm_ppoint_record, const void *const *lists_in, size_t n);
+
+void imsm_region_pop_if_active(const struct imsm_unwind_record *);
+
 /*
  * Exposed only for testing.
  */
@@ -49,6 +68,28 @@ struct imsm *imsm_deref_machine(struct imsm_ref);
  */
 inline size_t imsm_index(struct imsm_ctx *, struct imsm_ppoint_record);
 
+/*
+ * Returns whether the context should execute the continuation for
+ * this program point, given its workload annotation.
+ */
+inline bool imsm_ppoint_enabled(const struct imsm_ctx *,
+    const struct imsm_ppoint *);
+
+/*
+ * Program points may be annotated with the kind of work their
+ * continuation performs, so that driver workers can specialise.  A
+ * context's `workload_mask` has bit `1 << workload` set for each
+ * workload it executes; 0 means everything.  Default program points
+ * are executed by all contexts.
+ */
+enum imsm_workload {
+        IMSM_WORKLOAD_DEFAULT = 0,
+        IMSM_WORKLOAD_IO,
+        IMSM_WORKLOAD_CPU,
+};
+
+#define IMSM_WORKLOAD_MASK(WORKLOAD) (1U << (WORKLOAD))
+
 /*
  * We use statically allocated imsm program points to map queue
  * operations to program states.
@@ -72,6 +113,8 @@ struct imsm_ppoint {
          * line look different.
          */
         size_t unique;
+        /* `workload` is an `enum imsm_workload`. */
+        unsigned int workload;
 };
 
 /*
@@ -96,3 +139,9 @@ struct imsm_unwind_record {
         struct imsm_ctx *context;
         size_t scratch;
 };
+
+/*
+ * `scratch` value for regions that `imsm_region_push_if_active`
+ * decided to skip.
+ */
+#define IMSM_UNWIND_SKIPPED 2
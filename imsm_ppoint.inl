@@ -52,3 +52,13 @@ imsm_index(struct imsm_ctx *ctx, struct imsm_ppoint_record record)
          */
         return ctx->position.index - 1;
 }
+
+inline bool
+imsm_ppoint_enabled(const struct imsm_ctx *ctx, const struct imsm_ppoint *ppoint)
+{
+        unsigned int workload = ppoint->workload;
+
+        return workload == IMSM_WORKLOAD_DEFAULT ||
+            ctx->workload_mask == 0 ||
+            (ctx->workload_mask & IMSM_WORKLOAD_MASK(workload)) != 0;
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+/*
+ * Static tracepoints (USDT) for external tracers, e.g.,
+ *
+ *   bpftrace -e 'usdt:./imsm_echo:imsm:stage_exit { @[str(arg0)] = hist(arg3); }'
+ *
+ * With <sys/sdt.h> (systemtap-sdt-dev), each probe compiles to a
+ * single nop, plus an ELF note that tells tracers where to patch in a
+ * breakpoint and how to find the arguments; nothing happens until
+ * someone attaches.  Without the header, or with IMSM_NO_SDT, probes
+ * compile to nothing, and their arguments aren't evaluated.
+ *
+ * Probes, all in the "imsm" provider:
+ *
+ *   stage_entry(const char *ppoint_name, queue_id, num_in)
+ *   stage_exit(const char *ppoint_name, queue_id, num_staged, num_out)
+ *   notify(ref_bits, imsm_index, queue_id)
+ *      queue_id is UINT16_MAX if the reference is stale.
+ *   get_slow(imsm_index, worker_index)
+ *   get_reload(imsm_index, worker_index)
+ *   put_reload(imsm_index, worker_index)
+ *      an allocation (or deallocation) magazine ran out, and the
+ *      context went to the depot.
+ *   list_get_slow(capacity_index)
+ *
+ * Durations come from pairing entry and exit probes on the same
+ * thread.
+ */
+
+#if !defined(IMSM_NO_SDT) && defined(__has_include)
+# if __has_include(<sys/sdt.h>)
+#  define IMSM_HAS_SDT 1
+# endif
+#endif
+
+#ifdef IMSM_HAS_SDT
+
+#include <sys/sdt.h>
+
+#define IMSM_PROBE1(NAME, A)                    \
+        DTRACE_PROBE1(imsm, NAME, A)
+#define IMSM_PROBE2(NAME, A, B)                 \
+        DTRACE_PROBE2(imsm, NAME, A, B)
+#define IMSM_PROBE3(NAME, A, B, C)              \
+        DTRACE_PROBE3(imsm, NAME, A, B, C)
+#define IMSM_PROBE4(NAME, A, B, C, D)           \
+        DTRACE_PROBE4(imsm, NAME, A, B, C, D)
+
+#else
+
+/* Type-check the arguments, but never evaluate them. */
+#define IMSM_PROBE1(NAME, A)                    \
+        do {                                    \
+                if (0) {                        \
+                        (void)(A);              \
+                }                               \
+        } while (0)
+#define IMSM_PROBE2(NAME, A, B)                 \
+        do {                                    \
+                if (0) {                        \
+                        (void)(A);              \
+                        (void)(B);              \
+                }                               \
+        } while (0)
+#define IMSM_PROBE3(NAME, A, B, C)              \
+        do {                                    \
+                if (0) {                        \
+                        (void)(A);              \
+                        (void)(B);              \
+                        (void)(C);              \
+                }                               \
+        } while (0)
+#define IMSM_PROBE4(NAME, A, B, C, D)           \
+        do {                                    \
+                if (0) {                        \
+                        (void)(A);              \
+                        (void)(B);              \
+                        (void)(C);              \
+                        (void)(D);              \
+                }                               \
+        } while (0)
+
+#endif
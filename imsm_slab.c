@@ -1,9 +1,11 @@
 #include "imsm_slab.h"
 
 #include <assert.h>
+#include <stdbool.h>
 #include <stdlib.h>
 
 #include "imsm.h"
+#include "imsm_sdt.h"
 
 /*
  * Slab implementation for imsm.
@@ -62,9 +64,45 @@ magazine_of_alloc_cache(struct imsm_entry **entries)
         return (void *)(base - offset);
 }
 
+static inline void
+spin_pause(void)
+{
+
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+        return;
+}
+
+/*
+ * The depot lock is only taken when a context's cache runs dry or
+ * overflows, once every SLAB_MAGAZINE_SIZE operations at most.
+ */
+static void
+slab_lock(struct imsm_slab *slab)
+{
+
+        while (__atomic_exchange_n(&slab->lock, 1, __ATOMIC_ACQUIRE) != 0) {
+                while (__atomic_load_n(&slab->lock, __ATOMIC_RELAXED) != 0)
+                        spin_pause();
+        }
+
+        return;
+}
+
+static void
+slab_unlock(struct imsm_slab *slab)
+{
+
+        __atomic_store_n(&slab->lock, 0, __ATOMIC_RELEASE);
+        return;
+}
+
 /*
  * Returns an empty magazine, either from the slab's list cache of empty magazines,
  * of via `calloc`.
+ *
+ * The slab must be locked.
  */
 static inline struct imsm_slab_magazine *
 slab_get_empty_magazine(struct imsm_slab *slab)
@@ -82,6 +120,8 @@ slab_get_empty_magazine(struct imsm_slab *slab)
 
 /*
  * Returns a full magazine, or NULL if none is available.
+ *
+ * The slab must be locked.
  */
 static inline struct imsm_slab_magazine *
 slab_get_full_magazine(struct imsm_slab *slab)
@@ -96,108 +136,152 @@ slab_get_full_magazine(struct imsm_slab *slab)
 }
 
 /*
- * Replaces a slab's current freeing magazine.
+ * Replaces a cache's current freeing magazine.
+ *
+ * The slab must be locked.
  */
 static inline void
-slab_refresh_current_freeing(struct imsm_slab *slab)
+slab_refresh_current_freeing(struct imsm_slab *slab,
+    struct imsm_slab_cache *cache)
 {
         struct imsm_slab_magazine *empty;
 
-        assert(slab->current_freeing == NULL);
+        assert(cache->current_freeing == NULL);
 
         empty = slab_get_empty_magazine(slab);
-        slab->current_freeing = free_cache_of_magazine(empty);
-        slab->current_free_index = -SLAB_MAGAZINE_SIZE;
+        assert(empty != NULL && "Magazine allocation failed.");
+        cache->current_freeing = free_cache_of_magazine(empty);
+        cache->current_free_index = -SLAB_MAGAZINE_SIZE;
         return;
 }
 
 /*
- * Steals the current freeing cache as the new allocation cache if
- * possible.
+ * Steals the current freeing cache in `from` as the new allocation
+ * cache in `to`, if possible.
  *
  * We need this edge cache to guarantee a slab will allocate
  * successfully even if it has capacity for less than two magazines.
+ *
+ * The slab must be locked.
  */
-static void
-slab_convert_freeing_to_allocating(struct imsm_slab *slab)
+static bool
+slab_convert_freeing_to_allocating(struct imsm_slab *slab,
+    struct imsm_slab_cache *from, struct imsm_slab_cache *to)
 {
         struct imsm_slab_magazine *current_cache;
-        size_t num_freed = SLAB_MAGAZINE_SIZE + slab->current_free_index;
+        size_t num_freed;
 
-        assert(slab->current_freeing != NULL &&
-            "current_freeing must always be valid and never full.");
-        assert(slab->current_free_index >= -SLAB_MAGAZINE_SIZE);
+        assert(to->current_allocating == NULL);
 
-        /* If the current freeing cache is empty, there's nothing to convert. */
-        if (num_freed == 0) {
-                slab->current_alloc_index = 0;
-                slab->current_allocating = NULL;
-                return;
-        }
+        /* If the freeing cache is missing or empty, there's nothing to convert. */
+        if (from->current_freeing == NULL)
+                return false;
 
-        current_cache = magazine_of_free_cache(slab->current_freeing);
+        assert(from->current_free_index >= -SLAB_MAGAZINE_SIZE &&
+            from->current_free_index < 0 &&
+            "current_freeing must never be full.");
+        num_freed = SLAB_MAGAZINE_SIZE + from->current_free_index;
+        if (num_freed == 0)
+                return false;
+
+        current_cache = magazine_of_free_cache(from->current_freeing);
 
         /* Steal the current free cache, replace it with a new empty one. */
-        slab->current_freeing = NULL;
-        slab_refresh_current_freeing(slab);
+        from->current_freeing = NULL;
+        slab_refresh_current_freeing(slab, from);
 
-        slab->current_allocating = alloc_cache_of_magazine(current_cache);
-        slab->current_alloc_index = num_freed;
-        return;
+        to->current_allocating = alloc_cache_of_magazine(current_cache);
+        to->current_alloc_index = num_freed;
+        return true;
 }
 
 /*
- * Replaces a slab's current allocating magazine.
+ * Replaces a cache's current allocating magazine: first try a full
+ * magazine, then the depot's partial freeing magazine, and finally
+ * the cache's own freeing magazine.
+ *
+ * The slab must be locked.
  */
 static inline void
-slab_refresh_current_allocating(struct imsm_slab *slab)
+slab_refresh_current_allocating(struct imsm_slab *slab,
+    struct imsm_slab_cache *cache)
 {
         struct imsm_slab_magazine *full;
 
-        assert(slab->current_allocating == NULL);
+        assert(cache->current_allocating == NULL);
 
         full = slab_get_full_magazine(slab);
         if (full == NULL) {
-                slab_convert_freeing_to_allocating(slab);
+                if (!slab_convert_freeing_to_allocating(slab,
+                    &slab->depot, cache))
+                        slab_convert_freeing_to_allocating(slab,
+                            cache, cache);
                 return;
         }
 
-        slab->current_allocating = alloc_cache_of_magazine(full);
-        slab->current_alloc_index = SLAB_MAGAZINE_SIZE;
+        cache->current_allocating = alloc_cache_of_magazine(full);
+        cache->current_alloc_index = SLAB_MAGAZINE_SIZE;
         return;
 }
 
 /*
- * Flushes the current full freeing magazine to the freelist, and
- * replaces it with a new empty magazine.
+ * Flushes a cache's current full freeing magazine to the freelist,
+ * and replaces it with a new empty magazine.
+ *
+ * The slab must be locked.
  */
 static inline void
-slab_flush(struct imsm_slab *slab)
+slab_flush(struct imsm_slab *slab, struct imsm_slab_cache *cache)
 {
         struct imsm_slab_magazine *full;
 
-        assert(slab->current_free_index == 0 &&
+        assert(cache->current_free_index == 0 &&
             "slab_flush must only be called on full magazines");
 
-        full = magazine_of_free_cache(slab->current_freeing);
+        full = magazine_of_free_cache(cache->current_freeing);
         full->next = slab->freelist;
         slab->freelist = full;
 
-        slab->current_freeing = NULL;
-        slab_refresh_current_freeing(slab);
+        cache->current_freeing = NULL;
+        slab_refresh_current_freeing(slab, cache);
         return;
 }
 
 /*
- * Pushes `entry` to the freelist.
+ * Pushes `entry` to the depot.
+ *
+ * The slab must be locked.
  */
 static void
 slab_add_free(struct imsm_slab *slab, struct imsm_entry *entry)
 {
+        struct imsm_slab_cache *depot = &slab->depot;
 
-        slab->current_freeing[++slab->current_free_index] = entry;
-        if (slab->current_free_index == 0)
-                slab_flush(slab);
+        depot->current_freeing[++depot->current_free_index] = entry;
+        if (depot->current_free_index == 0)
+                slab_flush(slab, depot);
+        return;
+}
+
+/*
+ * Returns the empty magazine backing an allocation cache to the
+ * slab's list of empty magazines.
+ *
+ * The slab must be locked.
+ */
+static void
+slab_release_allocating(struct imsm_slab *slab, struct imsm_slab_cache *cache)
+{
+        struct imsm_slab_magazine *empty;
+
+        assert(cache->current_alloc_index == 0);
+        if (cache->current_allocating == NULL)
+                return;
+
+        empty = magazine_of_alloc_cache(cache->current_allocating);
+        empty->next = slab->empty;
+        slab->empty = empty;
+        cache->current_allocating = NULL;
         return;
 }
 
@@ -210,12 +294,13 @@ slab_init_freelist(struct imsm_slab *slab)
         const size_t nelem = slab->arena_size / elsize;
 
         slab->element_count = nelem;
-        slab_refresh_current_freeing(slab);
+        slab_refresh_current_freeing(slab, &slab->depot);
         for (size_t i = nelem; i --> 0; ) {
                 struct imsm_entry *to_free;
 
                 to_free = (struct imsm_entry *)(arena + i * elsize);
-                *to_free = (struct imsm_entry) { 0 };
+                /* Fresh entries aren't in any queue either. */
+                *to_free = (struct imsm_entry) { .queue_id = UINT16_MAX };
                 init_fn(to_free);
                 slab_add_free(slab, to_free);
         }
@@ -223,13 +308,13 @@ slab_init_freelist(struct imsm_slab *slab)
         /*
          * Confirm that we setup a valid slab.
          */
-        assert(slab->current_alloc_index == 0);
-        assert(slab->current_free_index < 0 &&
-            slab->current_free_index >= -SLAB_MAGAZINE_SIZE);
+        assert(slab->depot.current_alloc_index == 0);
+        assert(slab->depot.current_free_index < 0 &&
+            slab->depot.current_free_index >= -SLAB_MAGAZINE_SIZE);
 
-        /* The slab's allocation cache is initially empty. */
-        assert(slab->current_allocating == NULL);
-        assert(slab->current_freeing != NULL);
+        /* The depot never allocates directly. */
+        assert(slab->depot.current_allocating == NULL);
+        assert(slab->depot.current_freeing != NULL);
         assert(slab->empty == NULL);
         return;
 }
@@ -262,14 +347,15 @@ imsm_slab_init(struct imsm_slab *slab, void *arena, size_t arena_size,
 struct imsm_entry *
 imsm_get_slow(struct imsm_ctx *ctx, struct imsm *imsm)
 {
-        struct imsm_slab *slab = &imsm->slab;
+        struct imsm_slab_cache *cache = &ctx->slab_cache;
 
         assert(ctx->imsm == imsm &&
             "imsm context and allocating imsm must match.");
 
-        if (slab->current_allocating == NULL)
-                imsm_get_cache_reload(imsm);
-        if (slab->current_allocating == NULL)
+        IMSM_PROBE2(get_slow, imsm->global_index, ctx->worker_index);
+        if (cache->current_allocating == NULL)
+                imsm_get_cache_reload(ctx, imsm);
+        if (cache->current_allocating == NULL)
                 return NULL;
 
         /* imsm_get only calls get_slow if current_allocating == NULL. */
@@ -277,41 +363,100 @@ imsm_get_slow(struct imsm_ctx *ctx, struct imsm *imsm)
 }
 
 void
-imsm_get_cache_reload(struct imsm *imsm)
+imsm_get_cache_reload(struct imsm_ctx *ctx, struct imsm *imsm)
 {
         struct imsm_slab *slab = &imsm->slab;
+        struct imsm_slab_cache *cache = &ctx->slab_cache;
 
-        assert(slab->current_alloc_index == 0 &&
+        assert(cache->current_alloc_index == 0 &&
             "Only empty allocation caches may be reloaded");
+
+        IMSM_PROBE2(get_reload, imsm->global_index, ctx->worker_index);
+        slab_lock(slab);
         /*
          * If we have an empty allocation cache, push it to the list
          * of empty magazines.
          */
-        if (__builtin_expect(slab->current_allocating != NULL, 1)) {
-                struct imsm_slab_magazine *empty;
+        slab_release_allocating(slab, cache);
+        slab_refresh_current_allocating(slab, cache);
+        slab_unlock(slab);
+        return;
+}
 
-                empty = magazine_of_alloc_cache(slab->current_allocating);
-                empty->next = slab->empty;
-                slab->empty = empty;
-                slab->current_allocating = NULL;
+extern struct imsm_entry *imsm_get(struct imsm_ctx *, struct imsm *imsm);
+
+size_t
+imsm_get_n(struct imsm_ctx *ctx, struct imsm *imsm,
+    struct imsm_entry **dst, size_t n)
+{
+        struct imsm_slab_cache *cache = &ctx->slab_cache;
+        size_t ret = 0;
+
+        assert(ctx->imsm == imsm &&
+            "imsm context and allocating imsm must match.");
+
+        while (ret < n) {
+                uint32_t alloc_index;
+
+                if (cache->current_allocating == NULL)
+                        imsm_get_cache_reload(ctx, imsm);
+                if (cache->current_allocating == NULL)
+                        break;
+
+                /*
+                 * Pop as many entries as we can from the current
+                 * magazine.  Make sure this loop matches imsm_get.
+                 */
+                alloc_index = cache->current_alloc_index;
+                for (; alloc_index > 0 && ret < n; ret++) {
+                        struct imsm_entry *entry;
+
+                        entry = cache->current_allocating[--alloc_index];
+                        entry->version++;
+                        dst[ret] = entry;
+                }
+
+                cache->current_alloc_index = alloc_index;
+                if (alloc_index == 0)
+                        imsm_get_cache_reload(ctx, imsm);
         }
 
-        slab_refresh_current_allocating(slab);
-        return;
+        return ret;
 }
 
-extern struct imsm_entry *imsm_get(struct imsm_ctx *, struct imsm *imsm);
+void
+imsm_put_slow(struct imsm_ctx *ctx, struct imsm *imsm, struct imsm_entry *freed)
+{
+        struct imsm_slab *slab = &imsm->slab;
+        struct imsm_slab_cache *cache = &ctx->slab_cache;
+
+        assert(ctx->imsm == imsm &&
+            "imsm context and allocating imsm must match.");
+
+        slab_lock(slab);
+        if (cache->current_freeing == NULL)
+                slab_refresh_current_freeing(slab, cache);
+        cache->current_freeing[++cache->current_free_index] = freed;
+        if (cache->current_free_index == 0)
+                slab_flush(slab, cache);
+        slab_unlock(slab);
+        return;
+}
 
-inline void
+void
 imsm_put_cache_reload(struct imsm_ctx *ctx, struct imsm *imsm)
 {
         struct imsm_slab *slab = &imsm->slab;
+        struct imsm_slab_cache *cache = &ctx->slab_cache;
 
         assert(ctx->imsm == imsm &&
             "imsm context and allocating imsm must match.");
-        assert(slab->current_free_index == 0 &&
+        assert(cache->current_free_index == 0 &&
             "Only empty free caches may be reloaded");
-        slab_flush(slab);
+        IMSM_PROBE2(put_reload, imsm->global_index, ctx->worker_index);
+        slab_lock(slab);
+        slab_flush(slab, cache);
+        slab_unlock(slab);
         return;
 }
 
@@ -322,6 +467,7 @@ imsm_put_n(struct imsm_ctx *ctx, struct imsm *imsm,
     struct imsm_entry **freed_list, size_t n)
 {
         struct imsm_slab *slab = &imsm->slab;
+        struct imsm_slab_cache *cache = &ctx->slab_cache;
         void (*deinit_fn)(void *) = slab->deinit_fn;
         size_t non_null_count;
         long free_index;
@@ -341,12 +487,25 @@ imsm_put_n(struct imsm_ctx *ctx, struct imsm *imsm,
                 if (freed == NULL)
                         continue;
 
+                imsm_trace(IMSM_TRACE_PUT, imsm, freed, UINT16_MAX);
                 deinit_fn(freed);
                 freed_list[non_null_count++] = freed;
         }
 
+        if (non_null_count == 0)
+                return;
+
+        /* Make sure this matches imsm_put. */
+        __atomic_add_fetch(&imsm->change_count, 1, __ATOMIC_RELAXED);
+
+        if (__builtin_expect(cache->current_freeing == NULL, 0)) {
+                slab_lock(slab);
+                slab_refresh_current_freeing(slab, cache);
+                slab_unlock(slab);
+        }
+
         /* Locally replace current_free_index with the scalar free_index. */
-        free_index = slab->current_free_index;
+        free_index = cache->current_free_index;
 
         /*
          * Iterate over non-NULL entries and add them to the free list.
@@ -358,16 +517,130 @@ imsm_put_n(struct imsm_ctx *ctx, struct imsm *imsm,
                 /* Make sure this loop matches imsm_put. */
                 freed->version = (freed->version + 1) & ~1;
                 freed->queue_id = -1;
+                freed->wakeup_pending = 0;
                 free_index++;
-                slab->current_freeing[free_index] = freed;
+                cache->current_freeing[free_index] = freed;
                 if (free_index == 0) {
-                        slab->current_free_index = free_index;
+                        cache->current_free_index = free_index;
                         imsm_put_cache_reload(ctx, imsm);
-                        free_index = slab->current_free_index;
+                        free_index = cache->current_free_index;
                 }
         }
 
-        slab->current_free_index = free_index;
+        cache->current_free_index = free_index;
+        return;
+}
+
+void
+imsm_slab_cache_flush(struct imsm_ctx *ctx)
+{
+
+        if (ctx->imsm == NULL)
+                return;
+
+        imsm_slab_cache_release(&ctx->imsm->slab, &ctx->slab_cache);
+        return;
+}
+
+/*
+ * Replaces `cache`'s empty (or missing) allocation magazine.
+ */
+static void
+slab_cache_reload_allocating(struct imsm_slab *slab,
+    struct imsm_slab_cache *cache)
+{
+
+        slab_lock(slab);
+        slab_release_allocating(slab, cache);
+        slab_refresh_current_allocating(slab, cache);
+        slab_unlock(slab);
+        return;
+}
+
+struct imsm_entry *
+imsm_slab_get(struct imsm_slab *slab, struct imsm_slab_cache *cache)
+{
+        struct imsm_entry *ret;
+        size_t alloc_index;
+
+        if (cache->current_allocating == NULL) {
+                slab_cache_reload_allocating(slab, cache);
+                if (cache->current_allocating == NULL)
+                        return NULL;
+        }
+
+        /* Make sure this matches imsm_get. */
+        alloc_index = --cache->current_alloc_index;
+        ret = cache->current_allocating[alloc_index];
+        ret->version++;
+        if (alloc_index == 0)
+                slab_cache_reload_allocating(slab, cache);
+
+        return ret;
+}
+
+void
+imsm_slab_put(struct imsm_slab *slab, struct imsm_slab_cache *cache,
+    struct imsm_entry *freed)
+{
+
+        if (freed == NULL)
+                return;
+
+        /* Make sure this matches imsm_put. */
+        slab->deinit_fn(freed);
+        freed->version = (freed->version + 1) & ~1;
+        freed->queue_id = -1;
+        freed->wakeup_pending = 0;
+
+        if (__builtin_expect(cache->current_freeing == NULL, 0)) {
+                slab_lock(slab);
+                slab_refresh_current_freeing(slab, cache);
+                slab_unlock(slab);
+        }
+
+        cache->current_freeing[++cache->current_free_index] = freed;
+        if (cache->current_free_index == 0) {
+                slab_lock(slab);
+                slab_flush(slab, cache);
+                slab_unlock(slab);
+        }
+
+        return;
+}
+
+void
+imsm_slab_cache_release(struct imsm_slab *slab, struct imsm_slab_cache *cache)
+{
+
+        slab_lock(slab);
+        if (cache->current_allocating != NULL) {
+                while (cache->current_alloc_index > 0) {
+                        size_t i = --cache->current_alloc_index;
+
+                        slab_add_free(slab, cache->current_allocating[i]);
+                }
+
+                slab_release_allocating(slab, cache);
+        }
+
+        if (cache->current_freeing != NULL) {
+                struct imsm_slab_magazine *empty;
+
+                while (cache->current_free_index > -SLAB_MAGAZINE_SIZE) {
+                        long i = cache->current_free_index--;
+
+                        slab_add_free(slab, cache->current_freeing[i]);
+                }
+
+                empty = magazine_of_free_cache(cache->current_freeing);
+                empty->next = slab->empty;
+                slab->empty = empty;
+                cache->current_freeing = NULL;
+        }
+
+        slab_unlock(slab);
+        *cache = (struct imsm_slab_cache) { 0 };
         return;
 }
 
@@ -8,7 +8,11 @@ struct imsm_ctx;
 
 struct imsm_slab_magazine;
 
-struct imsm_slab {
+/*
+ * Allocation and deallocation caches for one slab.  Each `imsm_ctx`
+ * has its own cache, so the fast paths never touch shared state.
+ */
+struct imsm_slab_cache {
         /* Allocation goes down to 0. */
         uint32_t current_alloc_index;
         /* Deallocation goes up to 0. */
@@ -18,11 +22,24 @@ struct imsm_slab {
          * current_*_index to 0.  Once the item at zero is populated
          * or consumed, the cache must be recycled.
          *
-         * `current_allocating` may be NULL if we're out of slab items;
-         * `current_freeing` must always be a valid non-full magazine.
+         * Either may be NULL: `current_allocating` if we're out of
+         * slab items, and `current_freeing` until the first
+         * deallocation.  A non-NULL `current_freeing` is never full.
          */
         struct imsm_entry **current_allocating;
         struct imsm_entry **current_freeing;
+};
+
+struct imsm_slab {
+        /*
+         * The depot's cache receives the initial slab items and
+         * items flushed from dead contexts.  Contexts only steal its
+         * freeing magazine when the freelist is empty.
+         */
+        struct imsm_slab_cache depot;
+
+        /* Spinlock for `depot`, `freelist` and `empty`. */
+        uint32_t lock;
 
         void (*deinit_fn)(void *);
 
@@ -65,6 +82,16 @@ void imsm_slab_init(struct imsm_slab *slab, void *arena, size_t arena_size,
  */
 inline struct imsm_entry *imsm_get(struct imsm_ctx *, struct imsm *);
 
+/*
+ * Allocates up to `n` objects from the `imsm`'s slab, in bulk, and
+ * stores them in `dst`.  Returns the number of objects allocated,
+ * which is only less than `n` if the slab ran out of free objects.
+ *
+ * See IMSM_GET_N for a type-safe version.
+ */
+size_t imsm_get_n(struct imsm_ctx *, struct imsm *,
+    struct imsm_entry **dst, size_t n);
+
 /*
  * Deallocates one object back to the `imsm`'s slab.  Safe to call on
  * NULL pointers, but will abort on any other pointer not allocated
@@ -85,6 +112,38 @@ inline void imsm_put(struct imsm_ctx *, struct imsm *, struct imsm_entry *);
 void imsm_put_n(struct imsm_ctx *, struct imsm *,
     struct imsm_entry **, size_t n);
 
+/*
+ * Returns all the objects cached in the `imsm_ctx`'s slab cache to
+ * the shared depot.  Contexts must be flushed before they go away, or
+ * their cached objects will never be allocated again.
+ */
+void imsm_slab_cache_flush(struct imsm_ctx *);
+
+/*
+ * The functions below work on a bare slab, with an explicit cache, for
+ * slabs that aren't an imsm's (e.g., buffer pools).  Each thread must
+ * use its own cache.
+ */
+
+/*
+ * Allocates one object from `slab` through `cache`, or returns NULL
+ * if the slab has no free object.
+ */
+struct imsm_entry *imsm_slab_get(struct imsm_slab *, struct imsm_slab_cache *);
+
+/*
+ * Deallocates `freed` (which may be NULL) back to `slab` through
+ * `cache`.
+ */
+void imsm_slab_put(struct imsm_slab *, struct imsm_slab_cache *,
+    struct imsm_entry *freed);
+
+/*
+ * Returns all the objects in `cache` to `slab`'s depot, and resets
+ * the cache.
+ */
+void imsm_slab_cache_release(struct imsm_slab *, struct imsm_slab_cache *);
+
 /*
  * Accepts an interior pointer to an element of the `imsm_ctx`'s slab,
  * and returns a pointer to the entry header, or NULL if there is no
@@ -6,41 +6,46 @@
 struct imsm_entry *imsm_get_slow(struct imsm_ctx *, struct imsm *);
 
 /*
- * Reloads the imsm slab's allocation cache.
+ * Reloads the context's allocation cache.
  */
-void imsm_get_cache_reload(struct imsm *);
+void imsm_get_cache_reload(struct imsm_ctx *, struct imsm *);
 
 inline struct imsm_entry *
 imsm_get(struct imsm_ctx *ctx, struct imsm *imsm)
 {
-        struct imsm_slab *slab = &imsm->slab;
+        struct imsm_slab_cache *cache = &ctx->slab_cache;
         struct imsm_entry *ret;
         size_t alloc_index;
 
         /* If we have no allocation cache at all, enter the slow path. */
         if (__builtin_expect(
-            ctx->imsm != imsm || slab->current_allocating == NULL, 0))
+            ctx->imsm != imsm || cache->current_allocating == NULL, 0))
                 return imsm_get_slow(ctx, imsm);
 
-        alloc_index = slab->current_alloc_index - 1;
-        slab->current_alloc_index = alloc_index;
-        ret = slab->current_allocating[alloc_index];
+        alloc_index = cache->current_alloc_index - 1;
+        cache->current_alloc_index = alloc_index;
+        ret = cache->current_allocating[alloc_index];
         ret->version++;
         if (__builtin_expect(alloc_index == 0, 0))
-                imsm_get_cache_reload(imsm);
+                imsm_get_cache_reload(ctx, imsm);
 
         return ret;
 }
 
 /*
- * Reloads the imsm slab's deallocation cache.
+ * Full slow path for slab deallocation, once `freed` is deinitialised.
+ */
+void imsm_put_slow(struct imsm_ctx *, struct imsm *, struct imsm_entry *freed);
+
+/*
+ * Reloads the context's deallocation cache.
  */
 void imsm_put_cache_reload(struct imsm_ctx *, struct imsm *imsm);
 
 inline void
 imsm_put(struct imsm_ctx *ctx, struct imsm *imsm, struct imsm_entry *freed)
 {
-        struct imsm_slab *slab = &imsm->slab;
+        struct imsm_slab_cache *cache = &ctx->slab_cache;
         long free_index;
 
         if (__builtin_expect(freed == NULL, 0)) {
@@ -48,13 +53,23 @@ imsm_put(struct imsm_ctx *ctx, struct imsm *imsm, struct imsm_entry *freed)
         }
 
         /* Make sure this code matches imsm_put_n. */
-        slab->deinit_fn(freed);
+        imsm_trace(IMSM_TRACE_PUT, imsm, freed, UINT16_MAX);
+        imsm->slab.deinit_fn(freed);
         freed->version = (freed->version + 1) & ~1;
         freed->queue_id = -1;
-        free_index = slab->current_free_index + 1;
-        slab->current_free_index = free_index;
-        slab->current_freeing[free_index] = freed;
-        if (__builtin_expect(free_index == 0 || ctx->imsm != imsm, 0))
+        freed->wakeup_pending = 0;
+        /* Freed capacity is new work for blocked allocations. */
+        __atomic_add_fetch(&imsm->change_count, 1, __ATOMIC_RELAXED);
+        if (__builtin_expect(
+            ctx->imsm != imsm || cache->current_freeing == NULL, 0)) {
+                imsm_put_slow(ctx, imsm, freed);
+                return;
+        }
+
+        free_index = cache->current_free_index + 1;
+        cache->current_free_index = free_index;
+        cache->current_freeing[free_index] = freed;
+        if (__builtin_expect(free_index == 0, 0))
                 imsm_put_cache_reload(ctx, imsm);
         return;
 }
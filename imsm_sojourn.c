@@ -0,0 +1,155 @@
+#include "imsm_sojourn.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "imsm.h"
+
+static struct imsm_sojourn *recorders;
+
+struct imsm_sojourn *
+imsm_sojourn_create(struct imsm_ctx *ctx)
+{
+        struct imsm *imsm = ctx->imsm;
+        struct imsm_sojourn_times *times;
+        struct imsm_sojourn *ret;
+
+        ret = calloc(1, sizeof(*ret));
+        if (ret == NULL)
+                return NULL;
+
+        ret->imsm = imsm;
+        ret->queues = calloc(IMSM_MAX_QUEUES, sizeof(*ret->queues));
+        if (ret->queues == NULL) {
+                free(ret);
+                return NULL;
+        }
+
+        /* Workers may race to enable the timestamps: one array wins. */
+        if (__atomic_load_n(&imsm->sojourn_times, __ATOMIC_ACQUIRE) == NULL) {
+                struct imsm_sojourn_times *expected = NULL;
+
+                times = calloc(imsm->slab.element_count, sizeof(*times));
+                if (times == NULL) {
+                        free(ret->queues);
+                        free(ret);
+                        return NULL;
+                }
+
+                if (!__atomic_compare_exchange_n(&imsm->sojourn_times,
+                    &expected, times, false, __ATOMIC_ACQ_REL,
+                    __ATOMIC_ACQUIRE))
+                        free(times);
+        }
+
+        ret->next = __atomic_load_n(&recorders, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&recorders, &ret->next, ret,
+            /*weak=*/true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+                ;
+
+        return ret;
+}
+
+void
+imsm_sojourn_record(struct imsm_sojourn *sojourn,
+    const struct imsm_ppoint *ppoint, size_t queue_id,
+    uint64_t event_wait_ns, uint64_t poll_wait_ns)
+{
+        struct imsm_sojourn_queue *queue;
+
+        if (queue_id >= IMSM_MAX_QUEUES)
+                return;
+
+        queue = sojourn->queues[queue_id];
+        if (__builtin_expect(queue == NULL, 0)) {
+                queue = calloc(1, sizeof(*queue));
+                if (queue == NULL)
+                        return;
+
+                __atomic_store_n(&sojourn->queues[queue_id], queue,
+                    __ATOMIC_RELEASE);
+        }
+
+        /* Queue ids are positional: restart if another stage took over. */
+        if (queue->ppoint != ppoint) {
+                imsm_hist_reset(&queue->event_wait);
+                imsm_hist_reset(&queue->poll_wait);
+                queue->ppoint = ppoint;
+        }
+
+        imsm_hist_record(&queue->event_wait, event_wait_ns);
+        imsm_hist_record(&queue->poll_wait, poll_wait_ns);
+        return;
+}
+
+static void
+print_quantiles(FILE *out, const struct imsm_hist *hist)
+{
+
+        fprintf(out, " %9.1f %9.1f %9.1f %9.1f",
+            imsm_hist_quantile(hist, 0.5) * 1e-3,
+            imsm_hist_quantile(hist, 0.99) * 1e-3,
+            imsm_hist_quantile(hist, 0.999) * 1e-3,
+            hist->max * 1e-3);
+        return;
+}
+
+void
+imsm_sojourn_print(FILE *out, const struct imsm *imsm)
+{
+        struct imsm_sojourn_queue *merged;
+        bool any = false;
+
+        merged = malloc(sizeof(*merged));
+        if (merged == NULL)
+                return;
+
+        for (size_t queue_id = 0; queue_id < IMSM_MAX_QUEUES; queue_id++) {
+                const struct imsm_ppoint *ppoint = NULL;
+
+                *merged = (struct imsm_sojourn_queue) { 0 };
+                for (const struct imsm_sojourn *sojourn =
+                     __atomic_load_n(&recorders, __ATOMIC_ACQUIRE);
+                     sojourn != NULL; sojourn = sojourn->next) {
+                        const struct imsm_sojourn_queue *queue;
+
+                        if (sojourn->imsm != imsm)
+                                continue;
+
+                        queue = __atomic_load_n(&sojourn->queues[queue_id],
+                            __ATOMIC_ACQUIRE);
+                        if (queue == NULL || queue->event_wait.count == 0)
+                                continue;
+
+                        ppoint = queue->ppoint;
+                        imsm_hist_merge(&merged->event_wait,
+                            &queue->event_wait);
+                        imsm_hist_merge(&merged->poll_wait,
+                            &queue->poll_wait);
+                }
+
+                if (merged->event_wait.count == 0)
+                        continue;
+
+                if (!any) {
+                        fprintf(out, "  %5s %-24s %10s %39s %39s\n", "",
+                            "", "", "event wait (us)", "poll wait (us)");
+                        fprintf(out, "  %5s %-24s %10s %9s %9s %9s %9s"
+                            " %9s %9s %9s %9s\n", "queue", "stage",
+                            "wake-ups", "p50", "p99", "p99.9", "max",
+                            "p50", "p99", "p99.9", "max");
+                        any = true;
+                }
+
+                fprintf(out, "  %5zu %-24s %10llu", queue_id,
+                    (ppoint != NULL && ppoint->name != NULL)
+                    ? ppoint->name : "?",
+                    (unsigned long long)merged->event_wait.count);
+                print_quantiles(out, &merged->event_wait);
+                print_quantiles(out, &merged->poll_wait);
+                fprintf(out, "\n");
+        }
+
+        free(merged);
+        return;
+}
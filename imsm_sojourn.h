@@ -0,0 +1,83 @@
+#pragma once
+
+/*
+ * Per-program-point sojourn time histograms.
+ *
+ * Each time `imsm_stage_io` dispatches a wake-up, we split the time
+ * the entry spent in its queue since it was staged (or since its
+ * previous dispatch) in two:
+ *
+ *  - the event wait, until something woke the entry up (e.g., until
+ *    its socket became readable);
+ *  - the poll wait, from that wake-up to its dispatch, i.e., the
+ *    time the wake-up sat in the queue until the next poll pass.
+ *
+ * Long event waits point at slow peers or I/O; long poll waits at an
+ * overloaded or stalled driver loop.  Entries staged in are woken
+ * immediately, so both waits are (close to) 0 for them.
+ *
+ * Tracking needs one clock read per stage that stages entries in, per
+ * wake-up (`imsm_notify`), and per stage that dispatches wake-ups, so
+ * it's opt-in: creating a sojourn recorder for a context enables the
+ * timestamps for the context's imsm, and only contexts with a
+ * recorder feed histograms.  Histograms are per context, so recording
+ * is single-writer; printing merges every context's histograms for
+ * the same imsm and queue.
+ */
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "imsm_hist.h"
+
+struct imsm;
+struct imsm_ctx;
+struct imsm_ppoint;
+
+/*
+ * Per-entry timestamps, in CLOCK_MONOTONIC nanoseconds.
+ */
+struct imsm_sojourn_times {
+        /* When the entry was staged in, or last dispatched. */
+        uint64_t waiting_since;
+        /* When the entry's pending wake-up was posted. */
+        uint64_t woken_at;
+};
+
+struct imsm_sojourn_queue {
+        const struct imsm_ppoint *ppoint;
+        struct imsm_hist event_wait;
+        struct imsm_hist poll_wait;
+};
+
+struct imsm_sojourn {
+        /* All recorders, for `imsm_sojourn_print`. */
+        struct imsm_sojourn *next;
+        const struct imsm *imsm;
+        /* IMSM_MAX_QUEUES histogram pairs, allocated on demand. */
+        struct imsm_sojourn_queue **queues;
+};
+
+/*
+ * Returns a new recorder for `ctx` (but does not attach it), and
+ * enables per-entry timestamps for `ctx->imsm`, or returns NULL on
+ * failure.
+ *
+ * Recorders are never freed: they stay registered for
+ * `imsm_sojourn_print` after their context is gone.
+ */
+struct imsm_sojourn *imsm_sojourn_create(struct imsm_ctx *ctx);
+
+/*
+ * Accumulates one dispatch from `queue_id`.
+ */
+void imsm_sojourn_record(struct imsm_sojourn *, const struct imsm_ppoint *,
+    size_t queue_id, uint64_t event_wait_ns, uint64_t poll_wait_ns);
+
+/*
+ * Prints the event and poll wait quantiles for each of `imsm`'s
+ * queues, merged over all its recorders, to `out`.  Safe to call
+ * while workers record, at the cost of slightly inconsistent
+ * quantiles.
+ */
+void imsm_sojourn_print(FILE *out, const struct imsm *imsm);
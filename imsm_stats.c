@@ -0,0 +1,135 @@
+#define _GNU_SOURCE
+
+#include "imsm_stats.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "imsm.h"
+
+/*
+ * Single-writer counter update: readers only need untorn values.
+ */
+static inline void
+counter_add(uint64_t *counter, uint64_t value)
+{
+
+        __atomic_store_n(counter,
+            __atomic_load_n(counter, __ATOMIC_RELAXED) + value,
+            __ATOMIC_RELAXED);
+        return;
+}
+
+static void
+copy_name(char *dst, size_t size, const char *src)
+{
+
+        memset(dst, 0, size);
+        if (src != NULL)
+                strncpy(dst, src, size - 1);
+        return;
+}
+
+struct imsm_stats *
+imsm_stats_create(const struct imsm_ctx *ctx)
+{
+        struct imsm_stats *ret;
+        void *region;
+
+        ret = calloc(1, sizeof(*ret));
+        if (ret == NULL)
+                return NULL;
+
+        /* The file is sparse: we only pay for the slots we touch. */
+        ret->size = sizeof(*ret->header) +
+            IMSM_MAX_QUEUES * sizeof(*ret->ppoints);
+        ret->fd = memfd_create(IMSM_STATS_MEMFD_NAME, MFD_CLOEXEC);
+        if (ret->fd < 0)
+                goto fail;
+
+        if (ftruncate(ret->fd, ret->size) < 0)
+                goto fail_fd;
+
+        region = mmap(NULL, ret->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+            ret->fd, 0);
+        if (region == MAP_FAILED)
+                goto fail_fd;
+
+        ret->header = region;
+        ret->ppoints = (void *)(ret->header + 1);
+        ret->header->version = IMSM_STATS_VERSION;
+        ret->header->ppoint_size = sizeof(*ret->ppoints);
+        ret->header->capacity = IMSM_MAX_QUEUES;
+        ret->header->pid = getpid();
+        ret->header->tid = gettid();
+        ret->header->imsm_index = ctx->imsm->global_index;
+        ret->header->worker_index = ctx->worker_index;
+        /* Readers check the magic last. */
+        __atomic_store_n(&ret->header->magic, IMSM_STATS_MAGIC,
+            __ATOMIC_RELEASE);
+        return ret;
+
+fail_fd:
+        close(ret->fd);
+fail:
+        free(ret);
+        return NULL;
+}
+
+void
+imsm_stats_destroy(struct imsm_stats *stats)
+{
+
+        if (stats == NULL)
+                return;
+
+        munmap(stats->header, stats->size);
+        close(stats->fd);
+        free(stats);
+        return;
+}
+
+void
+imsm_stats_record(struct imsm_stats *stats, const struct imsm_ppoint *ppoint,
+    size_t queue_id, size_t staged_in, size_t woken_out, uint64_t ns,
+    size_t scanned, size_t depth)
+{
+        struct imsm_stats_ppoint *slot;
+
+        if (queue_id >= stats->header->capacity)
+                return;
+
+        slot = &stats->ppoints[queue_id];
+        if (slot->ppoint != (uintptr_t)ppoint) {
+                /* Unpublish while we (re)write the names. */
+                __atomic_store_n(&slot->valid, 0, __ATOMIC_RELAXED);
+                __atomic_thread_fence(__ATOMIC_RELEASE);
+                slot->queue_id = queue_id;
+                slot->ppoint = (uintptr_t)ppoint;
+                slot->lineno = ppoint->lineno;
+                copy_name(slot->name, sizeof(slot->name), ppoint->name);
+                copy_name(slot->function, sizeof(slot->function),
+                    ppoint->function);
+                copy_name(slot->file, sizeof(slot->file), ppoint->file);
+                slot->calls = 0;
+                slot->staged_in = 0;
+                slot->woken_out = 0;
+                slot->stage_ns = 0;
+                slot->scanned = 0;
+                __atomic_store_n(&slot->valid, 1, __ATOMIC_RELEASE);
+
+                if (queue_id >= stats->header->num_used)
+                        __atomic_store_n(&stats->header->num_used,
+                            queue_id + 1, __ATOMIC_RELEASE);
+        }
+
+        counter_add(&slot->calls, 1);
+        counter_add(&slot->staged_in, staged_in);
+        counter_add(&slot->woken_out, woken_out);
+        counter_add(&slot->stage_ns, ns);
+        counter_add(&slot->scanned, scanned);
+        __atomic_store_n(&slot->depth, depth, __ATOMIC_RELAXED);
+        return;
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+/*
+ * Per-program-point stage statistics, exported through shared memory.
+ *
+ * Each `imsm_ctx` with a non-NULL `stats` records, for every stage
+ * it executes, how many entries were staged in and woken out, how
+ * long the stage took, how many arena entries it scanned, and how
+ * many entries were in the queue.  The counters live in a memfd
+ * named IMSM_STATS_MEMFD_NAME, which external tools can find in
+ * /proc/PID/fd and mmap read-only while the process runs (see
+ * imsm_stats_dump.c).
+ *
+ * Each region has a single writer, the context's thread: readers may
+ * see a slightly stale snapshot, but never a torn counter.
+ */
+#include <stddef.h>
+#include <stdint.h>
+
+struct imsm_ctx;
+struct imsm_ppoint;
+
+#define IMSM_STATS_MEMFD_NAME "imsm-stats"
+
+/* "imsmstat" in little-endian ASCII. */
+#define IMSM_STATS_MAGIC 0x746174736d736d69ULL
+#define IMSM_STATS_VERSION 1
+
+#define IMSM_STATS_NAME_SIZE 48
+#define IMSM_STATS_FUNCTION_SIZE 64
+#define IMSM_STATS_FILE_SIZE 64
+
+struct imsm_stats_header {
+        uint64_t magic;
+        uint32_t version;
+        /* Size of each `struct imsm_stats_ppoint`, for compatibility. */
+        uint32_t ppoint_size;
+        /* Number of slots in the region, one per queue id. */
+        uint32_t capacity;
+        /* 1 + the highest queue id with a populated slot. */
+        uint32_t num_used;
+        int32_t pid;
+        int32_t tid;
+        /* Global index of the context's imsm, and worker index. */
+        uint32_t imsm_index;
+        uint32_t worker_index;
+} __attribute__((__aligned__(64)));
+
+/*
+ * Slots are indexed by queue id.  Names are copied from the
+ * `struct imsm_ppoint` the first time the queue is used, NUL-padded
+ * and possibly truncated, before `valid` is set (with release
+ * semantics).  Queue ids are positional, so a different ppoint may
+ * later execute at the same queue id: the slot is then relabeled and
+ * its counters restart from zero.
+ */
+struct imsm_stats_ppoint {
+        uint32_t valid;
+        uint32_t queue_id;
+        /* Address of the ppoint, only to detect changes. */
+        uint64_t ppoint;
+        uint64_t lineno;
+        char name[IMSM_STATS_NAME_SIZE];
+        char function[IMSM_STATS_FUNCTION_SIZE];
+        char file[IMSM_STATS_FILE_SIZE];
+
+        /* Number of `imsm_stage_io` calls that scanned the queue. */
+        uint64_t calls;
+        uint64_t staged_in;
+        /* Entries that left the queue, timed out ones included. */
+        uint64_t woken_out;
+        /* Total time in `imsm_stage_io`, in nanoseconds. */
+        uint64_t stage_ns;
+        /* Number of arena entries examined by scans. */
+        uint64_t scanned;
+        /* Number of entries in the queue as of the last scan. */
+        uint64_t depth;
+} __attribute__((__aligned__(64)));
+
+/*
+ * Shared memory region for one context, or NULL for none.
+ */
+struct imsm_stats {
+        int fd;
+        size_t size;
+        struct imsm_stats_header *header;
+        struct imsm_stats_ppoint *ppoints;
+};
+
+/*
+ * Returns a new stats region for `ctx` (but does not attach it), or
+ * NULL on failure.
+ */
+struct imsm_stats *imsm_stats_create(const struct imsm_ctx *ctx);
+
+/*
+ * Unmaps and closes the region.  Safe to call on NULL.
+ */
+void imsm_stats_destroy(struct imsm_stats *);
+
+/*
+ * Accumulates one `imsm_stage_io` call for `ppoint` at `queue_id`.
+ */
+void imsm_stats_record(struct imsm_stats *, const struct imsm_ppoint *,
+    size_t queue_id, size_t staged_in, size_t woken_out, uint64_t ns,
+    size_t scanned, size_t depth);
@@ -0,0 +1,245 @@
+#define _GNU_SOURCE
+
+/*
+ * Prints the per-program-point stage statistics that a running
+ * process exports with `imsm_stats` (e.g., driver workers with
+ * `export_stats`), without stopping it.
+ *
+ * Usage: imsm_stats_dump PID [INTERVAL]
+ *
+ * Without an interval, prints totals since each region was created.
+ * With an interval (in seconds), prints what changed during each
+ * interval, until interrupted.
+ *
+ * We find the regions by their memfd name in /proc/PID/fd, so we
+ * need the same permissions as a debugger would.
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "imsm_stats.h"
+
+#define MAX_REGIONS 256
+
+struct region {
+        int fd_number;
+        size_t size;
+        const struct imsm_stats_header *header;
+        const struct imsm_stats_ppoint *ppoints;
+        /* Counters as of the previous interval, if any. */
+        struct imsm_stats_ppoint *previous;
+        size_t num_previous;
+};
+
+/*
+ * Maps the stats region behind /proc/`pid`/fd/`fd_number`, if it is
+ * one.
+ */
+static bool
+region_open(struct region *region, int pid, int fd_number)
+{
+        char path[64];
+        char target[256];
+        struct stat info;
+        void *mapped;
+        ssize_t r;
+        int fd;
+
+        snprintf(path, sizeof(path), "/proc/%d/fd/%d", pid, fd_number);
+        r = readlink(path, target, sizeof(target) - 1);
+        if (r < 0)
+                return false;
+
+        target[r] = '\0';
+        if (strncmp(target, "/memfd:" IMSM_STATS_MEMFD_NAME,
+            strlen("/memfd:" IMSM_STATS_MEMFD_NAME)) != 0)
+                return false;
+
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+                perror(path);
+                return false;
+        }
+
+        if (fstat(fd, &info) < 0 ||
+            (size_t)info.st_size < sizeof(struct imsm_stats_header)) {
+                close(fd);
+                return false;
+        }
+
+        mapped = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mapped == MAP_FAILED) {
+                perror("mmap");
+                return false;
+        }
+
+        *region = (struct region) {
+                .fd_number = fd_number,
+                .size = info.st_size,
+                .header = mapped,
+                .ppoints = (const void *)((const char *)mapped +
+                    sizeof(struct imsm_stats_header)),
+        };
+
+        if (__atomic_load_n(&region->header->magic, __ATOMIC_ACQUIRE) !=
+            IMSM_STATS_MAGIC ||
+            region->header->version != IMSM_STATS_VERSION ||
+            region->header->ppoint_size != sizeof(struct imsm_stats_ppoint) ||
+            sizeof(struct imsm_stats_header) + (size_t)region->header->capacity *
+            sizeof(struct imsm_stats_ppoint) > region->size) {
+                fprintf(stderr, "%s: not a compatible stats region\n", path);
+                munmap(mapped, info.st_size);
+                return false;
+        }
+
+        return true;
+}
+
+/*
+ * Returns the difference `current - previous` for one counter.
+ */
+static uint64_t
+delta(uint64_t current, const struct imsm_stats_ppoint *previous,
+    size_t offset)
+{
+        uint64_t old;
+
+        if (previous == NULL)
+                return current;
+
+        memcpy(&old, (const char *)previous + offset, sizeof(old));
+        return current - old;
+}
+
+#define DELTA(SLOT, PREVIOUS, FIELD)                                    \
+        delta(__atomic_load_n(&(SLOT)->FIELD, __ATOMIC_RELAXED),        \
+            (PREVIOUS), __builtin_offsetof(struct imsm_stats_ppoint, FIELD))
+
+static void
+region_print(struct region *region)
+{
+        const struct imsm_stats_header *header = region->header;
+        size_t num_used;
+
+        num_used = __atomic_load_n(&header->num_used, __ATOMIC_ACQUIRE);
+        if (num_used > header->capacity)
+                num_used = header->capacity;
+
+        printf("pid %d tid %d imsm %u worker %u\n", header->pid,
+            header->tid, header->imsm_index, header->worker_index);
+        printf("  %5s %-24s %-32s %10s %10s %10s %8s %10s %6s %8s\n",
+            "queue", "name", "location", "calls", "in", "out", "depth",
+            "ns/call", "hit%", "scan/call");
+
+        for (size_t i = 0; i < num_used; i++) {
+                const struct imsm_stats_ppoint *slot = &region->ppoints[i];
+                const struct imsm_stats_ppoint *previous = NULL;
+                char location[IMSM_STATS_FILE_SIZE + 24];
+                uint64_t calls, in, out, ns, scanned;
+
+                if (__atomic_load_n(&slot->valid, __ATOMIC_ACQUIRE) == 0)
+                        continue;
+
+                if (i < region->num_previous &&
+                    region->previous[i].ppoint == slot->ppoint)
+                        previous = &region->previous[i];
+
+                calls = DELTA(slot, previous, calls);
+                in = DELTA(slot, previous, staged_in);
+                out = DELTA(slot, previous, woken_out);
+                ns = DELTA(slot, previous, stage_ns);
+                scanned = DELTA(slot, previous, scanned);
+                if (region->previous != NULL && calls == 0)
+                        continue;
+
+                snprintf(location, sizeof(location), "%.*s:%llu",
+                    IMSM_STATS_FILE_SIZE, slot->file,
+                    (unsigned long long)slot->lineno);
+                printf("  %5zu %-24.*s %-32s %10llu %10llu %10llu %8llu "
+                    "%10.0f %6.2f %8.0f\n",
+                    i, IMSM_STATS_NAME_SIZE, slot->name, location,
+                    (unsigned long long)calls, (unsigned long long)in,
+                    (unsigned long long)out,
+                    (unsigned long long)__atomic_load_n(&slot->depth,
+                        __ATOMIC_RELAXED),
+                    (calls > 0) ? (double)ns / calls : 0,
+                    (scanned > 0) ? 100.0 * out / scanned : 0,
+                    (calls > 0) ? (double)scanned / calls : 0);
+        }
+
+        /* Snapshot the counters for the next interval. */
+        free(region->previous);
+        region->previous = malloc(num_used * sizeof(*region->previous));
+        region->num_previous = (region->previous != NULL) ? num_used : 0;
+        if (region->previous != NULL)
+                memcpy(region->previous, region->ppoints,
+                    num_used * sizeof(*region->previous));
+        return;
+}
+
+int
+main(int argc, char **argv)
+{
+        static struct region regions[MAX_REGIONS];
+        size_t num_regions = 0;
+        unsigned int interval = 0;
+        char path[64];
+        struct dirent *entry;
+        DIR *fds;
+        int pid;
+
+        if (argc < 2) {
+                fprintf(stderr, "Usage: imsm_stats_dump PID [INTERVAL]\n");
+                return 1;
+        }
+
+        pid = atoi(argv[1]);
+        if (argc > 2)
+                interval = strtoul(argv[2], NULL, 10);
+
+        snprintf(path, sizeof(path), "/proc/%d/fd", pid);
+        fds = opendir(path);
+        if (fds == NULL) {
+                perror(path);
+                return 1;
+        }
+
+        while ((entry = readdir(fds)) != NULL && num_regions < MAX_REGIONS) {
+                if (entry->d_name[0] == '.')
+                        continue;
+
+                if (region_open(&regions[num_regions], pid,
+                    atoi(entry->d_name)))
+                        num_regions++;
+        }
+
+        closedir(fds);
+        if (num_regions == 0) {
+                fprintf(stderr, "No imsm stats region in process %d\n", pid);
+                return 1;
+        }
+
+        for (;;) {
+                for (size_t i = 0; i < num_regions; i++)
+                        region_print(&regions[i]);
+
+                if (interval == 0)
+                        break;
+
+                fflush(stdout);
+                sleep(interval);
+                printf("\n");
+        }
+
+        return 0;
+}
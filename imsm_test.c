@@ -1,8 +1,26 @@
 #include <assert.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "imsm.h"
+#include "imsm_buf.h"
+#include "imsm_driver.h"
+#include "imsm_dump.h"
+#include "imsm_gather.h"
+#include "imsm_hist.h"
+#include "imsm_mux.h"
+#include "imsm_pool.h"
+#include "imsm_sojourn.h"
+#include "imsm_stats.h"
+#include "imsm_timer.h"
+#include "imsm_trace.h"
 
 struct echo_state;
 
@@ -128,6 +146,83 @@ slab_get_empty(void)
         return;
 }
 
+void
+slab_get_n(void)
+{
+        static struct echo_imsm bulk_echo;
+        static struct echo_state buf[100];
+        struct imsm_ctx ctx = {
+                &bulk_echo.imsm,
+        };
+        struct echo_state *states[150];
+        size_t n0, n1;
+
+        IMSM_CTX_PTR(&ctx);
+        IMSM_INIT(&bulk_echo, header, buf, sizeof(buf),
+                  NULL, NULL, echo_poll);
+
+        /* Bulk allocations span magazines, and stop when we run out. */
+        n0 = IMSM_GET_N(&bulk_echo, states, 70);
+        n1 = IMSM_GET_N(&bulk_echo, &states[n0], 80);
+        printf("slab_get_n: %zu %zu\n", n0, n1);
+        assert(n0 == 70 && n1 == 30);
+        for (size_t i = 0; i < n0 + n1; i++) {
+                assert((states[i]->header.version & 1) == 1);
+                for (size_t j = 0; j < i; j++)
+                        assert(states[i] != states[j]);
+        }
+
+        assert(IMSM_GET_N(&bulk_echo, states, 1) == 0);
+        IMSM_PUT_N(&bulk_echo, states, n0 + n1);
+        assert(IMSM_GET_N(&bulk_echo, states, 150) == 100);
+        IMSM_PUT_N(&bulk_echo, states, 100);
+        imsm_ctx_deinit(&ctx);
+        return;
+}
+
+void
+slab_ctx_flush(void)
+{
+        static struct echo_imsm small_echo;
+        static struct echo_state buf[2];
+        struct imsm_ctx ctx = {
+                &small_echo.imsm,
+        };
+        struct imsm_ctx other = {
+                &small_echo.imsm,
+        };
+        struct echo_state *state0, *state1;
+
+        IMSM_INIT(&small_echo, header, buf, sizeof(buf),
+                  NULL, NULL, echo_poll);
+
+        {
+                IMSM_CTX_PTR(&ctx);
+
+                state0 = IMSM_GET(&small_echo);
+                state1 = IMSM_GET(&small_echo);
+                assert(state0 != NULL && state1 != NULL);
+                IMSM_PUT(&small_echo, state0);
+                IMSM_PUT(&small_echo, state1);
+        }
+
+        {
+                IMSM_CTX_PTR(&other);
+
+                /* The first context's cache holds all the elements. */
+                assert(IMSM_GET(&small_echo) == NULL);
+                imsm_ctx_deinit(&ctx);
+                state0 = IMSM_GET(&small_echo);
+                state1 = IMSM_GET(&small_echo);
+                printf("%p %p\n", state0, state1);
+                assert(state0 != NULL && state1 != NULL);
+                assert(IMSM_GET(&small_echo) == NULL);
+        }
+
+        imsm_ctx_deinit(&other);
+        return;
+}
+
 static void
 ppoint_rec(struct imsm_ctx *IMSM_CTX_PTR_VAR)
 {
@@ -208,6 +303,1251 @@ stage_io(void)
         return;
 }
 
+void
+stage_notify_n(void)
+{
+        struct imsm_ctx ctx = {
+                &echo.imsm,
+        };
+        struct imsm_ref refs[3] = { { 0 } };
+        struct echo_state **in, **out;
+        uint32_t generation;
+
+        IMSM_CTX_PTR(&ctx);
+        in = IMSM_LIST_GET(struct echo_state, 2);
+        imsm_list_push(in, IMSM_GET(&echo), 0);
+        imsm_list_push(in, IMSM_GET(&echo), 0);
+
+        refs[0] = IMSM_REFER(in[0]);
+        refs[2] = IMSM_REFER(in[1]);
+        for (size_t rep = 0; rep < 2; rep++) {
+                if (rep > 0) {
+                        generation = echo.imsm.change_count;
+                        assert(imsm_notify_n(refs, 3) == 3);
+                        /* One wake-up for the whole batch. */
+                        assert(echo.imsm.change_count == generation + 1);
+                        in = NULL;
+                }
+
+                out = IMSM_STAGE("notify_n", in, 0);
+                printf("stage_notify_n: %zu %zu\n", rep,
+                       imsm_list_size(out));
+                assert(imsm_list_size(out) == 2);
+                ctx.position = (struct imsm_ppoint_record) { 0 };
+        }
+
+        IMSM_PUT_N(&echo, out, 2);
+        imsm_ctx_deinit(&ctx);
+        return;
+}
+
+void
+stage_stats(void)
+{
+        struct imsm_ctx ctx = {
+                &echo.imsm,
+        };
+        const struct imsm_stats_header *header;
+        const struct imsm_stats_ppoint *slot = NULL;
+        struct echo_state **in, **out;
+        struct echo_state *waiting;
+        struct imsm_ref ref;
+        void *mapped;
+
+        ctx.stats = imsm_stats_create(&ctx);
+        assert(ctx.stats != NULL && "memfd_create failed");
+
+        /* Look at the counters the way an external reader would. */
+        mapped = mmap(NULL, ctx.stats->size, PROT_READ, MAP_SHARED,
+            ctx.stats->fd, 0);
+        assert(mapped != MAP_FAILED);
+        header = mapped;
+        assert(header->magic == IMSM_STATS_MAGIC);
+        assert(header->num_used == 0);
+
+        IMSM_CTX_PTR(&ctx);
+        in = IMSM_LIST_GET(struct echo_state, 2);
+        imsm_list_push(in, IMSM_GET(&echo), 0);
+        imsm_list_push(in, IMSM_GET(&echo), 0);
+        waiting = in[0];
+        ref = IMSM_REFER(in[1]);
+
+        for (size_t rep = 0; rep < 2; rep++) {
+                if (rep > 0) {
+                        imsm_notify(ref);
+                        in = NULL;
+                }
+
+                out = IMSM_STAGE("stats", in, 0);
+                ctx.position = (struct imsm_ppoint_record) { 0 };
+        }
+
+        assert(imsm_list_size(out) == 1);
+        assert(header->num_used > 0);
+        for (size_t i = 0; i < header->num_used; i++) {
+                const struct imsm_stats_ppoint *current;
+
+                current = (const void *)((const char *)mapped +
+                    sizeof(*header) + i * header->ppoint_size);
+                if (current->valid != 0 && strcmp(current->name, "stats") == 0)
+                        slot = current;
+        }
+
+        assert(slot != NULL && "stage not exported");
+        printf("stage_stats: %s:%llu calls %llu in %llu out %llu depth %llu\n",
+            slot->function, (unsigned long long)slot->lineno,
+            (unsigned long long)slot->calls,
+            (unsigned long long)slot->staged_in,
+            (unsigned long long)slot->woken_out,
+            (unsigned long long)slot->depth);
+        assert(strcmp(slot->function, "stage_stats") == 0);
+        assert(slot->calls == 2);
+        assert(slot->staged_in == 2);
+        /* Staging in publishes a wake-up for both entries. */
+        assert(slot->woken_out == 3);
+        /*
+         * The second scan still finds both entries in the queue, on
+         * top of what earlier tests left at the same queue id.
+         */
+        assert(slot->depth >= 2);
+
+        IMSM_PUT_N(&echo, out, 1);
+        IMSM_PUT(&echo, waiting);
+        munmap(mapped, ctx.stats->size);
+        imsm_stats_destroy(ctx.stats);
+        ctx.stats = NULL;
+        imsm_ctx_deinit(&ctx);
+        return;
+}
+
+void
+trace_timeline(void)
+{
+        static const enum imsm_trace_kind expected[] = {
+                IMSM_TRACE_STAGE_IN,
+                IMSM_TRACE_WAKE_OUT,
+                IMSM_TRACE_NOTIFY,
+                IMSM_TRACE_WAKE_OUT,
+                IMSM_TRACE_PUT,
+        };
+        struct imsm_ctx ctx = {
+                &echo.imsm,
+        };
+        struct imsm_trace_transition *transitions;
+        struct echo_state **in, **out;
+        struct echo_state *state;
+        struct imsm_ref ref;
+        size_t n, found = 0;
+
+        imsm_trace_enable(64);
+        IMSM_CTX_PTR(&ctx);
+        in = IMSM_LIST_GET(struct echo_state, 1);
+        state = IMSM_GET(&echo);
+        imsm_list_push(in, state, 0);
+        ref = IMSM_REFER(state);
+
+        for (size_t rep = 0; rep < 2; rep++) {
+                if (rep > 0) {
+                        imsm_notify(ref);
+                        in = NULL;
+                }
+
+                out = IMSM_STAGE("trace", in, 0);
+                assert(imsm_list_size(out) == 1);
+                ctx.position = (struct imsm_ppoint_record) { 0 };
+        }
+
+        IMSM_PUT(&echo, state);
+        assert(imsm_trace_print_timelines(stdout, ref) ==
+            sizeof(expected) / sizeof(expected[0]));
+
+        transitions = imsm_trace_collect(&n);
+        assert(transitions != NULL);
+        for (size_t i = 0; i < n; i++) {
+                if (transitions[i].ref != ref.bits)
+                        continue;
+
+                assert(transitions[i].kind == expected[found]);
+                found++;
+        }
+
+        assert(found == sizeof(expected) / sizeof(expected[0]));
+        free(transitions);
+
+        /* Once the ring wraps around, we only keep the latest events. */
+        for (size_t i = 0; i < 100; i++)
+                IMSM_PUT(&echo, IMSM_GET(&echo));
+
+        transitions = imsm_trace_collect(&n);
+        assert(transitions != NULL && n <= 64);
+        for (size_t i = 0; i < n; i++)
+                assert(transitions[i].ref != ref.bits &&
+                    "old events must be overwritten");
+        free(transitions);
+
+        imsm_trace_disable();
+        imsm_ctx_deinit(&ctx);
+        return;
+}
+
+static void
+echo_state_format(FILE *out, const void *vstate)
+{
+        const struct echo_state *state = vstate;
+
+        fprintf(out, "in_count %zu", state->in_count);
+        return;
+}
+
+void
+state_snapshot(void)
+{
+        struct imsm_ctx ctx = {
+                &echo.imsm,
+        };
+        struct imsm_state_info infos[16];
+        struct echo_state *states[3];
+        struct echo_state **in;
+        size_t cursor = 0, n = 0, found = 0;
+        char *dump;
+        size_t dump_size;
+        FILE *stream;
+
+        IMSM_CTX_PTR(&ctx);
+        in = IMSM_LIST_GET(struct echo_state, 3);
+        for (size_t i = 0; i < 3; i++) {
+                states[i] = IMSM_GET(&echo);
+                states[i]->in_count = 4242 + i;
+                /* Leave the last state out of any queue. */
+                if (i < 2)
+                        imsm_list_push(in, states[i], 0);
+        }
+
+        (void)IMSM_STAGE("snapshot", in, 0);
+        ctx.position = (struct imsm_ppoint_record) { 0 };
+
+        /* Snapshot in small chunks, like the dumper does for big arenas. */
+        while (cursor < echo.imsm.slab.element_count) {
+                n = imsm_snapshot(&echo.imsm, &cursor, infos, 2);
+                for (size_t i = 0; i < n; i++) {
+                        for (size_t j = 0; j < 3; j++) {
+                                if (infos[i].state != states[j])
+                                        continue;
+
+                                found++;
+                                assert(infos[i].ref.bits ==
+                                    IMSM_REFER(states[j]).bits);
+                                if (j == 2) {
+                                        assert(infos[i].queue_id == UINT16_MAX);
+                                        assert(infos[i].ppoint == NULL);
+                                } else {
+                                        assert(infos[i].ppoint != NULL);
+                                        assert(strcmp(infos[i].ppoint->name,
+                                            "snapshot") == 0);
+                                }
+                        }
+                }
+        }
+
+        assert(found == 3);
+
+        imsm_set_formatter(&echo.imsm, echo_state_format);
+        stream = open_memstream(&dump, &dump_size);
+        assert(stream != NULL);
+        imsm_dump(stream, 0);
+        fclose(stream);
+        printf("state_snapshot: dump of %zu bytes\n", dump_size);
+        assert(strstr(dump, "snapshot") != NULL);
+        assert(strstr(dump, "in_count 4242") != NULL);
+        assert(strstr(dump, "in_count 4244") != NULL);
+        free(dump);
+        imsm_set_formatter(&echo.imsm, NULL);
+
+        for (size_t i = 0; i < 3; i++)
+                IMSM_PUT(&echo, states[i]);
+        imsm_ctx_deinit(&ctx);
+        return;
+}
+
+void
+stage_sojourn(void)
+{
+        struct imsm_ctx ctx = {
+                &echo.imsm,
+        };
+        const struct imsm_sojourn_queue *queue = NULL;
+        struct echo_state **in, **out;
+        struct echo_state *state;
+        struct imsm_ref ref;
+
+        ctx.sojourn = imsm_sojourn_create(&ctx);
+        assert(ctx.sojourn != NULL);
+
+        IMSM_CTX_PTR(&ctx);
+        in = IMSM_LIST_GET(struct echo_state, 1);
+        state = IMSM_GET(&echo);
+        imsm_list_push(in, state, 0);
+        ref = IMSM_REFER(state);
+
+        /*
+         * Wait 2 ms for the wake-up, then 1 ms for the dispatch, on
+         * top of the immediate wake-up when we stage in.
+         */
+        for (size_t rep = 0; rep < 2; rep++) {
+                if (rep > 0) {
+                        usleep(2000);
+                        imsm_notify(ref);
+                        usleep(1000);
+                        in = NULL;
+                }
+
+                out = IMSM_STAGE("sojourn", in, 0);
+                assert(imsm_list_size(out) == 1);
+                ctx.position = (struct imsm_ppoint_record) { 0 };
+        }
+
+        for (size_t i = 0; i < IMSM_MAX_QUEUES && queue == NULL; i++) {
+                if (ctx.sojourn->queues[i] != NULL)
+                        queue = ctx.sojourn->queues[i];
+        }
+
+        assert(queue != NULL);
+        imsm_sojourn_print(stdout, &echo.imsm);
+        assert(strcmp(queue->ppoint->name, "sojourn") == 0);
+        assert(queue->event_wait.count == 2);
+        assert(queue->event_wait.min < 1000 * 1000);
+        assert(queue->event_wait.max >= 2 * 1000 * 1000);
+        assert(queue->poll_wait.max >= 1000 * 1000);
+
+        IMSM_PUT(&echo, state);
+        ctx.sojourn = NULL;
+        imsm_ctx_deinit(&ctx);
+        return;
+}
+
+/*
+ * Arms timers at every level of the wheel, and checks that each one
+ * fires on the first tick at or after its deadline, as we advance a
+ * synthetic clock in increasingly large steps.  Each round starts
+ * where the last one stopped, i.e., 2^36 + 7 ticks later, so that
+ * deadlines fall at different offsets in their slots.
+ */
+void
+timer_wheel(void)
+{
+        static const uint64_t delays[] = {
+                0, 1, 2, 62, 63, 64, 65, 127, 128, 4095, 4096, 4097,
+                262143, 262144, 1000000, 1ULL << 36, (1ULL << 36) + 5,
+        };
+        static const uint64_t steps[] = {
+                0, 1, 2, 3, 60, 63, 64, 65, 66, 129, 4000, 4098, 5000,
+                300000, 1000001, (1ULL << 36) + 1, (1ULL << 36) + 7,
+        };
+        static struct echo_imsm timer_echo;
+        static struct echo_state buf[32];
+        const size_t n = sizeof(delays) / sizeof(delays[0]);
+        struct imsm_ctx ctx = {
+                .imsm = &timer_echo.imsm,
+        };
+        struct echo_state *states[sizeof(delays) / sizeof(delays[0]) + 1];
+        struct imsm_timer_wheel *wheel;
+        IMSM_CTX_PTR(&ctx);
+
+        IMSM_INIT(&timer_echo, header, buf, sizeof(buf),
+                  NULL, NULL, echo_poll);
+        wheel = imsm_timer_wheel(&timer_echo.imsm);
+
+        for (size_t round = 0; round < 64; round++) {
+                const uint64_t base = wheel->now;
+
+                imsm_timer_lock(wheel);
+                for (size_t i = 0; i <= n; i++) {
+                        states[i] = IMSM_GET(&timer_echo);
+                        assert(states[i] != NULL);
+                        states[i]->header.queue_id = 7;
+                        /* Just past the tick, to exercise rounding up. */
+                        imsm_timer_arm_locked(wheel, states[i] - buf,
+                            states[i]->header.version, 7,
+                            ((base + delays[i % n]) <<
+                                IMSM_TIMER_TICK_SHIFT) + 1);
+                }
+                imsm_timer_unlock(wheel);
+
+                /* The last state's timer would fire with the first one. */
+                assert(IMSM_CANCEL_TIMEOUT(states[n]));
+                assert(!IMSM_CANCEL_TIMEOUT(states[n]));
+
+                for (size_t j = 0; j < sizeof(steps) / sizeof(steps[0]); j++) {
+                        const uint64_t now = base + steps[j];
+
+                        imsm_timer_advance(&timer_echo.imsm,
+                            now << IMSM_TIMER_TICK_SHIFT);
+                        for (size_t i = 0; i < n; i++) {
+                                const struct imsm_timer *timer =
+                                    &wheel->timers[IMSM_TIMER_ID(
+                                        states[i] - buf,
+                                        IMSM_TIMER_DEADLINE)];
+                                const bool due = (base + delays[i] + 1 <= now);
+
+                                assert(timer->expired == due &&
+                                    "Timers fire on the first tick past their deadline.");
+                                assert((timer->slot == 0) == due);
+                        }
+                }
+
+                assert(wheel->num_armed == 0);
+                for (size_t i = 0; i <= n; i++) {
+                        assert(imsm_timer_consume_expired(wheel,
+                            states[i] - buf) == (i < n));
+                        IMSM_PUT(&timer_echo, states[i]);
+                }
+        }
+
+        imsm_ctx_deinit(&ctx);
+        return;
+}
+
+/*
+ * Arms more timers for the same tick than we notify in one batch, and
+ * checks that a single advance fires all of them.
+ */
+void
+timer_wheel_burst(void)
+{
+        static struct echo_imsm burst_echo;
+        static struct echo_state buf[200];
+        struct imsm_ctx ctx = {
+                .imsm = &burst_echo.imsm,
+        };
+        struct echo_state *states[150];
+        struct imsm_timer_wheel *wheel;
+        uint64_t deadline;
+        size_t fired;
+        IMSM_CTX_PTR(&ctx);
+
+        IMSM_INIT(&burst_echo, header, buf, sizeof(buf),
+                  NULL, NULL, echo_poll);
+        wheel = imsm_timer_wheel(&burst_echo.imsm);
+        deadline = (wheel->now + 3) << IMSM_TIMER_TICK_SHIFT;
+
+        imsm_timer_lock(wheel);
+        for (size_t i = 0; i < 150; i++) {
+                states[i] = IMSM_GET(&burst_echo);
+                assert(states[i] != NULL);
+                states[i]->header.queue_id = 7;
+                imsm_timer_arm_locked(wheel, states[i] - buf,
+                    states[i]->header.version, 7, deadline);
+        }
+        imsm_timer_unlock(wheel);
+
+        fired = imsm_timer_advance(&burst_echo.imsm, deadline);
+        assert(fired == 150 && wheel->num_armed == 0);
+        for (size_t i = 0; i < 150; i++) {
+                assert(imsm_timer_consume_expired(wheel, states[i] - buf));
+                IMSM_PUT(&burst_echo, states[i]);
+        }
+
+        printf("timer_wheel_burst: %zu fired\n", fired);
+        imsm_ctx_deinit(&ctx);
+        return;
+}
+
+/*
+ * Stages three states with a 100 ms timeout: one is woken up and
+ * freed, one has its timeout cancelled, and the last one times out.
+ * The timeout leaves room for scheduling hiccups between the first
+ * two passes: otherwise, `woken` might time out too.
+ */
+void
+stage_timeout(void)
+{
+        struct imsm_ctx ctx = {
+                &echo.imsm,
+        };
+        struct echo_state **in, **out, **timed_out;
+        struct echo_state *woken, *cancelled, *idle;
+        size_t num_timed_out = 0;
+        IMSM_CTX_PTR(&ctx);
+
+        in = IMSM_LIST_GET(struct echo_state, 3);
+        woken = IMSM_GET(&echo);
+        cancelled = IMSM_GET(&echo);
+        idle = IMSM_GET(&echo);
+        imsm_list_push(in, woken, 0);
+        imsm_list_push(in, cancelled, 0);
+        imsm_list_push(in, idle, 0);
+
+        for (size_t rep = 0; rep < 1000 && num_timed_out == 0; rep++) {
+                if (rep == 1) {
+                        assert(IMSM_CANCEL_TIMEOUT(cancelled));
+                        imsm_notify(IMSM_REFER(woken));
+                }
+
+                out = IMSM_STAGE_TIMEOUT("timeout", in, 0, 100 * 1000 * 1000,
+                    &timed_out);
+                in = NULL;
+                /* Staging in wakes everything up, then only `woken`. */
+                if (rep == 0) {
+                        assert(imsm_list_size(out) == 3);
+                } else if (rep == 1) {
+                        assert(imsm_list_size(out) == 1 && out[0] == woken);
+                        IMSM_PUT(&echo, woken);
+                } else {
+                        assert(imsm_list_size(out) == 0);
+                }
+
+                imsm_list_foreach(current, timed_out)
+                        assert(current == idle);
+                num_timed_out = imsm_list_size(timed_out);
+                /* Keep the queue id, but recycle lists. */
+                imsm_list_cache_recycle(&ctx.cache);
+                ctx.position = (struct imsm_ppoint_record) { 0 };
+                usleep(1000);
+        }
+
+        printf("stage_timeout: %zu timed out\n", num_timed_out);
+        assert(num_timed_out == 1);
+        assert(idle->header.queue_id == UINT16_MAX);
+        assert(cancelled->header.queue_id != UINT16_MAX);
+
+        IMSM_PUT(&echo, cancelled);
+        IMSM_PUT(&echo, idle);
+        imsm_ctx_deinit(&ctx);
+        return;
+}
+
+/*
+ * Backs a state off repeatedly in the same queue, and checks that
+ * each delay is in range, that the stage only returns the state once
+ * its delay has elapsed, and that moving to another queue resets the
+ * attempt counter.
+ */
+void
+stage_backoff(void)
+{
+        static const uint64_t base_ns = 2 * 1000 * 1000;
+        static const uint64_t max_ns = 8 * 1000 * 1000;
+        struct imsm_ctx ctx = {
+                &echo.imsm,
+        };
+        struct echo_state *state;
+        uint64_t delay = 0, begin = 0;
+        IMSM_CTX_PTR(&ctx);
+
+        state = IMSM_GET(&echo);
+        for (size_t attempt = 0; attempt < 6; attempt++) {
+                /* The last attempt moves to the second queue. */
+                const bool moved = (attempt == 5);
+                struct echo_state **in = NULL, **out;
+                uint64_t expected, elapsed;
+                struct timespec now;
+
+                if (attempt == 0 || moved) {
+                        in = IMSM_LIST_GET(struct echo_state, 1);
+                        imsm_list_push(in, state, 0);
+                }
+
+                for (;;) {
+                        /* Queue ids are positional: stage in both. */
+                        ctx.position = (struct imsm_ppoint_record) { 0 };
+                        out = IMSM_STAGE("backoff", moved ? NULL : in, 0);
+                        if (moved)
+                                out = IMSM_STAGE("backoff_moved", in, 0);
+                        in = NULL;
+                        imsm_list_cache_recycle(&ctx.cache);
+
+                        clock_gettime(CLOCK_MONOTONIC, &now);
+                        elapsed = now.tv_sec * 1000 * 1000 * 1000ULL +
+                            now.tv_nsec - begin;
+                        if (imsm_list_size(out) > 0)
+                                break;
+
+                        assert(attempt > 0 &&
+                            elapsed < 1000 * 1000 * 1000ULL &&
+                            "Backed off states wake up.");
+                }
+
+                assert(imsm_list_size(out) == 1 && out[0] == state);
+                if (attempt > 0 && !moved)
+                        assert(elapsed >= delay &&
+                            "Back-offs never end early.");
+
+                expected = moved ? base_ns : base_ns << attempt;
+                if (expected > max_ns)
+                        expected = max_ns;
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                begin = now.tv_sec * 1000 * 1000 * 1000ULL + now.tv_nsec;
+                delay = IMSM_BACKOFF(state, base_ns, max_ns);
+                assert(delay >= expected / 2 && delay <= expected &&
+                    "Back-off delays are in [d / 2, d].");
+        }
+
+        IMSM_BACKOFF_RESET(state);
+        IMSM_PUT(&echo, state);
+        imsm_ctx_deinit(&ctx);
+        return;
+}
+
+/*
+ * Parks three states in a queue, wakes one up, and cancels the other
+ * two.  The woken state stays in the queue until we drain it.
+ */
+void
+queue_drain(void)
+{
+        static struct echo_imsm drain_echo;
+        static struct echo_state buf[8];
+        struct imsm_ctx ctx = {
+                &drain_echo.imsm,
+        };
+        struct echo_state **in, **out;
+        struct echo_state *states[3];
+        IMSM_CTX_PTR(&ctx);
+
+        IMSM_INIT(&drain_echo, header, buf, sizeof(buf),
+                  NULL, NULL, echo_poll);
+
+        in = IMSM_LIST_GET(struct echo_state, 3);
+        for (size_t i = 0; i < 3; i++) {
+                states[i] = IMSM_GET(&drain_echo);
+                imsm_list_push(in, states[i], 0);
+        }
+
+        out = IMSM_STAGE("drain", in, 0);
+        assert(imsm_list_size(out) == 3);
+        in = NULL;
+
+        /* Cancel in place of the stage, to get the same queue. */
+        ctx.position = (struct imsm_ppoint_record) { 0 };
+        imsm_notify(IMSM_REFER(states[0]));
+        out = IMSM_QUEUE_CANCEL(&drain_echo, "drain");
+        assert(imsm_list_size(out) == 2);
+        imsm_list_foreach(current, out) {
+                assert(current != states[0] && "Woken states stay.");
+                assert(current->header.queue_id == UINT16_MAX);
+        }
+
+        ctx.position = (struct imsm_ppoint_record) { 0 };
+        imsm_notify(IMSM_REFER(states[1]));
+        out = IMSM_STAGE("drain", in, 0);
+        assert(imsm_list_size(out) == 1 && out[0] == states[0]);
+
+        ctx.position = (struct imsm_ppoint_record) { 0 };
+        out = IMSM_QUEUE_DRAIN(&drain_echo, "drain");
+        assert(imsm_list_size(out) == 1 && out[0] == states[0]);
+        assert(states[0]->header.queue_id == UINT16_MAX);
+
+        ctx.position = (struct imsm_ppoint_record) { 0 };
+        imsm_notify(IMSM_REFER(states[0]));
+        out = IMSM_STAGE("drain", in, 0);
+        assert(imsm_list_size(out) == 0 && "Drained states left the queue.");
+
+        for (size_t i = 0; i < 3; i++)
+                IMSM_PUT(&drain_echo, states[i]);
+        imsm_ctx_deinit(&ctx);
+        return;
+}
+
+/*
+ * Stages states in a queue that dispatches at most two wake-ups per
+ * call, and is full with three states waiting.
+ */
+void
+stage_limits(void)
+{
+        static struct echo_imsm limits_echo;
+        static struct echo_state buf[8];
+        struct imsm_stage_limits limits = {
+                .max_batch = 2,
+                .max_depth = 3,
+        };
+        struct imsm_ctx ctx = {
+                &limits_echo.imsm,
+        };
+        struct echo_state **in, **out;
+        struct echo_state *states[5];
+        uint32_t change_count;
+        IMSM_CTX_PTR(&ctx);
+
+        IMSM_INIT(&limits_echo, header, buf, sizeof(buf),
+                  NULL, NULL, echo_poll);
+        for (size_t i = 0; i < 5; i++)
+                states[i] = IMSM_GET(&limits_echo);
+
+        in = IMSM_LIST_GET(struct echo_state, 2);
+        imsm_list_push(in, states[0], 0);
+        imsm_list_push(in, states[1], 0);
+        out = IMSM_STAGE_LIMITED("limited", in, 0, &limits);
+        assert(imsm_list_size(out) == 2);
+        assert(!limits.full);
+
+        /* Make sure the first two states are older. */
+        usleep(1000);
+        ctx.position = (struct imsm_ppoint_record) { 0 };
+        in = IMSM_LIST_GET(struct echo_state, 3);
+        for (size_t i = 2; i < 5; i++)
+                imsm_list_push(in, states[i], 0);
+        change_count = limits_echo.imsm.change_count;
+        out = IMSM_STAGE_LIMITED("limited", in, 0, &limits);
+        assert(imsm_list_size(out) == 2 && "Batches are capped.");
+        assert(limits_echo.imsm.change_count != change_count &&
+            "Leftover wake-ups trigger another poll.");
+        assert(limits.full);
+
+        /* The older state goes first, then the leftover. */
+        ctx.position = (struct imsm_ppoint_record) { 0 };
+        imsm_notify(IMSM_REFER(states[0]));
+        in = NULL;
+        out = IMSM_STAGE_LIMITED("limited", in, 0, &limits);
+        assert(imsm_list_size(out) == 2);
+        assert(out[0] == states[0] && "Oldest states go first.");
+        assert(out[1] != states[0] && out[1] != states[1]);
+
+        ctx.position = (struct imsm_ppoint_record) { 0 };
+        out = IMSM_STAGE_LIMITED("limited", in, 0, &limits);
+        assert(imsm_list_size(out) == 0);
+        assert(limits.full);
+
+        ctx.position = (struct imsm_ppoint_record) { 0 };
+        out = IMSM_QUEUE_DRAIN(&limits_echo, "limited");
+        assert(imsm_list_size(out) == 5);
+        IMSM_PUT_N(&limits_echo, out, imsm_list_size(out));
+        imsm_ctx_deinit(&ctx);
+        return;
+}
+
+void
+stage_workload(void)
+{
+        struct imsm_ctx io_ctx = {
+                .imsm = &echo.imsm,
+                .workload_mask = IMSM_WORKLOAD_MASK(IMSM_WORKLOAD_IO),
+        };
+        struct imsm_ctx cpu_ctx = {
+                .imsm = &echo.imsm,
+                .workload_mask = IMSM_WORKLOAD_MASK(IMSM_WORKLOAD_CPU),
+        };
+        struct echo_state **in, **out;
+
+        for (size_t rep = 0; rep < 2; rep++) {
+                struct imsm_ctx *ctx = (rep == 0) ? &io_ctx : &cpu_ctx;
+                IMSM_CTX_PTR(ctx);
+
+                in = NULL;
+                if (rep == 0) {
+                        in = IMSM_LIST_GET(struct echo_state, 1);
+                        imsm_list_push(in, IMSM_GET(&echo), 0);
+                }
+
+                /* The IO context only passes `in` through. */
+                out = IMSM_STAGE_WORKLOAD(IMSM_WORKLOAD_CPU,
+                    "compute", in, 0);
+                printf("stage_workload: %zu %zu\n", rep,
+                    imsm_list_size(out));
+                assert(imsm_list_size(out) == rep);
+                ctx->position = (struct imsm_ppoint_record) { 0 };
+        }
+
+        imsm_ctx_deinit(&io_ctx);
+        imsm_ctx_deinit(&cpu_ctx);
+        return;
+}
+
+void
+stage_ranges(void)
+{
+        static IMSM(, struct echo_state) range_echo;
+        static struct echo_state buf[4 * IMSM_SCAN_RANGE];
+        struct imsm_ctx ctxs[2] = {
+                {
+                        .imsm = &range_echo.imsm,
+                        .worker_index = 0,
+                        .worker_count = 2,
+                },
+                {
+                        .imsm = &range_echo.imsm,
+                        .worker_index = 1,
+                        .worker_count = 2,
+                },
+        };
+        struct echo_state **in, **out;
+
+        IMSM_INIT(&range_echo, header, buf, sizeof(buf),
+                  NULL, NULL, echo_poll);
+        for (size_t i = 0; i < 2; i++) {
+                struct imsm_ctx *ctx = &ctxs[1 - i];
+                IMSM_CTX_PTR(ctx);
+
+                in = NULL;
+                if (i == 0) {
+                        struct echo_state *state;
+
+                        in = IMSM_LIST_GET(struct echo_state,
+                            4 * IMSM_SCAN_RANGE);
+                        while ((state = IMSM_GET(&range_echo)) != NULL)
+                                imsm_list_push(in, state, 0);
+                }
+
+                out = IMSM_STAGE("ranges", in, 0);
+                printf("stage_ranges: %zu %zu\n", i, imsm_list_size(out));
+                if (i == 0) {
+                        /* Worker 1 of 2 starts with the second half. */
+                        assert(imsm_list_size(out) == 4 * IMSM_SCAN_RANGE);
+                        assert(out[0] == &buf[2 * IMSM_SCAN_RANGE]);
+                } else {
+                        /* Each wake-up is dispatched exactly once. */
+                        assert(imsm_list_size(out) == 0);
+                }
+
+                ctx->position = (struct imsm_ppoint_record) { 0 };
+        }
+
+        imsm_ctx_deinit(&ctxs[0]);
+        imsm_ctx_deinit(&ctxs[1]);
+        return;
+}
+
+static size_t
+region_if_active_pass(struct imsm_ctx *ctx, struct echo_state **in,
+    size_t *num_out)
+{
+        IMSM_CTX_PTR(ctx);
+        size_t ret;
+
+        ctx->position = (struct imsm_ppoint_record) { 0 };
+        *num_out = SIZE_MAX;
+        WITH_IMSM_REGION_IF_ACTIVE("idle_region", in) {
+                struct echo_state **out;
+
+                out = IMSM_STAGE("idle_stage", in, 0);
+                *num_out = imsm_list_size(out);
+        }
+
+        ret = IMSM_INDEX("after_region");
+        printf("region_if_active: %zu %zu\n", ret, *num_out);
+        return ret;
+}
+
+void
+region_if_active(void)
+{
+        struct imsm_ctx ctx = {
+                &echo.imsm,
+        };
+        struct echo_state **in;
+        struct imsm_ref ref;
+        size_t index, num_out;
+
+        IMSM_CTX_PTR(&ctx);
+
+        /* The first execution must learn the region's span. */
+        index = region_if_active_pass(&ctx, NULL, &num_out);
+        assert(num_out == 0);
+
+        /* Nothing to do: skip, but keep indices stable. */
+        assert(region_if_active_pass(&ctx, NULL, &num_out) == index);
+        assert(num_out == SIZE_MAX);
+
+        in = IMSM_LIST_GET(struct echo_state, 1);
+        imsm_list_push(in, IMSM_GET(&echo), 0);
+        ref = IMSM_REFER(in[0]);
+        assert(region_if_active_pass(&ctx, in, &num_out) == index);
+        assert(num_out == 1);
+
+        assert(region_if_active_pass(&ctx, NULL, &num_out) == index);
+        assert(num_out == SIZE_MAX);
+
+        imsm_notify(ref);
+        assert(region_if_active_pass(&ctx, NULL, &num_out) == index);
+        assert(num_out == 1);
+        return;
+}
+
+static IMSM(, struct echo_state) driver_echo;
+static size_t driver_passes;
+
+static void
+driver_poll(struct imsm_ctx *ctx)
+{
+
+        assert(ctx->imsm == &driver_echo.imsm);
+        if (__atomic_add_fetch(&driver_passes, 1, __ATOMIC_RELAXED) >= 100)
+                imsm_stop(&driver_echo.imsm);
+        /* Always find more work, or workers would skip poll passes. */
+        imsm_wake(ctx->imsm);
+        return;
+}
+
+void
+driver_run(void)
+{
+        static struct echo_state buf[16];
+        const struct imsm_driver_opts opts = {
+                .num_workers = 4,
+                .idle_policy = IMSM_IDLE_BACKOFF,
+                .spin_limit = 4,
+                .max_sleep_ns = 1000 * 1000,
+        };
+        int r;
+
+        IMSM_INIT(&driver_echo, header, buf, sizeof(buf),
+                  NULL, NULL, driver_poll);
+        r = imsm_run(&driver_echo.imsm, &opts);
+        printf("driver_run: %i %zu\n", r, driver_passes);
+        assert(r == 0);
+        assert(driver_passes >= 100);
+        return;
+}
+
+static IMSM(, struct echo_state) gated_echo;
+static size_t gated_passes;
+
+static void
+gated_poll(struct imsm_ctx *ctx)
+{
+
+        (void)ctx;
+        gated_passes++;
+        return;
+}
+
+void
+driver_poll_if_changed(void)
+{
+        static struct echo_state buf[16];
+        struct imsm_ctx ctx = {
+                .imsm = &gated_echo.imsm,
+        };
+        struct echo_state *state;
+        IMSM_CTX_PTR(&ctx);
+
+        IMSM_INIT(&gated_echo, header, buf, sizeof(buf),
+                  NULL, NULL, gated_poll);
+        assert(imsm_poll_if_changed(&ctx));
+        assert(!imsm_poll_if_changed(&ctx));
+
+        imsm_wake(&gated_echo.imsm);
+        assert(imsm_poll_if_changed(&ctx));
+        assert(!imsm_poll_if_changed(&ctx));
+
+        /* Frees may unblock allocations. */
+        state = IMSM_GET(&gated_echo);
+        assert(!imsm_poll_if_changed(&ctx));
+        IMSM_PUT(&gated_echo, state);
+        assert(imsm_poll_if_changed(&ctx));
+        assert(!imsm_poll_if_changed(&ctx));
+        assert(gated_passes == 3);
+
+        imsm_ctx_deinit(&ctx);
+        return;
+}
+
+static IMSM(, struct echo_state) shard_echo[2];
+static size_t shard_passes[2];
+
+static void
+shard_poll(struct imsm_ctx *ctx)
+{
+        size_t i = (ctx->imsm == &shard_echo[0].imsm) ? 0 : 1;
+
+        assert(ctx->imsm == &shard_echo[i].imsm);
+        if (++shard_passes[i] >= 50)
+                imsm_stop(ctx->imsm);
+        imsm_wake(ctx->imsm);
+        return;
+}
+
+void
+driver_run_sharded(void)
+{
+        static struct echo_state buf[2][16];
+        struct imsm *shards[2];
+        const struct imsm_driver_opts opts = {
+                .idle_policy = IMSM_IDLE_BUSY_POLL,
+        };
+        int r;
+
+        for (size_t i = 0; i < 2; i++) {
+                IMSM_INIT(&shard_echo[i], header, buf[i], sizeof(buf[i]),
+                          NULL, NULL, shard_poll);
+                shards[i] = &shard_echo[i].imsm;
+        }
+
+        r = imsm_run_sharded(shards, 2, &opts);
+        printf("driver_run_sharded: %i %zu %zu\n", r,
+               shard_passes[0], shard_passes[1]);
+        assert(r == 0);
+        assert(shard_passes[0] == 50 && shard_passes[1] == 50);
+        return;
+}
+
+static IMSM(, struct echo_state) mux_echo[3];
+static size_t mux_passes[3];
+
+static void
+mux_poll_fn(struct imsm_ctx *ctx)
+{
+
+        for (size_t i = 0; i < 3; i++) {
+                if (ctx->imsm == &mux_echo[i].imsm)
+                        mux_passes[i]++;
+        }
+
+        return;
+}
+
+void
+mux_poll(void)
+{
+        static struct echo_state buf[3][16];
+        struct imsm_mux *mux;
+        bool success;
+
+        mux = imsm_mux_create();
+        assert(mux != NULL);
+        for (size_t i = 0; i < 3; i++) {
+                IMSM_INIT(&mux_echo[i], header, buf[i], sizeof(buf[i]),
+                          NULL, NULL, mux_poll_fn);
+                success = imsm_mux_add(mux, &mux_echo[i].imsm);
+                assert(success);
+        }
+
+        /* Every machine is polled once after attaching... */
+        assert(imsm_mux_poll(mux, 0) == 3);
+        assert(imsm_mux_poll(mux, 0) == 0);
+
+        /* ... and then only when woken, once per batch of wake-ups. */
+        imsm_wake(&mux_echo[1].imsm);
+        imsm_wake(&mux_echo[1].imsm);
+        assert(imsm_mux_poll(mux, 0) == 1);
+        assert(imsm_mux_poll(mux, 0) == 0);
+        assert(mux_passes[0] == 1 && mux_passes[1] == 2 && mux_passes[2] == 1);
+
+        imsm_mux_remove(mux, &mux_echo[2].imsm);
+        imsm_wake(&mux_echo[2].imsm);
+        assert(imsm_mux_poll(mux, 0) == 0);
+        assert(mux_echo[2].imsm.wake_fd == -1);
+
+        imsm_mux_destroy(mux);
+        assert(mux_echo[0].imsm.wake_fd == -1);
+        printf("mux_poll: %zu %zu %zu\n",
+               mux_passes[0], mux_passes[1], mux_passes[2]);
+        return;
+}
+
+static unsigned int
+pool_classify(struct imsm_ctx *ctx, void *elem, void *arg)
+{
+        struct echo_state *state = elem;
+
+        (void)ctx;
+        (void)arg;
+        state->out_count++;
+        return state->in_count % 3;
+}
+
+void
+pool_map(void)
+{
+        static struct echo_imsm pool_echo;
+        static struct echo_state buf[1024];
+        struct imsm_ctx ctx = {
+                &pool_echo.imsm,
+        };
+        struct echo_state **in, **out[3];
+        struct imsm_pool *pool;
+
+        IMSM_CTX_PTR(&ctx);
+        IMSM_INIT(&pool_echo, header, buf, sizeof(buf),
+                  NULL, NULL, echo_poll);
+
+        pool = imsm_pool_create(&pool_echo.imsm, 3, 16);
+        assert(pool != NULL);
+
+        in = IMSM_LIST_GET(struct echo_state, 1000);
+        for (size_t i = 0; i < 1000; i++) {
+                struct echo_state *state = IMSM_GET(&pool_echo);
+
+                state->in_count = i;
+                imsm_list_push(in, state, 0);
+        }
+
+        for (size_t rep = 0; rep < 2; rep++) {
+                IMSM_POOL_MAP(pool, in, pool_classify, NULL, out);
+                printf("pool_map: %zu %zu %zu\n", imsm_list_size(out[0]),
+                    imsm_list_size(out[1]), imsm_list_size(out[2]));
+                for (size_t j = 0; j < 3; j++) {
+                        size_t expected = j;
+
+                        imsm_list_foreach(state, out[j]) {
+                                assert(state->in_count == expected);
+                                assert(state->out_count == rep + 1);
+                                expected += 3;
+                        }
+
+                        assert(expected >= 1000);
+                }
+        }
+
+        imsm_pool_destroy(pool);
+        imsm_ctx_deinit(&ctx);
+        return;
+}
+
+void
+gather_flush(void)
+{
+        struct imsm_gather gather = { 0 };
+        char buf[16] = { 0 };
+        int fds[2];
+        int r;
+
+        r = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+        assert(r == 0);
+
+        assert(imsm_gather_push(&gather, "abc", 3));
+        assert(imsm_gather_push(&gather, "", 0));
+        assert(imsm_gather_push(&gather, "de", 2));
+        assert(imsm_gather_push(&gather, "\n", 1));
+        assert(imsm_gather_pending(&gather) == 6);
+
+        /* One syscall for all the iovecs. */
+        assert(imsm_gather_flush(&gather, fds[0]) == 6);
+        assert(imsm_gather_pending(&gather) == 0);
+        assert(read(fds[1], buf, sizeof(buf)) == 6);
+        assert(memcmp(buf, "abcde\n", 6) == 0);
+
+        /* The gather compacts itself when iovecs are consumed. */
+        for (size_t i = 0; i < IMSM_GATHER_MAX_IOVECS; i++)
+                assert(imsm_gather_push(&gather, "x", 1));
+        assert(!imsm_gather_push(&gather, "x", 1));
+        assert(imsm_gather_flush(&gather, fds[0]) ==
+            IMSM_GATHER_MAX_IOVECS);
+        assert(imsm_gather_push(&gather, "y", 1));
+
+        printf("gather_flush: %zu\n", imsm_gather_pending(&gather));
+        close(fds[0]);
+        close(fds[1]);
+        return;
+}
+
+void
+buf_pool(void)
+{
+        static struct imsm_buf_pool pool;
+        struct imsm_buf_cache cache = { 0 };
+        struct imsm_buf *small, *large, *handoff;
+        uint32_t version;
+        bool success;
+
+        success = imsm_buf_pool_init(&pool, 4 * 16384);
+        assert(success);
+
+        /* Requests go to the smallest size class that fits. */
+        small = imsm_buf_get(&pool, &cache, 10);
+        assert(small != NULL && small->size_class == 0);
+        assert(small->capacity >= 10 && small->refcount == 1);
+        large = imsm_buf_get(&pool, &cache, 2000);
+        assert(large != NULL && large->size_class == 2);
+        assert(large->capacity >= 2000);
+        assert(imsm_buf_get(&pool, &cache, 1UL << 20) == NULL);
+        assert(imsm_buf_class_size(10) == 256);
+        assert(imsm_buf_class_size(512) == 1024);
+        assert(imsm_buf_class_size(1UL << 20) == 0);
+
+        /* Handing a buffer off keeps it alive until the last put. */
+        version = small->header.version;
+        handoff = imsm_buf_ref(small);
+        assert(handoff == small && small->refcount == 2);
+        imsm_buf_put(&pool, &cache, small);
+        assert(handoff->refcount == 1);
+        assert(handoff->header.version == version);
+        imsm_buf_put(&pool, &cache, handoff);
+        assert(small->header.version != version);
+        imsm_buf_put(&pool, &cache, NULL);
+
+        /* Full size classes spill over to larger ones. */
+        for (size_t i = 0; i < 4 * 16384 / 256; i++) {
+                struct imsm_buf *buf;
+
+                buf = imsm_buf_get(&pool, &cache, 10);
+                assert(buf != NULL && buf->size_class == 0);
+        }
+
+        small = imsm_buf_get(&pool, &cache, 10);
+        assert(small != NULL && small->size_class == 1);
+
+        imsm_buf_put(&pool, &cache, large);
+        imsm_buf_cache_flush(&pool, &cache);
+        printf("buf_pool: %u %u\n", small->capacity, large->capacity);
+        return;
+}
+
+/*
+ * Size classes with buffers larger than the pool's bytes per class
+ * are left empty, and don't fail the pool's initialization.
+ */
+void
+buf_pool_empty_classes(void)
+{
+        static struct imsm_buf_pool pool;
+        struct imsm_buf_cache cache = { 0 };
+        struct imsm_buf *buf;
+        bool success;
+
+        success = imsm_buf_pool_init(&pool, 8192);
+        assert(success);
+        assert(pool.classes[IMSM_BUF_NUM_CLASSES - 1].element_count == 0);
+        assert(imsm_buf_get(&pool, &cache, 10000) == NULL);
+
+        buf = imsm_buf_get(&pool, &cache, 2000);
+        assert(buf != NULL && buf->size_class == 2);
+        imsm_buf_put(&pool, &cache, buf);
+        imsm_buf_cache_flush(&pool, &cache);
+        printf("buf_pool_empty_classes: %u\n", buf->capacity);
+        return;
+}
+
+void
+hist_quantiles(void)
+{
+        static struct imsm_hist hist, merged;
+
+        assert(imsm_hist_quantile(&hist, 0.5) == 0);
+
+        /* Small values are exact. */
+        for (uint64_t i = 1; i <= 10; i++)
+                imsm_hist_record(&hist, i);
+        assert(hist.count == 10 && hist.min == 1 && hist.max == 10);
+        assert(imsm_hist_quantile(&hist, 0.5) == 5);
+        assert(imsm_hist_quantile(&hist, 0.9) == 9);
+        assert(imsm_hist_quantile(&hist, 1) == 10);
+        assert(imsm_hist_mean(&hist) == 5.5);
+
+        /* Larger ones are within ~3%, and extremes are exact. */
+        imsm_hist_reset(&hist);
+        for (uint64_t i = 1; i <= 100000; i++)
+                imsm_hist_record(&hist, 1000 * i);
+        for (size_t i = 0; i < 4; i++) {
+                static const double quantiles[] = { 0.5, 0.9, 0.99, 0.9999 };
+                double expected = quantiles[i] * 1e8;
+                double actual = imsm_hist_quantile(&hist, quantiles[i]);
+
+                assert(actual >= expected && actual <= 1.04 * expected);
+        }
+
+        assert(imsm_hist_quantile(&hist, 0) == 1000);
+        assert(imsm_hist_quantile(&hist, 1) == 100000000);
+
+        imsm_hist_record(&merged, UINT64_MAX);
+        imsm_hist_merge(&merged, &hist);
+        assert(merged.count == 100001 && merged.min == 1000);
+        assert(imsm_hist_quantile(&merged, 1) == UINT64_MAX);
+        printf("hist_quantiles: %llu\n",
+            (unsigned long long)imsm_hist_quantile(&merged, 0.5));
+        return;
+}
+
 void
 codec_ref(void)
 {
@@ -235,8 +1575,33 @@ main()
         slab_get_put();
         slab_get_put_tight();
         slab_get_empty();
+        slab_ctx_flush();
+        slab_get_n();
         ppoint();
         stage_io();
+        stage_notify_n();
+        stage_stats();
+        trace_timeline();
+        state_snapshot();
+        stage_sojourn();
+        timer_wheel();
+        timer_wheel_burst();
+        stage_timeout();
+        stage_backoff();
+        queue_drain();
+        stage_limits();
+        stage_workload();
+        stage_ranges();
+        region_if_active();
         codec_ref();
+        gather_flush();
+        buf_pool();
+        buf_pool_empty_classes();
+        hist_quantiles();
+        pool_map();
+        driver_poll_if_changed();
+        driver_run();
+        driver_run_sharded();
+        mux_poll();
         return 0;
 }
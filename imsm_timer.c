@@ -0,0 +1,501 @@
+#include "imsm_timer.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "imsm.h"
+
+#define TICK_NS (1ULL << IMSM_TIMER_TICK_SHIFT)
+
+/* Timers more than this many ticks away wait in the top level. */
+#define WHEEL_SPAN (1ULL << (IMSM_TIMER_SLOT_BITS * IMSM_TIMER_LEVELS))
+
+/*
+ * We notify fired timers in batches of up to FIRE_BATCH, after
+ * releasing the wheel's lock.
+ */
+#define FIRE_BATCH 64
+
+static uint64_t
+monotonic_ns(void)
+{
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return now.tv_sec * 1000 * 1000 * 1000ULL + now.tv_nsec;
+}
+
+/*
+ * splitmix64's finaliser: good enough to jitter back-offs.
+ */
+static uint64_t
+mix64(uint64_t x)
+{
+
+        x ^= x >> 30;
+        x *= 0xbf58476d1ce4e5b9ULL;
+        x ^= x >> 27;
+        x *= 0x94d049bb133111ebULL;
+        x ^= x >> 31;
+        return x;
+}
+
+static inline void
+spin_pause(void)
+{
+
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+        return;
+}
+
+struct imsm_timer_wheel *
+imsm_timer_wheel(struct imsm *imsm)
+{
+        const size_t count = imsm->slab.element_count;
+        struct imsm_timer_wheel *expected = NULL;
+        struct imsm_timer_wheel *wheel;
+
+        wheel = __atomic_load_n(&imsm->timers, __ATOMIC_ACQUIRE);
+        if (wheel != NULL)
+                return wheel;
+
+        assert(count < UINT32_MAX / IMSM_TIMER_KINDS &&
+            "Too many entries for timers.");
+        wheel = calloc(1, sizeof(*wheel) +
+            count * IMSM_TIMER_KINDS * sizeof(wheel->timers[0]));
+        assert(wheel != NULL && "Static allocation failed.");
+        wheel->now = monotonic_ns() >> IMSM_TIMER_TICK_SHIFT;
+        wheel->count = count;
+
+        /* Workers may race to create the wheel: one wins. */
+        if (!__atomic_compare_exchange_n(&imsm->timers, &expected, wheel,
+            false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                free(wheel);
+                wheel = expected;
+        }
+
+        return wheel;
+}
+
+void
+imsm_timer_lock(struct imsm_timer_wheel *wheel)
+{
+
+        while (__atomic_exchange_n(&wheel->lock, 1, __ATOMIC_ACQUIRE) != 0) {
+                while (__atomic_load_n(&wheel->lock, __ATOMIC_RELAXED) != 0)
+                        spin_pause();
+        }
+
+        return;
+}
+
+void
+imsm_timer_unlock(struct imsm_timer_wheel *wheel)
+{
+
+        __atomic_store_n(&wheel->lock, 0, __ATOMIC_RELEASE);
+        return;
+}
+
+/*
+ * Removes timer `id` from its slot, if it's armed.
+ */
+static void
+timer_unlink(struct imsm_timer_wheel *wheel, size_t id)
+{
+        struct imsm_timer *timer = &wheel->timers[id];
+        size_t level, slot;
+
+        if (timer->slot == 0)
+                return;
+
+        level = (timer->slot - 1) / IMSM_TIMER_SLOTS;
+        slot = (timer->slot - 1) % IMSM_TIMER_SLOTS;
+        if (timer->prev != 0)
+                wheel->timers[timer->prev - 1].next = timer->next;
+        else
+                wheel->heads[level][slot] = timer->next;
+
+        if (timer->next != 0)
+                wheel->timers[timer->next - 1].prev = timer->prev;
+
+        if (wheel->heads[level][slot] == 0)
+                wheel->occupied[level] &= ~(1ULL << slot);
+
+        timer->next = timer->prev = 0;
+        timer->slot = 0;
+        wheel->num_armed--;
+        return;
+}
+
+/*
+ * Adds timer `id` to the slot for its deadline, given that
+ * we have processed every tick up to `base`.
+ *
+ * A level `l` slot spans 2^(6 l) ticks, and the level 2^(6 (l + 1)).
+ * We use the lowest level that spans the deadline's distance from
+ * `base`: at level `l` > 0, that distance is more than a slot, so
+ * the slot's span begins after `base`, and we'll cascade its timers
+ * before they're due, to a distance of at most one slot from the
+ * tick before the cascade.
+ */
+static void
+timer_link(struct imsm_timer_wheel *wheel, size_t id, uint64_t base)
+{
+        struct imsm_timer *timer = &wheel->timers[id];
+        uint64_t deadline = timer->deadline;
+        size_t level = 0, slot;
+
+        /* Overdue timers fire on the next tick. */
+        if (deadline <= base)
+                deadline = base + 1;
+
+        /* Far deadlines wait in the top level, and cascade back there. */
+        if (deadline - base > WHEEL_SPAN)
+                deadline = base + WHEEL_SPAN;
+
+        while (deadline - base >
+            (1ULL << (IMSM_TIMER_SLOT_BITS * (level + 1))))
+                level++;
+
+        slot = (deadline >> (IMSM_TIMER_SLOT_BITS * level)) % IMSM_TIMER_SLOTS;
+        timer->slot = 1 + level * IMSM_TIMER_SLOTS + slot;
+        timer->prev = 0;
+        timer->next = wheel->heads[level][slot];
+        if (timer->next != 0)
+                wheel->timers[timer->next - 1].prev = id + 1;
+
+        wheel->heads[level][slot] = id + 1;
+        wheel->occupied[level] |= 1ULL << slot;
+        wheel->num_armed++;
+        return;
+}
+
+/*
+ * Detaches the list of timers in `slot` of `level`, and returns
+ * 1 + the id of its first timer, or 0 if it's empty.
+ */
+static uint32_t
+slot_detach(struct imsm_timer_wheel *wheel, size_t level, size_t slot)
+{
+        uint32_t ret = wheel->heads[level][slot];
+
+        wheel->heads[level][slot] = 0;
+        wheel->occupied[level] &= ~(1ULL << slot);
+        for (uint32_t i = ret; i != 0; i = wheel->timers[i - 1].next) {
+                wheel->timers[i - 1].slot = 0;
+                wheel->num_armed--;
+        }
+
+        return ret;
+}
+
+/*
+ * Returns the first tick after `wheel->now` at which we must expire
+ * or cascade a slot, or UINT64_MAX if the wheel is empty.
+ */
+static uint64_t
+wheel_next_tick(const struct imsm_timer_wheel *wheel)
+{
+        uint64_t ret = UINT64_MAX;
+
+        for (size_t level = 0; level < IMSM_TIMER_LEVELS; level++) {
+                const unsigned int shift = IMSM_TIMER_SLOT_BITS * level;
+                const uint64_t unit = (wheel->now >> shift) + 1;
+                const unsigned int rotate = unit % IMSM_TIMER_SLOTS;
+                uint64_t occupied = wheel->occupied[level];
+                uint64_t tick;
+
+                if (occupied == 0)
+                        continue;
+
+                /* Bit k is now the slot for `unit + k`. */
+                if (rotate != 0)
+                        occupied = (occupied >> rotate) |
+                            (occupied << (IMSM_TIMER_SLOTS - rotate));
+                tick = (unit + __builtin_ctzll(occupied)) << shift;
+                if (tick < ret)
+                        ret = tick;
+        }
+
+        return ret;
+}
+
+/*
+ * Fires timer `id`, unless its entry moved on, and adds the entry to
+ * `fired`, which must have room for it.  Retry timers are plain
+ * wake-ups; deadlines also flag the entry as expired.
+ *
+ * Returns whether the timer fired.
+ */
+static bool
+timer_fire(struct imsm *imsm, struct imsm_timer_wheel *wheel, size_t id,
+    struct imsm_ref *fired, size_t *num_fired)
+{
+        struct imsm_timer *timer = &wheel->timers[id];
+        const size_t index = id / IMSM_TIMER_KINDS;
+        struct imsm_entry *entry;
+        uint32_t version;
+
+        entry = (void *)((char *)imsm->slab.arena +
+            index * imsm->slab.element_size);
+        version = __atomic_load_n(&entry->version, __ATOMIC_RELAXED);
+        if (version != timer->version ||
+            __atomic_load_n(&entry->queue_id, __ATOMIC_RELAXED) !=
+            timer->queue_id)
+                return false;
+
+        if (id % IMSM_TIMER_KINDS == IMSM_TIMER_DEADLINE)
+                timer->expired = 1;
+        assert(*num_fired < FIRE_BATCH && "Fired timer batch overflow.");
+        fired[(*num_fired)++] = imsm_refer_index(imsm, index, version);
+        return true;
+}
+
+size_t
+imsm_timer_advance(struct imsm *imsm, uint64_t now_ns)
+{
+        const uint64_t now = now_ns >> IMSM_TIMER_TICK_SHIFT;
+        struct imsm_ref fired[FIRE_BATCH];
+        struct imsm_timer_wheel *wheel;
+        size_t num_fired = 0, ret = 0;
+
+        wheel = __atomic_load_n(&imsm->timers, __ATOMIC_ACQUIRE);
+        if (wheel == NULL ||
+            __atomic_load_n(&wheel->now, __ATOMIC_RELAXED) >= now)
+                return 0;
+
+        imsm_timer_lock(wheel);
+        for (uint64_t tick; (tick = wheel_next_tick(wheel)) <= now; ) {
+                const size_t due = tick % IMSM_TIMER_SLOTS;
+                uint32_t i;
+
+                /* Move the timers in slots that start now down... */
+                for (size_t level = IMSM_TIMER_LEVELS - 1; level > 0;
+                     level--) {
+                        const unsigned int shift = IMSM_TIMER_SLOT_BITS * level;
+
+                        if ((tick & ((1ULL << shift) - 1)) != 0)
+                                continue;
+
+                        i = slot_detach(wheel, level,
+                            (tick >> shift) % IMSM_TIMER_SLOTS);
+                        while (i != 0) {
+                                uint32_t next = wheel->timers[i - 1].next;
+
+                                timer_link(wheel, i - 1, tick - 1);
+                                i = next;
+                        }
+                }
+
+                /*
+                 * ... and fire the ones due now.  Notifying may make
+                 * syscalls, so we only do that without the lock: when
+                 * `fired` is full, leave the rest of the slot linked,
+                 * and come back to this tick once we've flushed it.
+                 * Cascading the tick again is harmless.
+                 */
+                while (num_fired < FIRE_BATCH &&
+                    (i = wheel->heads[0][due]) != 0) {
+                        timer_unlink(wheel, i - 1);
+                        ret += timer_fire(imsm, wheel, i - 1, fired,
+                            &num_fired);
+                }
+
+                if (wheel->heads[0][due] != 0) {
+                        __atomic_store_n(&wheel->now, tick - 1,
+                            __ATOMIC_RELAXED);
+                        imsm_timer_unlock(wheel);
+                        imsm_notify_n(fired, num_fired);
+                        num_fired = 0;
+                        imsm_timer_lock(wheel);
+                        continue;
+                }
+
+                __atomic_store_n(&wheel->now, tick, __ATOMIC_RELAXED);
+        }
+
+        /* Another thread may have advanced further while we notified. */
+        if (wheel->now < now)
+                __atomic_store_n(&wheel->now, now, __ATOMIC_RELAXED);
+        imsm_timer_unlock(wheel);
+        if (num_fired > 0)
+                imsm_notify_n(fired, num_fired);
+        return ret;
+}
+
+uint64_t
+imsm_timer_poll(struct imsm *imsm)
+{
+        struct imsm_timer_wheel *wheel;
+        uint64_t now, next;
+
+        wheel = __atomic_load_n(&imsm->timers, __ATOMIC_ACQUIRE);
+        if (wheel == NULL ||
+            __atomic_load_n(&wheel->num_armed, __ATOMIC_RELAXED) == 0)
+                return UINT64_MAX;
+
+        now = monotonic_ns();
+        if (imsm_timer_advance(imsm, now) > 0)
+                return 0;
+
+        imsm_timer_lock(wheel);
+        next = wheel_next_tick(wheel);
+        imsm_timer_unlock(wheel);
+        if (next == UINT64_MAX)
+                return UINT64_MAX;
+
+        next <<= IMSM_TIMER_TICK_SHIFT;
+        return (next > now) ? next - now : 0;
+}
+
+/*
+ * (Re-)arms timer `id` to fire at `deadline_ns`.
+ */
+static void
+timer_arm(struct imsm_timer_wheel *wheel, size_t id, uint64_t deadline_ns)
+{
+        struct imsm_timer *timer = &wheel->timers[id];
+
+        timer_unlink(wheel, id);
+        /* Round up: timers never fire early. */
+        timer->deadline = (deadline_ns >> IMSM_TIMER_TICK_SHIFT) +
+            ((deadline_ns & (TICK_NS - 1)) != 0);
+        timer_link(wheel, id, wheel->now);
+        return;
+}
+
+void
+imsm_timer_arm_locked(struct imsm_timer_wheel *wheel, size_t index,
+    uint32_t version, uint16_t queue_id, uint64_t deadline_ns)
+{
+        const size_t id = IMSM_TIMER_ID(index, IMSM_TIMER_DEADLINE);
+        struct imsm_timer *timer = &wheel->timers[id];
+
+        assert(index < wheel->count && "Timer index out of range.");
+        timer->version = version;
+        timer->queue_id = queue_id;
+        timer->expired = 0;
+        timer_arm(wheel, id, deadline_ns);
+        return;
+}
+
+bool
+imsm_timer_consume_expired(struct imsm_timer_wheel *wheel, size_t index)
+{
+        uint8_t *expired = &wheel->timers[IMSM_TIMER_ID(index,
+            IMSM_TIMER_DEADLINE)].expired;
+
+        if (__atomic_load_n(expired, __ATOMIC_RELAXED) == 0)
+                return false;
+
+        return __atomic_exchange_n(expired, 0, __ATOMIC_ACQUIRE) != 0;
+}
+
+static size_t
+entry_index(const struct imsm *imsm, const struct imsm_entry *entry)
+{
+
+        return ((uintptr_t)entry - (uintptr_t)imsm->slab.arena) /
+            imsm->slab.element_size;
+}
+
+bool
+imsm_timer_cancel(struct imsm_ctx *ctx, void *object)
+{
+        struct imsm *imsm = ctx->imsm;
+        struct imsm_timer_wheel *wheel;
+        struct imsm_entry *entry;
+        size_t id;
+        bool ret;
+
+        wheel = __atomic_load_n(&imsm->timers, __ATOMIC_ACQUIRE);
+        if (wheel == NULL)
+                return false;
+
+        entry = imsm_entry_of(ctx, object);
+        if (entry == NULL)
+                return false;
+
+        id = IMSM_TIMER_ID(entry_index(imsm, entry), IMSM_TIMER_DEADLINE);
+        imsm_timer_lock(wheel);
+        ret = (wheel->timers[id].slot != 0);
+        timer_unlink(wheel, id);
+        wheel->timers[id].expired = 0;
+        imsm_timer_unlock(wheel);
+        return ret;
+}
+
+uint64_t
+imsm_backoff(struct imsm_ctx *ctx, void *object, uint64_t base_ns,
+    uint64_t max_ns)
+{
+        struct imsm_timer_wheel *wheel = imsm_timer_wheel(ctx->imsm);
+        struct imsm_entry *entry;
+        struct imsm_timer *timer;
+        uint64_t now, delay;
+        uint32_t version;
+        uint16_t queue_id;
+        size_t index;
+
+        entry = imsm_entry_of(ctx, object);
+        assert(entry != NULL && "Backing off a non-imsm object.");
+        index = entry_index(ctx->imsm, entry);
+        version = __atomic_load_n(&entry->version, __ATOMIC_RELAXED);
+        queue_id = __atomic_load_n(&entry->queue_id, __ATOMIC_RELAXED);
+        assert(queue_id != UINT16_MAX && "Backing off a state without queue.");
+
+        now = monotonic_ns();
+        timer = &wheel->timers[IMSM_TIMER_ID(index, IMSM_TIMER_RETRY)];
+        imsm_timer_lock(wheel);
+        if (timer->version != version || timer->queue_id != queue_id) {
+                timer->version = version;
+                timer->queue_id = queue_id;
+                timer->attempts = 0;
+        }
+
+        delay = max_ns;
+        if (timer->attempts < 64 && base_ns <= (max_ns >> timer->attempts))
+                delay = base_ns << timer->attempts;
+        /*
+         * "Equal jitter": keep half the delay, so attempts still back
+         * off, and spread the rest to desynchronise states that failed
+         * together.
+         */
+        delay = delay / 2 +
+            mix64(now ^ ((uint64_t)index << 20) ^ timer->attempts) %
+            (delay - delay / 2 + 1);
+        if (timer->attempts < UINT32_MAX)
+                timer->attempts++;
+        timer_arm(wheel, IMSM_TIMER_ID(index, IMSM_TIMER_RETRY),
+            (now > UINT64_MAX - delay) ? UINT64_MAX : now + delay);
+        imsm_timer_unlock(wheel);
+        return delay;
+}
+
+void
+imsm_backoff_reset(struct imsm_ctx *ctx, void *object)
+{
+        struct imsm *imsm = ctx->imsm;
+        struct imsm_timer_wheel *wheel;
+        struct imsm_entry *entry;
+        size_t id;
+
+        wheel = __atomic_load_n(&imsm->timers, __ATOMIC_ACQUIRE);
+        if (wheel == NULL)
+                return;
+
+        entry = imsm_entry_of(ctx, object);
+        if (entry == NULL)
+                return;
+
+        id = IMSM_TIMER_ID(entry_index(imsm, entry), IMSM_TIMER_RETRY);
+        imsm_timer_lock(wheel);
+        timer_unlink(wheel, id);
+        wheel->timers[id].attempts = 0;
+        imsm_timer_unlock(wheel);
+        return;
+}
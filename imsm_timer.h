@@ -0,0 +1,154 @@
+#pragma once
+
+/*
+ * Per-imsm hierarchical timing wheel, for stage timeouts.
+ *
+ * `IMSM_STAGE_TIMEOUT` gives each entry it stages in a deadline.
+ * When the deadline passes while the entry is still in the stage's
+ * queue, the wheel wakes the entry up, and the stage returns it in a
+ * separate list of timed out entries, out of the queue, instead of
+ * with the regular wake-ups.
+ *
+ * Timers are threaded through a side array indexed like the arena,
+ * as intrusive doubly linked lists, so arming, re-arming and
+ * cancelling are O(1), without any allocation or syscall.  The wheel
+ * has IMSM_TIMER_LEVELS levels of IMSM_TIMER_SLOTS slots: level 0
+ * slots are one tick wide, and each slot of a higher level spans a
+ * full revolution of the level below.  Advancing the wheel expires
+ * the level 0 slot of each elapsed tick, and moves ("cascades") the
+ * timers of a higher level slot down to lower levels when its span
+ * begins; per-level occupancy bitmaps let us jump over empty ticks.
+ *
+ * Deadlines fire whether or not a worker is still handling the
+ * entry, so they require a single worker per machine (see
+ * `imsm_stage_io_timeout`).
+ *
+ * Timers never fire early, but may fire up to a tick late, plus
+ * however long it takes the stage to run again.  Timers are not
+ * cancelled when their entry leaves the stage's queue (or is freed):
+ * they just fire into the void.
+ *
+ * The same wheel also drives retries: `IMSM_BACKOFF` leaves a state
+ * parked in its current queue, and arms a second timer for its entry
+ * that merely wakes it up again after an exponentially growing,
+ * jittered, delay.
+ */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct imsm;
+struct imsm_ctx;
+
+/* Ticks are 2^20 ns, a bit over a millisecond. */
+#define IMSM_TIMER_TICK_SHIFT 20
+#define IMSM_TIMER_SLOT_BITS 6
+#define IMSM_TIMER_SLOTS (1U << IMSM_TIMER_SLOT_BITS)
+/* 6 levels cover 2^36 ticks, i.e., more than two years. */
+#define IMSM_TIMER_LEVELS 6
+
+/* Each entry has one timer of each kind. */
+enum imsm_timer_kind {
+        IMSM_TIMER_DEADLINE = 0,
+        IMSM_TIMER_RETRY,
+        IMSM_TIMER_KINDS
+};
+
+/* Index of the `KIND` timer for the `INDEX`th entry in `timers`. */
+#define IMSM_TIMER_ID(INDEX, KIND) ((INDEX) * IMSM_TIMER_KINDS + (KIND))
+
+struct imsm_timer {
+        /* Tick at which the timer fires. */
+        uint64_t deadline;
+        /* 1 + the id of the neighbours in the slot, 0 if none. */
+        uint32_t next;
+        uint32_t prev;
+        /* The entry's version and queue when the timer was armed. */
+        uint32_t version;
+        uint16_t queue_id;
+        /* 1 + level * IMSM_TIMER_SLOTS + slot, or 0 if not armed. */
+        uint16_t slot;
+        /* Set when the timer fires, cleared once its stage sees it. */
+        uint8_t expired;
+        /* Retry timers: number of back-offs in the current queue. */
+        uint32_t attempts;
+};
+
+struct imsm_timer_wheel {
+        /* Spinlock for everything in the wheel. */
+        uint32_t lock;
+        /* Last tick we processed. */
+        uint64_t now;
+        size_t num_armed;
+        /* Bitmap of non-empty slots, for each level. */
+        uint64_t occupied[IMSM_TIMER_LEVELS];
+        /* 1 + the id of the first timer in each slot. */
+        uint32_t heads[IMSM_TIMER_LEVELS][IMSM_TIMER_SLOTS];
+        /* IMSM_TIMER_KINDS timers per arena entry. */
+        size_t count;
+        struct imsm_timer timers[];
+};
+
+/*
+ * Returns `imsm`'s timing wheel, and creates it on first use.
+ */
+struct imsm_timer_wheel *imsm_timer_wheel(struct imsm *);
+
+void imsm_timer_lock(struct imsm_timer_wheel *);
+void imsm_timer_unlock(struct imsm_timer_wheel *);
+
+/*
+ * (Re-)arms the deadline timer for the `index`th arena entry, currently at
+ * version `version` in queue `queue_id`, to fire at `deadline_ns` on
+ * the monotonic clock.  The caller must hold the wheel's lock.
+ */
+void imsm_timer_arm_locked(struct imsm_timer_wheel *, size_t index,
+    uint32_t version, uint16_t queue_id, uint64_t deadline_ns);
+
+/*
+ * Returns whether the `index`th entry's timer fired since it was
+ * last armed, and clears that status.
+ */
+bool imsm_timer_consume_expired(struct imsm_timer_wheel *, size_t index);
+
+/*
+ * Disarms the deadline timer for `object`, an entry in `ctx->imsm`'s
+ * arena.
+ *
+ * Returns whether the timer was armed.
+ */
+bool imsm_timer_cancel(struct imsm_ctx *, void *object);
+
+/*
+ * Leaves `object`, an entry in `ctx->imsm`'s arena, in its current
+ * queue, and wakes it up again after a random delay in [d / 2, d],
+ * for d = min(`base_ns` << attempts, `max_ns`).  The attempt counter
+ * goes up with each call, and starts over from 0 once the state is
+ * staged in another queue, or freed.  The caller must not stage or
+ * free `object` in the meantime: it's still in the queue.
+ *
+ * Returns the delay, in nanoseconds.
+ */
+uint64_t imsm_backoff(struct imsm_ctx *, void *object, uint64_t base_ns,
+    uint64_t max_ns);
+
+/*
+ * Disarms `object`'s retry timer, and resets its attempt counter.
+ */
+void imsm_backoff_reset(struct imsm_ctx *, void *object);
+
+/*
+ * Fires all the timers of `imsm` due at `now_ns`, on the monotonic
+ * clock, with `imsm_notify`.
+ *
+ * Returns the number of entries we woke up.
+ */
+size_t imsm_timer_advance(struct imsm *, uint64_t now_ns);
+
+/*
+ * Fires all the timers of `imsm` that are due, and returns how long
+ * until the next one might fire: 0 if we just fired some, and
+ * UINT64_MAX if `imsm` has no armed timer.  Driver loops should call
+ * this before blocking, and not block for longer.
+ */
+uint64_t imsm_timer_poll(struct imsm *);
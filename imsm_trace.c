@@ -0,0 +1,363 @@
+#define _GNU_SOURCE
+
+#include "imsm_trace.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "imsm.h"
+
+/*
+ * Each thread writes to its own ring, with a seqlock-style protocol:
+ * the writer publishes the new `head` after writing an event, and
+ * readers discard any event whose slot the writer may have reused
+ * while they copied it.
+ *
+ * Rings are never freed, so that we can still decode the history of
+ * threads that exited.
+ */
+struct imsm_trace_ring {
+        struct imsm_trace_ring *next;
+        pid_t tid;
+        size_t mask;
+        /* Number of events written so far. */
+        uint64_t head;
+        struct imsm_trace_event events[];
+};
+
+uint32_t imsm_trace_enabled;
+
+static struct {
+        /* Stack of all the rings, pushed with a CAS. */
+        struct imsm_trace_ring *rings;
+        size_t events_per_thread;
+        /*
+         * Timestamps are converted to nanoseconds since `base_ticks`
+         * with `ns_per_tick`, calibrated the first time we enable
+         * tracing.
+         */
+        bool calibrated;
+        uint64_t base_ticks;
+        double ns_per_tick;
+} trace_state;
+
+static __thread struct imsm_trace_ring *current_ring;
+
+extern void imsm_trace(enum imsm_trace_kind, const struct imsm *,
+    const struct imsm_entry *, uint16_t new_queue);
+
+static uint64_t
+clock_ns(void)
+{
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return now.tv_sec * 1000 * 1000 * 1000ULL + now.tv_nsec;
+}
+
+/*
+ * The TSC is much cheaper than even the vDSO's clock_gettime, and
+ * invariant (synchronised between cores) on the hardware we care
+ * about.
+ */
+static inline uint64_t
+trace_now(void)
+{
+
+#if defined(__x86_64__)
+        return __builtin_ia32_rdtsc();
+#else
+        return clock_ns();
+#endif
+}
+
+static void
+trace_calibrate(void)
+{
+#if defined(__x86_64__)
+        uint64_t begin_ns, begin_ticks, end_ns, end_ticks;
+
+        begin_ns = clock_ns();
+        begin_ticks = trace_now();
+        do {
+                end_ns = clock_ns();
+        } while (end_ns - begin_ns < 10 * 1000 * 1000);
+
+        end_ticks = trace_now();
+        trace_state.base_ticks = begin_ticks;
+        trace_state.ns_per_tick =
+            (double)(end_ns - begin_ns) / (end_ticks - begin_ticks);
+#else
+        trace_state.base_ticks = clock_ns();
+        trace_state.ns_per_tick = 1;
+#endif
+        trace_state.calibrated = true;
+        return;
+}
+
+void
+imsm_trace_enable(size_t events_per_thread)
+{
+        size_t capacity = 1;
+
+        if (events_per_thread == 0)
+                events_per_thread = IMSM_TRACE_DEFAULT_EVENTS;
+
+        while (capacity < events_per_thread)
+                capacity *= 2;
+
+        if (!trace_state.calibrated)
+                trace_calibrate();
+
+        __atomic_store_n(&trace_state.events_per_thread, capacity,
+            __ATOMIC_RELAXED);
+        __atomic_store_n(&imsm_trace_enabled, 1, __ATOMIC_RELEASE);
+        return;
+}
+
+void
+imsm_trace_disable(void)
+{
+
+        __atomic_store_n(&imsm_trace_enabled, 0, __ATOMIC_RELEASE);
+        return;
+}
+
+static struct imsm_trace_ring *
+trace_ring_create(void)
+{
+        struct imsm_trace_ring *ring;
+        size_t capacity;
+
+        capacity = __atomic_load_n(&trace_state.events_per_thread,
+            __ATOMIC_RELAXED);
+        ring = calloc(1, sizeof(*ring) + capacity * sizeof(ring->events[0]));
+        if (ring == NULL)
+                return NULL;
+
+        ring->tid = gettid();
+        ring->mask = capacity - 1;
+        ring->next = __atomic_load_n(&trace_state.rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&trace_state.rings, &ring->next,
+            ring, /*weak=*/true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+                ;
+
+        current_ring = ring;
+        return ring;
+}
+
+void
+imsm_trace_record(enum imsm_trace_kind kind, const struct imsm *imsm,
+    const struct imsm_entry *entry, uint16_t new_queue)
+{
+        struct imsm_trace_ring *ring = current_ring;
+        struct imsm_trace_event *event;
+        uint64_t head;
+
+        if (__builtin_expect(ring == NULL, 0)) {
+                ring = trace_ring_create();
+                if (ring == NULL)
+                        return;
+        }
+
+        head = ring->head;
+        event = &ring->events[head & ring->mask];
+        /*
+         * Order the previous update to `head` before we overwrite
+         * the slot's old event.
+         */
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        *event = (struct imsm_trace_event) {
+                .timestamp = trace_now(),
+                .offset = (uintptr_t)entry - (uintptr_t)imsm->slab.arena,
+                .version = entry->version,
+                .imsm_index = imsm->global_index,
+                .old_queue = entry->queue_id,
+                .new_queue = new_queue,
+                .kind = kind,
+        };
+        __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+        return;
+}
+
+/*
+ * Appends the events in `ring` to `dst`, which has room for the whole
+ * ring, and returns the number of transitions appended.  `copy` is
+ * scratch space for the whole ring.
+ */
+static size_t
+trace_ring_collect(struct imsm_trace_transition *dst,
+    struct imsm_trace_event *copy, const struct imsm_trace_ring *ring)
+{
+        const uint64_t capacity = ring->mask + 1;
+        uint64_t first, begin, end, valid;
+        size_t ret = 0;
+
+        end = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        first = (end > capacity) ? end - capacity : 0;
+        for (uint64_t i = first; i < end; i++)
+                memcpy(&copy[i - first], &ring->events[i & ring->mask],
+                    sizeof(copy[0]));
+
+        /*
+         * The writer bumps `head` to N before it overwrites event
+         * N - capacity, so anything at or before that index may be
+         * torn.
+         */
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        valid = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        valid = (valid >= capacity) ? valid - capacity + 1 : 0;
+        begin = (first < valid) ? valid : first;
+
+        for (uint64_t i = begin; i < end; i++) {
+                const struct imsm_trace_event *event = &copy[i - first];
+                struct imsm *imsm;
+                size_t object_index;
+
+                imsm = imsm_lookup(event->imsm_index);
+                if (imsm == NULL || event->kind == IMSM_TRACE_NONE)
+                        continue;
+
+                object_index = event->offset / imsm->slab.element_size;
+                dst[ret++] = (struct imsm_trace_transition) {
+                        .ref = imsm_refer_index(imsm, object_index,
+                            event->version).bits,
+                        .imsm_index = event->imsm_index,
+                        .object_index = object_index,
+                        .ns = (event->timestamp - trace_state.base_ticks) *
+                            trace_state.ns_per_tick,
+                        .tid = ring->tid,
+                        .old_queue = event->old_queue,
+                        .new_queue = event->new_queue,
+                        .kind = event->kind,
+                };
+        }
+
+        return ret;
+}
+
+static int
+transition_cmp(const void *x, const void *y)
+{
+        const struct imsm_trace_transition *a = x;
+        const struct imsm_trace_transition *b = y;
+
+        if (a->ref != b->ref)
+                return (a->ref < b->ref) ? -1 : 1;
+
+        if (a->ns != b->ns)
+                return (a->ns < b->ns) ? -1 : 1;
+
+        return (int)a->kind - (int)b->kind;
+}
+
+struct imsm_trace_transition *
+imsm_trace_collect(size_t *n)
+{
+        struct imsm_trace_ring *rings;
+        struct imsm_trace_transition *ret;
+        struct imsm_trace_event *copy;
+        size_t total = 0, max_ring = 0;
+
+        *n = 0;
+        rings = __atomic_load_n(&trace_state.rings, __ATOMIC_ACQUIRE);
+        for (const struct imsm_trace_ring *ring = rings; ring != NULL;
+             ring = ring->next) {
+                total += ring->mask + 1;
+                if (ring->mask + 1 > max_ring)
+                        max_ring = ring->mask + 1;
+        }
+
+        ret = calloc(total + 1, sizeof(*ret));
+        copy = calloc(max_ring + 1, sizeof(*copy));
+        if (ret == NULL || copy == NULL) {
+                free(ret);
+                free(copy);
+                return NULL;
+        }
+
+        for (const struct imsm_trace_ring *ring = rings; ring != NULL;
+             ring = ring->next)
+                *n += trace_ring_collect(&ret[*n], copy, ring);
+
+        free(copy);
+        qsort(ret, *n, sizeof(*ret), transition_cmp);
+        return ret;
+}
+
+static const char *
+queue_name(char *buf, size_t size, uint16_t queue)
+{
+
+        if (queue == UINT16_MAX)
+                return "-";
+
+        snprintf(buf, size, "%u", (unsigned int)queue);
+        return buf;
+}
+
+size_t
+imsm_trace_print_timelines(FILE *out, struct imsm_ref ref)
+{
+        static const char *const kind_names[] = {
+                [IMSM_TRACE_NONE] = "none",
+                [IMSM_TRACE_STAGE_IN] = "stage_in",
+                [IMSM_TRACE_WAKE_OUT] = "wake_out",
+                [IMSM_TRACE_NOTIFY] = "notify",
+                [IMSM_TRACE_PUT] = "put",
+                [IMSM_TRACE_TIMEOUT] = "timeout",
+                [IMSM_TRACE_DRAIN] = "drain",
+        };
+        struct imsm_trace_transition *transitions;
+        size_t n, ret = 0;
+        uint64_t first_ns = 0, previous_ns = 0, staged_ns = 0;
+        uint16_t staged_queue = UINT16_MAX;
+
+        transitions = imsm_trace_collect(&n);
+        if (transitions == NULL)
+                return 0;
+
+        for (size_t i = 0; i < n; i++) {
+                const struct imsm_trace_transition *current = &transitions[i];
+                char old_buf[8], new_buf[8];
+
+                if (ref.bits != 0 && current->ref != ref.bits)
+                        continue;
+
+                if (i == 0 || current->ref != transitions[i - 1].ref) {
+                        fprintf(out, "state %#llx (imsm %zu, index %zu)\n",
+                            (unsigned long long)current->ref,
+                            current->imsm_index, current->object_index);
+                        first_ns = current->ns;
+                        previous_ns = current->ns;
+                        staged_queue = UINT16_MAX;
+                }
+
+                fprintf(out, "  %+12.3f us (%+10.3f) tid %-7d %-8s %s -> %s",
+                    (current->ns - first_ns) * 1e-3,
+                    (current->ns - previous_ns) * 1e-3, (int)current->tid,
+                    kind_names[current->kind],
+                    queue_name(old_buf, sizeof(old_buf), current->old_queue),
+                    queue_name(new_buf, sizeof(new_buf), current->new_queue));
+                if ((current->kind == IMSM_TRACE_WAKE_OUT ||
+                    current->kind == IMSM_TRACE_TIMEOUT) &&
+                    current->old_queue == staged_queue)
+                        fprintf(out, "  waited %.3f us in queue %u",
+                            (current->ns - staged_ns) * 1e-3,
+                            (unsigned int)staged_queue);
+                fprintf(out, "\n");
+
+                if (current->kind == IMSM_TRACE_STAGE_IN) {
+                        staged_queue = current->new_queue;
+                        staged_ns = current->ns;
+                }
+
+                previous_ns = current->ns;
+                ret++;
+        }
+
+        free(transitions);
+        return ret;
+}
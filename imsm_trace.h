@@ -0,0 +1,132 @@
+#pragma once
+
+/*
+ * Per-entry transition tracing.
+ *
+ * When enabled, every queue transition (staged into a queue, woken
+ * out of one, notified, timed out, drained, or freed) appends one
+ * event to a ring buffer owned by the current thread.  Writers never
+ * synchronise with each other, and only pay for a relaxed load and a
+ * predictable branch while tracing is disabled.
+ *
+ * Old events are overwritten once a thread's ring is full, so the
+ * rings always hold each thread's most recent history.  The decoder
+ * merges all the rings, and rebuilds each state's timeline, keyed by
+ * `imsm_ref`: when one connection is slow, its timeline shows which
+ * queues it waited in, and for how long.
+ */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+struct imsm;
+struct imsm_entry;
+struct imsm_ref;
+
+/* Default ring size, in events per thread. */
+#define IMSM_TRACE_DEFAULT_EVENTS (1UL << 16)
+
+enum imsm_trace_kind {
+        IMSM_TRACE_NONE = 0,
+        /* `imsm_stage_in` added the entry to `new_queue`. */
+        IMSM_TRACE_STAGE_IN,
+        /* `imsm_stage_out` dispatched the entry's wake-up. */
+        IMSM_TRACE_WAKE_OUT,
+        /* `imsm_notify` (or `imsm_notify_n`) woke the entry up. */
+        IMSM_TRACE_NOTIFY,
+        /* `imsm_put` (or `imsm_put_n`) released the entry. */
+        IMSM_TRACE_PUT,
+        /* `imsm_stage_io_timeout` dispatched the entry's timeout. */
+        IMSM_TRACE_TIMEOUT,
+        /* `imsm_queue_drain` (or `imsm_queue_cancel`) took the entry. */
+        IMSM_TRACE_DRAIN,
+};
+
+/*
+ * Raw event, as written to the per-thread rings.  We defer the
+ * conversion to `imsm_ref`, which needs a division, to the decoder.
+ */
+struct imsm_trace_event {
+        /* TSC ticks on x86-64, CLOCK_MONOTONIC nanoseconds otherwise. */
+        uint64_t timestamp;
+        /* Byte offset of the entry in its imsm's arena. */
+        uint64_t offset;
+        /* The entry's version before the transition. */
+        uint32_t version;
+        uint16_t imsm_index;
+        uint16_t old_queue;
+        uint16_t new_queue;
+        uint8_t kind;
+        uint8_t padding[5];
+};
+
+/*
+ * Decoded event.
+ */
+struct imsm_trace_transition {
+        /* Bits of the state's `imsm_ref`. */
+        uint64_t ref;
+        /* Global index of the state's imsm, and index in its arena. */
+        size_t imsm_index;
+        size_t object_index;
+        /* Nanoseconds since tracing was first enabled. */
+        uint64_t ns;
+        pid_t tid;
+        uint16_t old_queue;
+        uint16_t new_queue;
+        enum imsm_trace_kind kind;
+};
+
+/*
+ * Non-zero while tracing is enabled.
+ */
+extern uint32_t imsm_trace_enabled;
+
+/*
+ * Starts recording transitions.  Each thread allocates a ring of
+ * `events_per_thread` events (rounded up to a power of two, or
+ * IMSM_TRACE_DEFAULT_EVENTS if 0) the first time it records one.
+ * Rings that already exist keep their size.
+ */
+void imsm_trace_enable(size_t events_per_thread);
+
+/*
+ * Stops recording transitions.  The rings keep their contents.
+ */
+void imsm_trace_disable(void);
+
+/*
+ * Records one transition for `entry` to `new_queue` (UINT16_MAX for
+ * none), if tracing is enabled.  Call before updating the entry.
+ */
+inline void imsm_trace(enum imsm_trace_kind, const struct imsm *,
+    const struct imsm_entry *, uint16_t new_queue);
+
+/*
+ * Slow path for `imsm_trace`.
+ */
+void imsm_trace_record(enum imsm_trace_kind, const struct imsm *,
+    const struct imsm_entry *, uint16_t new_queue);
+
+/*
+ * Returns a snapshot of every thread's ring, decoded and sorted by
+ * reference, then by time, and stores the number of transitions in
+ * `*n`.  The caller must `free` the return value.
+ *
+ * Safe to call while other threads record events: we drop events
+ * that might have been overwritten while we copied them.
+ */
+struct imsm_trace_transition *imsm_trace_collect(size_t *n);
+
+/*
+ * Prints the timeline of the state referenced by `ref`, or of every
+ * state if `ref` is 0 (the NULL reference), to `out`.  Each line
+ * shows the time since the state's first event, the thread, and the
+ * transition; waits between staging in and waking out are labeled
+ * with the queue they happened in.
+ *
+ * Returns the number of transitions printed.
+ */
+size_t imsm_trace_print_timelines(FILE *out, struct imsm_ref ref);
@@ -0,0 +1,16 @@
+/* -*- mode: C -*- */
+
+#pragma once
+
+inline void
+imsm_trace(enum imsm_trace_kind kind, const struct imsm *imsm,
+    const struct imsm_entry *entry, uint16_t new_queue)
+{
+
+        if (__builtin_expect(
+            __atomic_load_n(&imsm_trace_enabled, __ATOMIC_RELAXED) == 0, 1))
+                return;
+
+        imsm_trace_record(kind, imsm, entry, new_queue);
+        return;
+}
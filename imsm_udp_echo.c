@@ -0,0 +1,640 @@
+#define _GNU_SOURCE
+
+/*
+ * UDP echo server on top of immediate mode state machines, with a
+ * matching load generator.
+ *
+ * Each shard receives up to RECV_BATCH datagrams with one recvmmsg(2),
+ * straight into pooled buffers, and allocates their states in bulk.
+ * All the replies that are ready in a poll pass then leave with a
+ * single sendmmsg(2).  Replies that would block wait in their stage
+ * until the socket is writable again.
+ */
+#include <assert.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "imsm.h"
+#include "imsm_buf.h"
+#include "imsm_driver.h"
+
+/* Number of datagrams we try to receive with each recvmmsg. */
+#define RECV_BATCH 64
+
+/* Longer datagrams are truncated. */
+#define MAX_DATAGRAM 512
+
+/*
+ * Allow up to 256 concurrent requests per shard.
+ */
+#define NUM_UDP_STATES 256
+
+struct udp_state {
+        struct imsm_entry header;
+        struct sockaddr_in peer;
+        uint32_t size;
+        /* The request's datagram, and thus its reply. */
+        struct imsm_buf *buf;
+};
+
+/*
+ * Each shard is a fully independent server, with its own state
+ * machine, SO_REUSEPORT socket, and epoll set.  Shards only have one
+ * worker, so nothing here needs atomics.
+ */
+struct udp_shard {
+        IMSM(, struct udp_state) udp;
+        int fd;
+        int epoll_fd;
+        /*
+         * Set by the (edge-triggered) socket's EPOLLIN events, and
+         * left set until recvmmsg drains the socket.
+         */
+        bool recv_ready;
+        /* Number of allocated states. */
+        size_t num_live;
+        /* States whose reply would block, until the next EPOLLOUT. */
+        size_t num_blocked;
+        struct imsm_ref blocked[NUM_UDP_STATES];
+        /*
+         * Receive buffers stay here, across poll passes, until a
+         * datagram lands in them.
+         */
+        struct imsm_buf *recv_bufs[RECV_BATCH];
+        struct sockaddr_in recv_peers[RECV_BATCH];
+        /* Scratch space for recvmmsg and sendmmsg. */
+        struct mmsghdr msgs[NUM_UDP_STATES];
+        struct iovec iovecs[NUM_UDP_STATES];
+        struct imsm_buf_pool bufs;
+        struct imsm_buf_cache buf_cache;
+        struct udp_state *backing;
+};
+
+/*
+ * Returns the shard for the context's state machine.
+ */
+static struct udp_shard *
+udp_shard_of(struct imsm_ctx *ctx)
+{
+
+        return (struct udp_shard *)((char *)ctx->imsm -
+            __builtin_offsetof(struct udp_shard, udp.imsm));
+}
+
+static void
+udp_state_init(void *vstate)
+{
+        struct udp_state *state = vstate;
+
+        memset(&state->peer, 0, sizeof(state->peer));
+        state->size = 0;
+        state->buf = NULL;
+        return;
+}
+
+static void
+udp_state_deinit(void *vstate)
+{
+        struct udp_state *state = vstate;
+
+        assert(state->buf == NULL &&
+            "UDP states must release their buffer before IMSM_PUT.");
+        udp_state_init(state);
+        return;
+}
+
+/*
+ * Makes sure the first `n` receive buffers are populated, and returns
+ * how many of them are.
+ */
+static size_t
+fill_recv_bufs(struct udp_shard *shard, size_t n)
+{
+
+        for (size_t i = 0; i < n; i++) {
+                if (shard->recv_bufs[i] == NULL)
+                        shard->recv_bufs[i] = imsm_buf_get(&shard->bufs,
+                            &shard->buf_cache, MAX_DATAGRAM);
+                if (shard->recv_bufs[i] == NULL)
+                        return i;
+        }
+
+        return n;
+}
+
+/*
+ * Receives a batch of datagrams if the socket is ready, and returns
+ * them as an imsm_list of new states.  We never receive more
+ * datagrams than we have free states for.
+ */
+static struct udp_state **
+receive_datagrams(struct imsm_ctx *ctx)
+{
+        struct udp_shard *shard = udp_shard_of(ctx);
+        struct udp_state *states[RECV_BATCH];
+        struct udp_state **ret;
+        size_t batch_size, num_states;
+        int r;
+        IMSM_CTX_PTR(ctx);
+
+        if (!shard->recv_ready)
+                return NULL;
+
+        /*
+         * If we're out of states, leave `recv_ready` set: releasing
+         * states bumps the generation counter, and we'll come back.
+         */
+        batch_size = NUM_UDP_STATES - shard->num_live;
+        if (batch_size > RECV_BATCH)
+                batch_size = RECV_BATCH;
+        batch_size = fill_recv_bufs(shard, batch_size);
+        if (batch_size == 0)
+                return NULL;
+
+        for (size_t i = 0; i < batch_size; i++) {
+                shard->iovecs[i] = (struct iovec) {
+                        .iov_base = shard->recv_bufs[i]->data,
+                        .iov_len = MAX_DATAGRAM,
+                };
+                shard->msgs[i] = (struct mmsghdr) {
+                        .msg_hdr = {
+                                .msg_name = &shard->recv_peers[i],
+                                .msg_namelen = sizeof(shard->recv_peers[i]),
+                                .msg_iov = &shard->iovecs[i],
+                                .msg_iovlen = 1,
+                        },
+                };
+        }
+
+        r = recvmmsg(shard->fd, shard->msgs, batch_size, MSG_DONTWAIT, NULL);
+        if (r < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                        shard->recv_ready = false;
+                else if (errno != EINTR)
+                        perror("recvmmsg");
+                return NULL;
+        }
+
+        /* A short batch means the socket is drained. */
+        if ((size_t)r < batch_size)
+                shard->recv_ready = false;
+
+        num_states = IMSM_GET_N(&shard->udp, states, r);
+        assert(num_states == (size_t)r &&
+            "We only receive as many datagrams as we have free states.");
+
+        ret = IMSM_LIST_GET(struct udp_state, num_states);
+        for (size_t i = 0; i < num_states; i++) {
+                struct udp_state *state = states[i];
+                bool success;
+
+                state->peer = shard->recv_peers[i];
+                state->size = shard->msgs[i].msg_len;
+                state->buf = shard->recv_bufs[i];
+                shard->recv_bufs[i] = NULL;
+                success = imsm_list_push(ret, state, 0);
+                assert(success && "imsm_list_push failed.");
+        }
+
+        shard->num_live += num_states;
+        if (shard->recv_ready && shard->num_live < NUM_UDP_STATES)
+                imsm_wake(ctx->imsm);
+        return ret;
+}
+
+/*
+ * Sends the replies for all the states that are ready, with a single
+ * sendmmsg in the common case.
+ *
+ * `received` states are added to the set of states ready to send.
+ *
+ * Returns the list of states whose reply is gone.  States that would
+ * block stay in the stage, and are woken by the next EPOLLOUT.
+ */
+static struct udp_state **
+send_replies(struct imsm_ctx *ctx, struct udp_state **received)
+{
+        struct udp_shard *shard = udp_shard_of(ctx);
+        struct udp_state **ready, **done;
+        size_t num_ready, num_sent = 0;
+        IMSM_CTX_PTR(ctx);
+
+        IMSM_REGION("send_replies");
+        ready = IMSM_STAGE("ready_to_send", received, 0);
+        num_ready = imsm_list_size(ready);
+        done = IMSM_LIST_GET(struct udp_state, num_ready);
+        if (num_ready == 0)
+                return done;
+
+        assert(num_ready <= NUM_UDP_STATES);
+        for (size_t i = 0; i < num_ready; i++) {
+                struct udp_state *state = ready[i];
+
+                shard->iovecs[i] = (struct iovec) {
+                        .iov_base = state->buf->data,
+                        .iov_len = state->size,
+                };
+                shard->msgs[i] = (struct mmsghdr) {
+                        .msg_hdr = {
+                                .msg_name = &state->peer,
+                                .msg_namelen = sizeof(state->peer),
+                                .msg_iov = &shard->iovecs[i],
+                                .msg_iovlen = 1,
+                        },
+                };
+        }
+
+        while (num_sent < num_ready) {
+                int r;
+
+                r = sendmmsg(shard->fd, &shard->msgs[num_sent],
+                    num_ready - num_sent, MSG_DONTWAIT);
+                if (r > 0) {
+                        num_sent += r;
+                        continue;
+                }
+
+                if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                        break;
+
+                /* Drop the reply that failed, and try the rest again. */
+                if (r < 0 && errno != EINTR) {
+                        perror("sendmmsg");
+                        num_sent++;
+                }
+        }
+
+        for (size_t i = 0; i < num_ready; i++) {
+                struct udp_state *state = ready[i];
+                bool success;
+
+                if (i >= num_sent) {
+                        assert(shard->num_blocked < NUM_UDP_STATES);
+                        shard->blocked[shard->num_blocked++] =
+                            IMSM_REFER(state);
+                        continue;
+                }
+
+                success = imsm_list_push(done, state, 0);
+                assert(success && "imsm_list_push failed.");
+        }
+
+        return done;
+}
+
+/*
+ * Fully scans the UDP state machine once.
+ */
+static void
+udp_fn(struct imsm_ctx *ctx)
+{
+        struct udp_shard *shard = udp_shard_of(ctx);
+        struct udp_state **received, **done;
+        IMSM_CTX_PTR(ctx);
+
+        received = receive_datagrams(ctx);
+        done = send_replies(ctx, received);
+
+        imsm_list_foreach(current, done) {
+                imsm_buf_put(&shard->bufs, &shard->buf_cache, current->buf);
+                current->buf = NULL;
+        }
+
+        shard->num_live -= imsm_list_size(done);
+        IMSM_PUT_N(&shard->udp, done, imsm_list_size(done));
+        return;
+}
+
+/*
+ * Waits for epoll events for up to `timeout_ns`, and wakes the state
+ * machine for new datagrams, or the blocked states once the socket is
+ * writable.
+ */
+static void
+udp_wait(struct imsm_ctx *ctx, uint64_t timeout_ns, void *arg)
+{
+        struct udp_shard *shard = udp_shard_of(ctx);
+        struct epoll_event events[4];
+        int timeout_ms;
+        int r;
+
+        (void)arg;
+        /* Round up to the next millisecond, without overflowing. */
+        if (timeout_ns > 1000 * 1000 * 1000ULL)
+                timeout_ns = 1000 * 1000 * 1000ULL;
+        timeout_ms = (timeout_ns + 999999) / 1000000;
+
+        r = epoll_wait(shard->epoll_fd, events,
+                       sizeof(events) / sizeof(events[0]),
+                       timeout_ms);
+        if (r < 0 && errno != EINTR) {
+                perror("epoll");
+                abort();
+        }
+
+        for (size_t i = 0, n = (r > 0) ? r : 0; i < n; i++) {
+                if (events[i].events & (EPOLLIN | EPOLLERR)) {
+                        shard->recv_ready = true;
+                        imsm_wake(ctx->imsm);
+                }
+
+                if ((events[i].events & EPOLLOUT) && shard->num_blocked > 0) {
+                        imsm_notify_n(shard->blocked, shard->num_blocked);
+                        shard->num_blocked = 0;
+                }
+        }
+
+        return;
+}
+
+static int
+make_udp_fd(int port, bool reuse_port)
+{
+        struct sockaddr_in sock = { 0 };
+        int one = 1;
+        int fd;
+
+        fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+                perror("socket");
+                abort();
+        }
+
+        sock.sin_family = AF_INET;
+        sock.sin_port = htons(port);
+        sock.sin_addr.s_addr = htonl(INADDR_ANY);
+
+        /* Let the kernel spread incoming datagrams between shards. */
+        if (reuse_port &&
+            setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+                perror("setsockopt");
+                abort();
+        }
+
+        if (bind(fd, (struct sockaddr *)&sock, sizeof(sock)) < 0) {
+                perror("bind");
+                abort();
+        }
+
+        return fd;
+}
+
+/*
+ * Initializes a shard with its own arena, buffers, socket and epoll
+ * set.
+ */
+static void
+udp_shard_init(struct udp_shard *shard, int port, bool reuse_port)
+{
+        struct epoll_event event = {
+                .events = EPOLLIN | EPOLLOUT | EPOLLET,
+        };
+
+        shard->fd = make_udp_fd(port, reuse_port);
+        shard->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (shard->epoll_fd < 0) {
+                perror("epoll_create");
+                abort();
+        }
+
+        if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, shard->fd, &event) < 0) {
+                perror("epoll_ctl");
+                abort();
+        }
+
+        /* Optimistically try to receive before the first event. */
+        shard->recv_ready = true;
+
+        /*
+         * Every state holds one buffer, and we keep up to RECV_BATCH
+         * more around for recvmmsg, all from the size class that fits
+         * MAX_DATAGRAM.  Smaller classes go unused.
+         */
+        if (!imsm_buf_pool_init(&shard->bufs,
+            (NUM_UDP_STATES + RECV_BATCH) *
+            imsm_buf_class_size(MAX_DATAGRAM))) {
+                perror("imsm_buf_pool_init");
+                abort();
+        }
+
+        shard->backing = calloc(NUM_UDP_STATES, sizeof(*shard->backing));
+        if (shard->backing == NULL) {
+                perror("calloc");
+                abort();
+        }
+
+        IMSM_INIT(&shard->udp, header, shard->backing,
+            NUM_UDP_STATES * sizeof(*shard->backing),
+            udp_state_init, udp_state_deinit, udp_fn);
+        return;
+}
+
+/*
+ * Runs `num_shards` independent UDP echo state machines, each pinned
+ * to its own CPU, with its own SO_REUSEPORT socket.
+ */
+static void
+run_server(int port, size_t num_shards)
+{
+        const struct imsm_driver_opts opts = {
+                .idle_policy = IMSM_IDLE_SLEEP,
+                .wait_fn = udp_wait,
+                .export_stats = true,
+        };
+        struct udp_shard *shards;
+        struct imsm **machines;
+        int r;
+
+        shards = calloc(num_shards, sizeof(*shards));
+        machines = calloc(num_shards, sizeof(*machines));
+        if (shards == NULL || machines == NULL) {
+                perror("calloc");
+                abort();
+        }
+
+        for (size_t i = 0; i < num_shards; i++) {
+                udp_shard_init(&shards[i], port, num_shards > 1);
+                machines[i] = &shards[i].udp.imsm;
+        }
+
+        printf("Listening on UDP port %i with %zu shards\n", port, num_shards);
+        r = imsm_run_sharded(machines, num_shards, &opts);
+        if (r != 0) {
+                errno = r;
+                perror("imsm_run_sharded");
+                abort();
+        }
+
+        return;
+}
+
+static double
+now_seconds(void)
+{
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return now.tv_sec + 1e-9 * now.tv_nsec;
+}
+
+/*
+ * Sends windows of `window` requests to the server on localhost with
+ * sendmmsg, and waits for their replies with recvmmsg, for `seconds`.
+ * Requests that don't get a reply within 100 ms count as lost.
+ *
+ * Prints the number of replies per second.
+ */
+static void
+run_client(int port, double seconds, size_t window)
+{
+        static const char request[] = "ping\n";
+        const struct timeval timeout = { .tv_usec = 100 * 1000 };
+        struct sockaddr_in server = { 0 };
+        struct mmsghdr *msgs;
+        struct iovec *iovecs;
+        char (*replies)[MAX_DATAGRAM];
+        size_t num_replies = 0, num_lost = 0;
+        double begin, end;
+        int fd;
+
+        msgs = calloc(window, sizeof(*msgs));
+        iovecs = calloc(window, sizeof(*iovecs));
+        replies = calloc(window, sizeof(*replies));
+        if (msgs == NULL || iovecs == NULL || replies == NULL) {
+                perror("calloc");
+                abort();
+        }
+
+        fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+                perror("socket");
+                abort();
+        }
+
+        server.sin_family = AF_INET;
+        server.sin_port = htons(port);
+        server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (connect(fd, (struct sockaddr *)&server, sizeof(server)) < 0) {
+                perror("connect");
+                abort();
+        }
+
+        if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO,
+            &timeout, sizeof(timeout)) < 0) {
+                perror("setsockopt");
+                abort();
+        }
+
+        begin = now_seconds();
+        end = begin;
+        while (end - begin < seconds) {
+                size_t num_received = 0;
+                int sent;
+
+                for (size_t i = 0; i < window; i++) {
+                        iovecs[i] = (struct iovec) {
+                                .iov_base = (void *)request,
+                                .iov_len = sizeof(request) - 1,
+                        };
+                        msgs[i] = (struct mmsghdr) {
+                                .msg_hdr = {
+                                        .msg_iov = &iovecs[i],
+                                        .msg_iovlen = 1,
+                                },
+                        };
+                }
+
+                sent = sendmmsg(fd, msgs, window, 0);
+                if (sent < 0) {
+                        perror("sendmmsg");
+                        abort();
+                }
+
+                for (size_t i = 0; i < window; i++) {
+                        iovecs[i] = (struct iovec) {
+                                .iov_base = replies[i],
+                                .iov_len = sizeof(replies[i]),
+                        };
+                }
+
+                while (num_received < (size_t)sent) {
+                        int r;
+
+                        r = recvmmsg(fd, msgs, sent - num_received,
+                            MSG_WAITFORONE, NULL);
+                        if (r < 0) {
+                                if (errno == EINTR)
+                                        continue;
+                                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                                        perror("recvmmsg");
+                                        abort();
+                                }
+
+                                num_lost += sent - num_received;
+                                break;
+                        }
+
+                        num_received += r;
+                }
+
+                num_replies += num_received;
+                end = now_seconds();
+        }
+
+        printf("%zu replies in %.3f s: %.0f packets/s, %zu lost\n",
+            num_replies, end - begin, num_replies / (end - begin), num_lost);
+        close(fd);
+        free(replies);
+        free(iovecs);
+        free(msgs);
+        return;
+}
+
+/*
+ * Usage: imsm_udp_echo PORT [NUM_SHARDS]
+ *        imsm_udp_echo PORT client [SECONDS [WINDOW]]
+ *
+ * The server runs one state machine per shard.  The client measures
+ * how many requests per second the server on localhost answers, with
+ * up to WINDOW (default 32) requests in flight.
+ */
+int
+main(int argc, char **argv)
+{
+        size_t num_shards = 1;
+        int port;
+
+        if (argc < 2)
+                return -1;
+
+        port = atoi(argv[1]);
+        if (argc > 2 && strcmp(argv[2], "client") == 0) {
+                double seconds = (argc > 3) ? strtod(argv[3], NULL) : 5;
+                size_t window = (argc > 4) ? strtoul(argv[4], NULL, 10) : 32;
+
+                if (window == 0 || window > UIO_MAXIOV)
+                        window = 32;
+
+                run_client(port, seconds, window);
+                return 0;
+        }
+
+        if (argc > 2)
+                num_shards = strtoul(argv[2], NULL, 10);
+        if (num_shards == 0)
+                num_shards = 1;
+
+        run_server(port, num_shards);
+        return 0;
+}
@@ -43,15 +43,119 @@
  */
 
 #define IMSM_STAGE(LOC_INFO, LIST_IN, AUX_MATCH)                        \
+        IMSM_STAGE_WORKLOAD(IMSM_WORKLOAD_DEFAULT, LOC_INFO,            \
+            LIST_IN, AUX_MATCH)
+
+/*
+ * IMSM_STAGE_WORKLOAD(WORKLOAD, LOC_INFO, LIST_IN, AUX_MATCH) is like
+ * IMSM_STAGE, for a stage annotated with an `enum imsm_workload`.
+ * Contexts whose `workload_mask` excludes WORKLOAD only add LIST_IN
+ * to the stage's queue, and return an empty list.
+ */
+#define IMSM_STAGE_WORKLOAD(WORKLOAD, LOC_INFO, LIST_IN, AUX_MATCH)     \
         ({                                                              \
                 __typeof__(**(LIST_IN)) **stage_list_in_ = (LIST_IN);   \
                 struct imsm_ctx *ctx_ = (IMSM_CTX_PTR_VAR);             \
                                                                         \
-                (__typeof__(list_in_))imsm_stage_io(                    \
-                    ctx_, IMSM_PPOINT_RECORD(IMSM_UNPAREN(LOC_INFO)),   \
+                (__typeof__(stage_list_in_))imsm_stage_io(              \
+                    ctx_, IMSM_PPOINT_RECORD_WORKLOAD((WORKLOAD),       \
+                        IMSM_UNPAREN(LOC_INFO)),                        \
                     (void **)stage_list_in_, (AUX_MATCH));              \
         })
 
+/*
+ * IMSM_STAGE_TIMEOUT(LOC_INFO, LIST_IN, AUX_MATCH, TIMEOUT_NS, TIMED_OUT)
+ * is like IMSM_STAGE, but gives each entry in LIST_IN a deadline
+ * TIMEOUT_NS from now, and stores in *TIMED_OUT the list of entries
+ * whose deadline passed while they waited in the stage's queue.
+ * Timed out entries are out of the queue: free them, or stage them
+ * elsewhere.  Staging an entry in again re-arms its deadline, and
+ * IMSM_CANCEL_TIMEOUT(OBJECT) disarms it.
+ */
+#define IMSM_STAGE_TIMEOUT(LOC_INFO, LIST_IN, AUX_MATCH, TIMEOUT_NS,    \
+                           TIMED_OUT)                                   \
+        ({                                                              \
+                __typeof__(**(LIST_IN)) **stage_list_in_ = (LIST_IN);   \
+                __typeof__(stage_list_in_) *stage_timed_out_ =          \
+                        (TIMED_OUT);                                    \
+                struct imsm_ctx *ctx_ = (IMSM_CTX_PTR_VAR);             \
+                                                                        \
+                (__typeof__(stage_list_in_))imsm_stage_io_timeout(      \
+                    ctx_, IMSM_PPOINT_RECORD(IMSM_UNPAREN(LOC_INFO)),   \
+                    (void **)stage_list_in_, (AUX_MATCH), (TIMEOUT_NS), \
+                    (void ***)stage_timed_out_);                        \
+        })
+
+#define IMSM_CANCEL_TIMEOUT(OBJECT)                                     \
+        (imsm_timer_cancel((IMSM_CTX_PTR_VAR), (OBJECT)))
+
+/*
+ * IMSM_STAGE_LIMITED(LOC_INFO, LIST_IN, AUX_MATCH, LIMITS) is like
+ * IMSM_STAGE, and IMSM_STAGE_TIMEOUT_LIMITED(LOC_INFO, LIST_IN,
+ * AUX_MATCH, TIMEOUT_NS, TIMED_OUT, LIMITS) like IMSM_STAGE_TIMEOUT,
+ * with a `struct imsm_stage_limits *` on the number of entries they
+ * return, and a "queue full" signal for upstream stages.
+ */
+#define IMSM_STAGE_LIMITED(LOC_INFO, LIST_IN, AUX_MATCH, LIMITS)        \
+        ({                                                              \
+                __typeof__(**(LIST_IN)) **stage_list_in_ = (LIST_IN);   \
+                struct imsm_ctx *ctx_ = (IMSM_CTX_PTR_VAR);             \
+                                                                        \
+                (__typeof__(stage_list_in_))imsm_stage_io_limited(      \
+                    ctx_, IMSM_PPOINT_RECORD(IMSM_UNPAREN(LOC_INFO)),   \
+                    (void **)stage_list_in_, (AUX_MATCH), 0, NULL,      \
+                    (LIMITS));                                          \
+        })
+
+#define IMSM_STAGE_TIMEOUT_LIMITED(LOC_INFO, LIST_IN, AUX_MATCH,        \
+                                   TIMEOUT_NS, TIMED_OUT, LIMITS)       \
+        ({                                                              \
+                __typeof__(**(LIST_IN)) **stage_list_in_ = (LIST_IN);   \
+                __typeof__(stage_list_in_) *stage_timed_out_ =          \
+                        (TIMED_OUT);                                    \
+                struct imsm_ctx *ctx_ = (IMSM_CTX_PTR_VAR);             \
+                                                                        \
+                (__typeof__(stage_list_in_))imsm_stage_io_limited(      \
+                    ctx_, IMSM_PPOINT_RECORD(IMSM_UNPAREN(LOC_INFO)),   \
+                    (void **)stage_list_in_, (AUX_MATCH), (TIMEOUT_NS), \
+                    (void ***)stage_timed_out_, (LIMITS));              \
+        })
+
+/*
+ * IMSM_BACKOFF(OBJECT, BASE_NS, MAX_NS) leaves OBJECT parked in the
+ * queue of the stage that just returned it, and wakes it up again
+ * after a jittered delay that doubles with each consecutive attempt,
+ * from BASE_NS up to MAX_NS.  IMSM_BACKOFF_RESET(OBJECT) forgets
+ * previous attempts.
+ */
+#define IMSM_BACKOFF(OBJECT, BASE_NS, MAX_NS)                           \
+        (imsm_backoff((IMSM_CTX_PTR_VAR), (OBJECT), (BASE_NS), (MAX_NS)))
+
+#define IMSM_BACKOFF_RESET(OBJECT)                                      \
+        (imsm_backoff_reset((IMSM_CTX_PTR_VAR), (OBJECT)))
+
+/*
+ * IMSM_QUEUE_DRAIN(IMSM, LOC_INFO) and IMSM_QUEUE_CANCEL(IMSM,
+ * LOC_INFO) take the states (woken or not, or only those that aren't
+ * woken) out of the queue at LOC_INFO, and return them in a list of
+ * IMSM's state type, e.g., for IMSM_PUT_N.
+ */
+#define IMSM_QUEUE_DRAIN(IMSM, LOC_INFO)                                \
+        ({                                                              \
+                typedef __typeof__(*(IMSM)->meta->eltype) elt_t_;       \
+                                                                        \
+                (elt_t_ **)imsm_queue_drain((IMSM_CTX_PTR_VAR),         \
+                    IMSM_PPOINT_RECORD(IMSM_UNPAREN(LOC_INFO)));        \
+        })
+
+#define IMSM_QUEUE_CANCEL(IMSM, LOC_INFO)                               \
+        ({                                                              \
+                typedef __typeof__(*(IMSM)->meta->eltype) elt_t_;       \
+                                                                        \
+                (elt_t_ **)imsm_queue_cancel((IMSM_CTX_PTR_VAR),        \
+                    IMSM_PPOINT_RECORD(IMSM_UNPAREN(LOC_INFO)));        \
+        })
+
 #define IMSM_GET(IMSM)                                                  \
         ({                                                              \
                 __typeof__(IMSM) imsm_ = (IMSM);                        \
@@ -61,6 +165,22 @@
                 (elt_t_ *)imsm_get(ctx_, &imsm_->imsm);                 \
         })
 
+/*
+ * IMSM_GET_N(IMSM, DST, N) allocates up to N objects in the DST array,
+ * and returns the number of objects allocated.
+ */
+#define IMSM_GET_N(IMSM, DST, N)                                        \
+        ({                                                              \
+                __typeof__(IMSM) imsm_ = (IMSM);                        \
+                struct imsm_ctx *ctx_ = (IMSM_CTX_PTR_VAR);             \
+                typedef __typeof__(*imsm_->meta->eltype) elt_t_;        \
+                elt_t_ **ptr_dst_ = (DST);                              \
+                                                                        \
+                /* We know there is an imsm_entry at offset 0. */       \
+                imsm_get_n(ctx_, &imsm_->imsm,                          \
+                    (struct imsm_entry **)ptr_dst_, (N));               \
+        })
+
 #define IMSM_PUT(IMSM, OBJ)                                             \
         ({                                                              \
                 __typeof__(IMSM) imsm_ = (IMSM);                        \
@@ -118,6 +238,29 @@
              imsm_unwind_##UNIQUE##_.scratch == 0;                      \
              imsm_unwind_##UNIQUE##_.scratch = 1)
 
+/*
+ * WITH_IMSM_REGION_IF_ACTIVE(LOC_INFO, LISTS...) executes the block
+ * like WITH_IMSM_REGION, unless no queue in the region has pending
+ * wake-ups and all the imsm_lists in LISTS... are empty.  Only use
+ * this if the block does nothing useful when all its stages return
+ * empty lists.
+ */
+#define WITH_IMSM_REGION_IF_ACTIVE(LOC_INFO, ...)                       \
+        WITH_IMSM_REGION_IF_ACTIVE_(__COUNTER__, (IMSM_CTX_PTR_VAR),    \
+            LOC_INFO, ##__VA_ARGS__)
+
+#define WITH_IMSM_REGION_IF_ACTIVE_(UNIQUE, CTX, LOC_INFO, ...)         \
+        for (struct imsm_unwind_record imsm_unwind_##UNIQUE##_          \
+             __attribute__((__cleanup__(imsm_region_pop_if_active),     \
+                 __unused__))                                           \
+                 = imsm_region_push_if_active(CTX,                      \
+                     IMSM_PPOINT_RECORD(IMSM_UNPAREN(LOC_INFO)),        \
+                     (const void *const[]) { NULL, ##__VA_ARGS__ },     \
+                     sizeof((const void *const[]) { NULL, ##__VA_ARGS__ }) \
+                     / sizeof(void *));                                 \
+             imsm_unwind_##UNIQUE##_.scratch == 0;                      \
+             imsm_unwind_##UNIQUE##_.scratch = 1)
+
 /*
  * Internals that shouldn't be used directly.
  */
@@ -129,9 +272,12 @@
 #define IMSM_PASTE_(X, ...) X ## __VA_ARGS__
 #define IMSM_NOTHING_IMSM_EXTRACT
 
-#define IMSM_PPOINT(NAME) IMSM_PPOINT_((NAME), __COUNTER__)
-#define IMSM_PPOINT_(NAME, UNIQUE) IMSM_PPOINT__(NAME, UNIQUE)
-#define IMSM_PPOINT__(NAME, UNIQUE) \
+#define IMSM_PPOINT(NAME) IMSM_PPOINT_WORKLOAD(IMSM_WORKLOAD_DEFAULT, NAME)
+
+#define IMSM_PPOINT_WORKLOAD(WORKLOAD, NAME)                    \
+        IMSM_PPOINT_((NAME), (WORKLOAD), __COUNTER__)
+#define IMSM_PPOINT_(NAME, WORKLOAD, UNIQUE) IMSM_PPOINT__(NAME, WORKLOAD, UNIQUE)
+#define IMSM_PPOINT__(NAME, WORKLOAD, UNIQUE) \
         ({                         \
                 static const struct imsm_ppoint ppoint_##UNIQUE##_ = {  \
                         .name = NAME,                                   \
@@ -139,16 +285,21 @@
                         .file = __FILE__,                               \
                         .lineno = __LINE__,                             \
                         .unique = UNIQUE,                               \
+                        .workload = WORKLOAD,                           \
                 };                                                      \
                                                                         \
                 &ppoint_##UNIQUE##_;                                    \
         })
 
-#define IMSM_PPOINT_RECORD(NAME, ...) IMSM_PPOINT_RECORD_(NAME, ##__VA_ARGS__, 0)
-#define IMSM_PPOINT_RECORD_(NAME, ITER, ...)    \
-        ((struct imsm_ppoint_record) {          \
-                .ppoint = IMSM_PPOINT(NAME),    \
-                .iteration = (ITER),            \
+#define IMSM_PPOINT_RECORD(NAME, ...)                                   \
+        IMSM_PPOINT_RECORD_WORKLOAD(IMSM_WORKLOAD_DEFAULT, NAME, ##__VA_ARGS__)
+
+#define IMSM_PPOINT_RECORD_WORKLOAD(WORKLOAD, NAME, ...)                \
+        IMSM_PPOINT_RECORD_(WORKLOAD, NAME, ##__VA_ARGS__, 0)
+#define IMSM_PPOINT_RECORD_(WORKLOAD, NAME, ITER, ...)  \
+        ((struct imsm_ppoint_record) {                  \
+                .ppoint = IMSM_PPOINT_WORKLOAD(WORKLOAD, NAME), \
+                .iteration = (ITER),                    \
          })
 
 #define IMSM_INDEX(NAME, ...)                                      \